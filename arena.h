@@ -284,12 +284,25 @@ typedef struct Arena_Allocation_s
 #endif /* ARENA_DEBUG */
 
 
+/* A region the arena has moved on from, kept so its pointers stay valid */
+typedef struct Arena_Region_s
+{
+    char *region;
+    size_t used;
+    struct Arena_Region_s *prev;
+} Arena_Region;
+
+
 typedef struct
 {
     char *region;
     size_t index;
     size_t size;
 
+    Arena_Region *retired;
+    size_t retired_used;
+    size_t peak;
+
     #ifdef ARENA_DEBUG
     unsigned long allocations;
     Arena_Allocation *head_allocation;
@@ -327,6 +340,21 @@ Parameters
 Arena* arena_expand(Arena *arena, size_t size);
 
 
+/*
+Give the arena a fresh region of the specified size
+without moving the current one. Unlike arena_expand,
+every pointer handed out so far stays valid; the old
+regions are released by arena_clear or arena_destroy.
+
+Parameters
+  Arena *arena    |    The arena being grown
+  size_t size     |    The size of the new region
+Return:
+  The arena on success, NULL on failure.
+*/
+Arena* arena_grow(Arena *arena, size_t size);
+
+
 /*
 Return a pointer to a portion of specified size of the
 specified arena's region. Nothing will restrict you
@@ -395,7 +423,9 @@ ARENA_INLINE size_t arena_copy(Arena *dest, Arena *src);
 /*
 Reset the pointer to the arena region to the beginning
 of the allocation. Allows reuse of the memory without
-realloc or frees.
+realloc or frees. Regions retired by arena_grow are
+freed, only the newest (largest) region is reused. The
+peak usage is kept.
 
 Parameters:
   Arena *arena    |    The arena to be cleared.
@@ -506,6 +536,9 @@ Arena* arena_create(size_t size)
 
     arena->index = 0;
     arena->size = size;
+    arena->retired = NULL;
+    arena->retired_used = 0;
+    arena->peak = 0;
 
     #ifdef ARENA_DEBUG
     arena->head_allocation = NULL;
@@ -534,6 +567,56 @@ Arena* arena_expand(Arena *arena, size_t size)
 }
 
 
+Arena* arena_grow(Arena *arena, size_t size)
+{
+    Arena_Region *retired;
+    char *region;
+
+    if (arena == NULL || size == 0)
+    {
+        return NULL;
+    }
+
+    retired = ARENA_MALLOC(sizeof(Arena_Region));
+    if (retired == NULL)
+    {
+        return NULL;
+    }
+
+    region = ARENA_MALLOC(size);
+    if (region == NULL)
+    {
+        ARENA_FREE(retired);
+        return NULL;
+    }
+
+    retired->region = arena->region;
+    retired->used = arena->index;
+    retired->prev = arena->retired;
+    arena->retired = retired;
+    arena->retired_used += arena->index;
+
+    arena->region = region;
+    arena->index = 0;
+    arena->size = size;
+    return arena;
+}
+
+
+static void arena_free_retired(Arena *arena)
+{
+    while (arena->retired != NULL)
+    {
+        Arena_Region *prev = arena->retired->prev;
+        ARENA_FREE(arena->retired->region);
+        ARENA_FREE(arena->retired);
+        arena->retired = prev;
+    }
+
+    arena->retired_used = 0;
+}
+
+
 ARENA_INLINE void* arena_alloc(Arena *arena, size_t size)
 {
     return arena_alloc_aligned(arena, size, ARENA_DEFAULT_ALIGNMENT);
@@ -542,7 +625,8 @@ ARENA_INLINE void* arena_alloc(Arena *arena, size_t size)
 
 void* arena_alloc_aligned(Arena *arena, size_t size, unsigned int alignment)
 {
-    unsigned int offset;
+    size_t aligned;
+    size_t offset;
 
     if (size == 0)
     {
@@ -554,30 +638,34 @@ void* arena_alloc_aligned(Arena *arena, size_t size, unsigned int alignment)
         return NULL;
     }
 
+    aligned = arena->index;
     if (alignment != 0)
     {
         offset = (size_t)(arena->region + arena->index) % alignment;
         if (offset > 0)
         {
-            arena->index = arena->index - offset + alignment;
+            aligned += alignment - offset;
         }
     }
-    else
-    {
-        offset = 0;
-    }
 
-    if (arena->size - (arena->index + offset) < size)
+    /* Rounding up can pass the end of the region, check without wrapping before moving the index */
+    if (aligned > arena->size || arena->size - aligned < size)
     {
         return NULL;
     }
 
+    arena->index = aligned;
+
     #ifdef ARENA_DEBUG
     arena_add_allocation(arena, size);
     #endif /* ARENA_DEBUG */
 
     arena->index += size;
-    return arena->region + (arena->index - size);
+    if (arena->retired_used + arena->index > arena->peak)
+    {
+        arena->peak = arena->retired_used + arena->index;
+    }
+    return arena->region + aligned;
 }
 
 
@@ -614,6 +702,7 @@ ARENA_INLINE void arena_clear(Arena *arena)
     }
 
     arena->index = 0;
+    arena_free_retired(arena);
 
     #ifdef ARENA_DEBUG
     arena_delete_allocation_list(arena);
@@ -636,6 +725,7 @@ ARENA_INLINE void arena_destroy(Arena *arena)
     {
         ARENA_FREE(arena->region);
     }
+    arena_free_retired(arena);
 
     ARENA_FREE(arena);
 }
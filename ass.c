@@ -1,5 +1,7 @@
-#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
 #define _XOPEN_SOURCE_EXTENDED
+/* MAP_ANONYMOUS, MAP_NORESERVE and madvise */
+#define _DEFAULT_SOURCE
 
 #include <assert.h>
 #include <stdio.h>
@@ -9,8 +11,25 @@
 #include <string.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define ARENA_IMPLEMENTATION
 #define ARENA_DEFAULT_ALIGNMENT sizeof(size_t)
@@ -20,46 +39,236 @@
 #include "lexer.h"
 #include "parser.h"
 #include "ass.h"
+#include "piss.h"
+#include "vm.h"
+#include "stream.h"
+#include "scheduler.h"
+#include "channel.h"
+#include "ffi.h"
+#include "batch.h"
+#include "lanes.h"
+#include "serve.h"
+
+const char *HELP = "Usage: ass [options] file ...\n"
+	"       ass [options] -      read the program from stdin\n"
+	"\n"
+	"Options:\n"
+	"  --pipeline    start running before the whole program is parsed, calls\n"
+	"                to externs wait until it parsed cleanly\n"
+	"  --pipeline-hold\n"
+	"                like --pipeline, but output and files also wait, so a\n"
+	"                program that fails to parse prints nothing but the errors\n"
+	"  --watch       re-assemble and re-run whenever the file changes\n"
+	"  --arena-stats print peak arena and heap usage to stderr\n"
+	"  --huge-pages  back large zero-filled data with huge pages\n"
+	"  --guard-pages catch stack overflows with guard pages instead of checks\n"
+	"  --sandbox     confine pointers to the program's own memory\n"
+	"  --batch FILE  run once per line of FILE, each run starts with a pointer\n"
+	"                to its line and the 8 byte length on the stack\n"
+	"  -j N          run N batch jobs at a time, one per processor by default\n"
+	"  --lanes N     run 8 or 16 batch jobs at once on each thread in lockstep,\n"
+	"                for programs that only use the plain arithmetic ops. It\n"
+	"                pays off when the jobs mostly take the same branches\n"
+	"  --workers N   run green threads on N threads, 1 by default\n"
+	"  --serve SOCKET\n"
+	"                run programs for --connect clients on a unix socket, keeping\n"
+	"                the most recently used ones parsed\n"
+	"  --connect SOCKET\n"
+	"                run file on a --serve daemon with this process's stdin,\n"
+	"                stdout and stderr. file may also be # and the hash the\n"
+	"                daemon logged for a program it has cached\n"
+	"  --stdin-line  with --connect, start the run like a --batch job with all\n"
+	"                of stdin as its line\n"
+	"  --stack-size N\n"
+	"                start with N bytes of operand stack\n"
+	"  --return-stack-size N\n"
+	"                start with N bytes of return stack\n";
+
+typedef struct MapEntry {
+	/* The integer key, or the hash of a byte string key */
+	uint64_t key;
+	uint64_t value;
+	/* Copy of a byte string key in the heap, NULL for integer keys */
+	byte *bytes;
+	size_t len;
+} MapEntry;
+
+#define MAP_GROUP 16
+#define MAP_EMPTY ((int8_t) -128)
+#define MAP_DELETED ((int8_t) -2)
+
+/*
+ * Open-addressed hash map behind the hm* opcodes. Each slot has a control
+ * byte holding 7 bits of its hash, or MAP_EMPTY or MAP_DELETED, so a probe
+ * checks a group of 16 slots with one compare and only looks at entries
+ * whose bits match.
+ */
+typedef struct Map {
+	int8_t *ctrl;
+	MapEntry *entries;
+	/* A power of two, at least MAP_GROUP */
+	size_t cap;
+	size_t len;
+	/* Full and deleted slots, rebuilt past 7/8 so every probe finds an empty slot */
+	size_t used;
+	/* The handle is in use */
+	bool live;
+} Map;
+
+/*
+ * With --sandbox, program pointers are 32-bit offsets into one reservation
+ * that holds every addressable byte: frame locals and the heap share the
+ * first quarter, the data segment regions get one each. The guard behind
+ * it is as large as the space itself, so adding any offset to the base
+ * lands inside the reservation and loads and stores need no compare.
+ * Stacks can't be addressed and stay outside.
+ */
+#define SANDBOX_SIZE ((size_t) 1 << 32)
+#define SANDBOX_QUARTER (SANDBOX_SIZE / 4)
+/* Offset 0 and the rest of the first megabyte stay unmapped to catch null */
+#define SANDBOX_LOCALS ((size_t) 1 << 20)
+#define SANDBOX_HEAP ((size_t) 1 << 26)
+
+typedef struct Section {
+	size_t row;
+	enum ParserState state;
+} Section;
+
+/*
+ * Jump labels and section directives by position, so --watch can re-parse
+ * only the lines that changed and patch the program in place.
+ */
+typedef struct SourceMap {
+	/* Label of each jump, parallel to the instructions, NULL for everything else */
+	const char **names;
+	size_t cap;
+	size_t len;
 
-const char *HELP = "Usage: ass [options] file ...\n";
+	Section *sections;
+	size_t section_cap;
+	size_t section_len;
+} SourceMap;
 
-typedef struct FramePointer {
-	byte *ptr;
-	byte *return_stack_ptr;
-	byte *start;
-	byte locals[LOCAL_SIZE];
-	struct FramePointer *prev;
-} FramePointer;
+typedef struct Watch {
+	const char *path;
+	char *src;
+	size_t len;
+	size_t lines;
+	struct timespec mtime;
+	off_t size;
+	/* An edit left the program unresolved, the next one re-parses everything */
+	bool stale;
+} Watch;
 
-typedef struct Ctx {
-	byte stack[STACK_SIZE];
-	byte return_stack[STACK_SIZE];
-	FramePointer *frame_ptr;
-	size_t pc;
+#define WATCH_POLL_NS (100 * 1000 * 1000)
+/* Every splice keeps its arena, past this many bytes the next edit re-parses everything */
+#define WATCH_SPLICE_MAX (1024 * 1024 * 4)
 
-	DeclarationMap declaration_map;
-	LabelMap label_map;
+typedef struct ParseError {
+	Span span;
+	const char *error;
+} ParseError;
 
-	Instruction **instructions;
-	size_t instruction_cap;
-	size_t instruction_len;
-} Ctx;
+/*
+ * A newline-delimited slice of the source parsed by its own worker.
+ *
+ * Every chunk except the first starts out assuming `PARSE_TEXT`; if the
+ * previous chunk ends up in a different section, the chunk is re-parsed
+ * with the correct state during the merge.
+ */
+typedef struct ParseChunk {
+	const char *path;
+	/* Read with pread from `offset`, shared by the chunks of one file. -1 reads it in order */
+	FILE *file;
+	off_t offset;
+	size_t len;
+	enum ParserState state;
+	enum ParserState end_state;
+	size_t rows;
 
+	Arena *arena;
+	Program program;
+	ParseError *errors;
+	size_t error_cap;
+	size_t error_len;
+	SourceMap *source_map;
+	size_t scratch_peak;
+	/* Reject what --sandbox can't contain */
+	bool sandboxed;
+
+	pthread_t thread;
+} ParseChunk;
+
+/*
+ * Instructions handed from the parser thread to the interpreter.
+ *
+ * The parser appends to and patches the context's program, which may
+ * reallocate. Resolved instructions are copied into blocks that are
+ * append-only and never move, so the interpreter can run (and jump back
+ * into) earlier instructions while the parser fills later ones.
+ * `published` only ever covers the prefix whose jumps and loads are all
+ * resolved, the interpreter waits when it runs into the end of it.
+ * Until the parse is `done` callext waits, the extern table can still
+ * grow. With `hold` the program's output is held back as well and the
+ * other instructions that reach outside the process wait, so a program
+ * with a parse error shows nothing but its errors.
+ */
+typedef struct Pipeline {
+	uint8_t **op_blocks;
+	union InstructionData **imm_blocks;
+	/* First instruction still waiting on a label or declaration */
+	size_t frontier;
+	byte *unresolved;
+	size_t unresolved_cap;
+
+	size_t published;
+	int waiting;
+	bool done;
+	int errcode;
+	bool hold;
+	/* Only touched by the interpreter, until it has seen `done` */
+	bool parsing;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	Ctx *context;
+	Arena *arena;
+	const char *path;
+	FILE *file;
+	size_t file_len;
+	pthread_t thread;
+} Pipeline;
+
+#define PIPELINE_BLOCK_SIZE 4096
+#define PIPELINE_BLOCK_MAX (1024 * 64)
+#define PIPELINE_SPIN 64
+
+/* Files smaller than this are not worth splitting */
+#define PARALLEL_PARSE_MIN (1024 * 1024 * 4)
+#define PARALLEL_CHUNK_MIN (1024 * 1024)
+#define PARALLEL_CHUNK_MAX 64
+
+/*
+ * Grows by starting a new region rather than reallocating, so nodes and
+ * instructions handed out earlier never move.
+ */
 void *_arena_xalloc(char *filename, int row, Arena *arena, size_t size)
 {
-	if (arena->index + size > arena->size) {
+	void *block = arena_alloc(arena, size);
+	if (!block) {
 		size_t old_size = arena->size;
 		size_t new_size = arena->size * 2;
+		if (new_size < size + ARENA_DEFAULT_ALIGNMENT) new_size = size + ARENA_DEFAULT_ALIGNMENT;
 #ifdef DEBUG_TRACE
 		fprintf(stderr, "%s:%d:DEBUG:attempting to growing arena... %lu => %lu\n", filename, row, old_size, new_size);
 #endif
-		if (!arena_expand(arena, new_size)) {
-			fprintf(stderr, "%s:%d:ERROR:failed to expand arena... %lu => %lu\n", filename, row, old_size, new_size);
+		if (!arena_grow(arena, new_size)) {
+			fprintf(stderr, "%s:%d:ERROR:failed to grow arena... %lu => %lu\n", filename, row, old_size, new_size);
 			abort();
 		}
+		block = arena_alloc(arena, size);
 	}
 
-	void *block = arena_alloc(arena, size);
 	assert(block);
 	return block;
 }
@@ -89,8 +298,85 @@ static void print_help(void)
 	fputs(HELP, stdout);
 }
 
-static bool insert_label(LabelMap *label_map, const char *name, size_t location)
+static void label_map_init(LabelMap *label_map)
+{
+	*label_map = (LabelMap){
+		.labels = xmalloc(sizeof(*label_map->labels) * 16),
+		.cap = 16,
+		.len = 0,
+		.buckets = calloc(32, sizeof(*label_map->buckets)),
+		.bucket_cap = 32,
+		.fixups = xmalloc(sizeof(*label_map->fixups) * 16),
+		.fixup_cap = 16,
+		.fixup_len = 0,
+	};
+	if (!label_map->buckets) panic("Failed to allocate label buckets\n");
+}
+
+static void label_map_clear(LabelMap *label_map)
+{
+	label_map->len = 0;
+	label_map->fixup_len = 0;
+	memset(label_map->buckets, 0, sizeof(*label_map->buckets) * label_map->bucket_cap);
+}
+
+static void label_map_destroy(LabelMap *label_map)
+{
+	free(label_map->labels);
+	free(label_map->buckets);
+	free(label_map->fixups);
+}
+
+static size_t hash_str(const char *s)
+{
+	size_t hash = 14695981039346656037UL;
+	for (; *s; ++s) {
+		hash ^= (unsigned char) *s;
+		hash *= 1099511628211UL;
+	}
+	return hash;
+}
+
+static void label_map_rehash(LabelMap *label_map)
+{
+	size_t cap = label_map->bucket_cap * 2;
+	size_t *buckets = calloc(cap, sizeof(*buckets));
+	if (!buckets) panic("Failed to allocate label buckets\n");
+	for (size_t i = 0; i < label_map->len; ++i) {
+		size_t b = hash_str(label_map->labels[i].name) & (cap - 1);
+		while (buckets[b]) b = (b + 1) & (cap - 1);
+		buckets[b] = i + 1;
+	}
+	free(label_map->buckets);
+	label_map->buckets = buckets;
+	label_map->bucket_cap = cap;
+}
+
+/* Bucket of the label named `name`, or the empty one it would go in */
+static size_t label_map_probe(LabelMap *label_map, const char *name)
+{
+	size_t mask = label_map->bucket_cap - 1;
+	size_t b = hash_str(name) & mask;
+	for (; label_map->buckets[b]; b = (b + 1) & mask) {
+		Label *label = &label_map->labels[label_map->buckets[b] - 1];
+		// TODO: Intern
+		if (strcmp(name, label->name) == 0) break;
+	}
+	return b;
+}
+
+Label *label_map_find(LabelMap *label_map, const char *name)
 {
+	size_t b = label_map_probe(label_map, name);
+	return label_map->buckets[b] ? &label_map->labels[label_map->buckets[b] - 1] : NULL;
+}
+
+/* Find the label named `name`, adding it as undefined if it is not there yet */
+static Label *label_map_get(LabelMap *label_map, const char *name)
+{
+	size_t b = label_map_probe(label_map, name);
+	if (label_map->buckets[b]) return &label_map->labels[label_map->buckets[b] - 1];
+
 	if (label_map->len >= label_map->cap) {
 		label_map->cap *= 2;
 		label_map->labels =
@@ -98,447 +384,2892 @@ static bool insert_label(LabelMap *label_map, const char *name, size_t location)
 	}
 	label_map->labels[label_map->len++] = (Label){
 		.name = name,
-		.location = location,
+		.location = LABEL_UNDEFINED,
+		.row = 0,
+		.fixup = FIXUP_NONE,
 	};
-	return true;
+	label_map->buckets[b] = label_map->len;
+	if (label_map->len * 2 > label_map->bucket_cap) label_map_rehash(label_map);
+	return &label_map->labels[label_map->len - 1];
 }
 
-static bool insert_declaration(DeclarationMap *declaration_map, Declaration declaration)
+static void program_init(Program *program)
 {
-	if (declaration_map->len >= declaration_map->cap) {
-		declaration_map->cap *= 2;
-		declaration_map->declarations =
-			xrealloc(declaration_map->declarations, sizeof(*declaration_map->declarations) * declaration_map->cap);
-	}
-	declaration_map->declarations[declaration_map->len++] = declaration;
-	return true;
+	program->ops = xmalloc(sizeof(*program->ops) * 16);
+	program->imms = xmalloc(sizeof(*program->imms) * 16);
+	program->rows = xmalloc(sizeof(*program->rows) * 16);
+	program->cap = 16;
+	program->len = 0;
+	program->stack = (StackSizes){0};
+
+	label_map_init(&program->label_map);
+
+	program->declaration_map = (DeclarationMap){
+		.declarations = xmalloc(sizeof(*program->declaration_map.declarations) * 16),
+		.cap = 16,
+		.len = 0,
+	};
 }
 
-static FramePointer *context_push_frame(Ctx *context)
+/* Drop every instruction, label and declaration but keep the storage */
+static void program_clear(Program *program)
 {
-	FramePointer *p = xmalloc(sizeof(FramePointer));
-	if (context->frame_ptr) {
-		p->prev = context->frame_ptr;
-		p->start = context->frame_ptr->ptr;
-		p->ptr = context->frame_ptr->ptr;
-	}
-	context->frame_ptr = p;
-	return context->frame_ptr;
+	program->declaration_map.len = 0;
+	program->len = 0;
+	program->stack = (StackSizes){0};
+	label_map_clear(&program->label_map);
 }
 
-static FramePointer *context_pop_frame(Ctx *context)
+static void program_destroy(Program *program)
 {
-	if (!context->frame_ptr->prev) return NULL;
-	FramePointer *p = context->frame_ptr;
-	context->frame_ptr = context->frame_ptr->prev;
-	free(p);
-	return context->frame_ptr;
+	free(program->ops);
+	free(program->imms);
+	free(program->rows);
+	label_map_destroy(&program->label_map);
+	free(program->declaration_map.declarations);
 }
 
-static bool is_empty_stack(Ctx *context, size_t n)
+static void program_reserve(Program *program, size_t len)
 {
-	return (context->frame_ptr->ptr - n) < context->frame_ptr->start;
+	if (program->cap >= len) return;
+	while (program->cap < len) program->cap *= 2;
+	program->ops = xrealloc(program->ops, sizeof(*program->ops) * program->cap);
+	program->imms = xrealloc(program->imms, sizeof(*program->imms) * program->cap);
+	program->rows = xrealloc(program->rows, sizeof(*program->rows) * program->cap);
 }
 
-static void dump_stack(Ctx *context)
+static void patch_jump(Program *program, size_t i, size_t location)
 {
-	for (size_t i = 0; i < STACK_SIZE; ++i) {
-		fprintf(stderr, "%d,", context->stack[i]);
+	ssize_t offset = location - i - 1;
+	if (instruction_info[program->ops[i]].shape == OPERAND_PROC) {
+		program->imms[i].proc.location.offset = offset;
+	} else {
+		program->imms[i].offset = offset;
 	}
 }
 
-static void push_stack(Ctx *context, void *data, size_t size)
+static ssize_t jump_offset(Program *program, size_t i)
 {
-	if (context->frame_ptr->ptr - context->stack + size >= STACK_SIZE) {
-		dump_stack(context);
-		panic("Stack overflow! Dumping stack\n");
-	}
-	byte *ptr = context->frame_ptr->ptr;
-	memcpy(ptr, data, size);
-	context->frame_ptr->ptr += size;
+	if (instruction_info[program->ops[i]].shape == OPERAND_PROC) return program->imms[i].proc.location.offset;
+	return program->imms[i].offset;
 }
 
-static void *pop_stack(Ctx *context, size_t n)
+static const char *jump_label(Program *program, size_t i)
 {
-	context->frame_ptr->ptr -= n;
-	byte *top = context->frame_ptr->ptr;
-	return top;
+	if (instruction_info[program->ops[i]].shape == OPERAND_PROC) return program->imms[i].proc.location.s;
+	return program->imms[i].s;
 }
 
-#define TYOP_INST(ty, prefix, printf_str)                      \
-	case I_##prefix##PUSH: {                               \
-		void *data = &instruction->data.lit.data;      \
-		push_stack(context, data, sizeof(ty));         \
-		break;                                         \
-	}                                                      \
-	case I_##prefix##ADD: {                                \
-		STACK_CHECK(sizeof(ty) * 2);                   \
-		ty *b = pop_stack(context, sizeof(*b));        \
-		ty *a = pop_stack(context, sizeof(*a));        \
-		ty item = *a + *b;                             \
-		push_stack(context, &item, sizeof(item));      \
-		break;                                         \
-	}                                                      \
-	case I_##prefix##SUB: {                                \
-		STACK_CHECK(sizeof(ty) * 2);                   \
-		ty *b = pop_stack(context, sizeof(*b));        \
-		ty *a = pop_stack(context, sizeof(*a));        \
-		ty item = *a - *b;                             \
-		push_stack(context, &item, sizeof(item));      \
-		break;                                         \
-	}                                                      \
-	case I_##prefix##MULT: {                               \
-		STACK_CHECK(sizeof(ty) * 2);                   \
-		ty *b = pop_stack(context, sizeof(*b));        \
-		ty *a = pop_stack(context, sizeof(*a));        \
-		ty item = *a * *b;                             \
-		push_stack(context, &item, sizeof(item));      \
-		break;                                         \
-	}                                                      \
-	case I_##prefix##DIV: {                                \
-		STACK_CHECK(sizeof(ty) * 2);                   \
-		ty *b = pop_stack(context, sizeof(*b));        \
-		ty *a = pop_stack(context, sizeof(*a));        \
-		ty item = *a / *b;                             \
-		push_stack(context, &item, sizeof(item));      \
-		break;                                         \
-	}                                                      \
-	case I_##prefix##PRINT: {                              \
-		STACK_CHECK(sizeof(ty));                       \
-		byte *stack_ptr = context->frame_ptr->ptr;     \
-		ty *a = (ty *)(&stack_ptr[-sizeof(*a)]);       \
-		printf(printf_str, *a);                        \
-		break;                                         \
-	}                                                      \
-	case I_##prefix##CEQ: {                                \
-		STACK_CHECK(sizeof(ty) * 2);                   \
-		byte *stack_ptr = context->frame_ptr->ptr;     \
-		ty *b = (ty *)(&stack_ptr[-(sizeof(*b) * 1)]); \
-		ty *a = (ty *)(&stack_ptr[-(sizeof(*a) * 2)]); \
-		bool item = *a == *b;                          \
-		push_stack(context, &item, 1);                 \
-		break;                                         \
-	}                                                      \
-	case I_##prefix##CLT: {                                \
-		STACK_CHECK(sizeof(ty) * 2);                   \
-		byte *stack_ptr = context->frame_ptr->ptr;     \
-		ty *b = (ty *)&stack_ptr[-(sizeof(*b) * 1)];   \
-		ty *a = (ty *)&stack_ptr[-(sizeof(*a) * 2)];   \
-		bool item = *a < *b;                           \
-		push_stack(context, &item, 1);                 \
-		break;                                         \
-	}                                                      \
-	case I_##prefix##CLE: {                                \
-		STACK_CHECK(sizeof(ty) * 2);                   \
-		byte *stack_ptr = context->frame_ptr->ptr;     \
-		ty *b = (ty *)&stack_ptr[-(sizeof(*b) * 1)];   \
-		ty *a = (ty *)&stack_ptr[-(sizeof(*a) * 2)];   \
-		bool item = *a <= *b;                          \
-		push_stack(context, &item, 1);                 \
-		break;                                         \
-	}                                                      \
-	case I_##prefix##CGT: {                                \
-		STACK_CHECK(sizeof(ty) * 2);                   \
-		byte *stack_ptr = context->frame_ptr->ptr;     \
-		ty *b = (ty *)&stack_ptr[-(sizeof(*b) * 1)];   \
-		ty *a = (ty *)&stack_ptr[-(sizeof(*a) * 2)];   \
-		bool item = *a > *b;                           \
-		push_stack(context, &item, 1);                 \
-		break;                                         \
-	}                                                      \
-	case I_##prefix##CGE: {                                \
-		STACK_CHECK(sizeof(ty) * 2);                   \
-		byte *stack_ptr = context->frame_ptr->ptr;     \
-		ty *b = (ty *)&stack_ptr[-(sizeof(*b) * 1)];   \
-		ty *a = (ty *)&stack_ptr[-(sizeof(*a) * 2)];   \
-		bool item = *a >= *b;                          \
-		push_stack(context, &item, 1);                 \
-		break;                                         \
-	}
+static bool is_jump(enum InstructionKind kind)
+{
+	return kind == I_JUMP || kind == I_JUMPCMP || kind == I_JUMPPROC || kind == I_SPAWN || kind == I_PARFOR;
+}
 
-/* Integer types also have `mod` operation */
-#define ITYOP_INST(ty, prefix, printf_str)                \
-	TYOP_INST(ty, prefix, printf_str)                 \
-	case I_##prefix##MOD: {                           \
-		STACK_CHECK(sizeof(ty) * 2);              \
-		ty *b = pop_stack(context, sizeof(*b));   \
-		ty *a = pop_stack(context, sizeof(*a));   \
-		ty item = *a % *b;                        \
-		push_stack(context, &item, sizeof(item)); \
-		break;                                    \
-	}                                                 \
+/*
+ * Resolve the jump at `i` right away if its label has been seen, otherwise
+ * chain it on the label to be backpatched once the label shows up.
+ */
+static bool reference_label(Program *program, const char *name, size_t i)
+{
+	LabelMap *label_map = &program->label_map;
+	Label *label = label_map_get(label_map, name);
+	if (label->location != LABEL_UNDEFINED) {
+		patch_jump(program, i, label->location);
+		return true;
+	}
 
-#define OPN_INST(ty, suffix)                                                                     \
-	case I_PDEREF##suffix: {                                                                 \
-		STACK_CHECK(sizeof(ty *));                                                       \
-		ty **item = pop_stack(context, sizeof(*item));                                   \
-		push_stack(context, *item, sizeof(**item));                                      \
-		break;                                                                           \
-	}                                                                                        \
-	case I_PSET##suffix: {                                                                   \
-		STACK_CHECK(sizeof(ty *) + sizeof(ty));                                          \
-		ty **a = pop_stack(context, sizeof(*a));                                         \
-		ty *b = pop_stack(context, sizeof(*b));                                          \
-		**a = *b;                                                                        \
-		break;                                                                           \
-	}                                                                                        \
-	case I_POP##suffix: {                                                                    \
-		STACK_CHECK(sizeof(ty));                                                         \
-		pop_stack(context, sizeof(ty));                                                  \
-		break;                                                                           \
-	}                                                                                        \
-	case I_SWAP##suffix: {                                                                   \
-		STACK_CHECK(sizeof(ty) * 2);                                                     \
-		byte *a = pop_stack(context, sizeof(ty));                                        \
-		byte *b = pop_stack(context, sizeof(ty));                                        \
-		byte tmp[sizeof(ty)] = {0};                                                      \
-		memcpy(tmp, b, sizeof(ty));                                                      \
-		push_stack(context, a, sizeof(ty));                                              \
-		push_stack(context, tmp, sizeof(ty));                                            \
-		break;                                                                           \
-	}                                                                                        \
-	case I_DUPE##suffix: {                                                                   \
-		STACK_CHECK(sizeof(ty));                                                         \
-		byte *stack_ptr = context->frame_ptr->ptr;                                       \
-		byte *a = &stack_ptr[-sizeof(ty)];                                               \
-		push_stack(context, a, sizeof(ty));                                              \
-		break;                                                                           \
-	}                                                                                        \
-	case I_COPY##suffix: {                                                                   \
-		STACK_CHECK(sizeof(ty));                                                         \
-		byte *stack_ptr = context->frame_ptr->ptr;                                       \
-		byte *a = &stack_ptr[-sizeof(ty)];                                               \
-		size_t n = instruction->data.n;                                                  \
-		for (size_t i = 0; i < n; ++i) {                                                 \
-			push_stack(context, a, sizeof(ty));                                      \
-		}                                                                                \
-		break;                                                                           \
-	}                                                                                        \
-	case I_STORE##suffix: {                                                                  \
-		STACK_CHECK(sizeof(ty));                                                         \
-		size_t n = instruction->data.n;                                                  \
-		byte *locals = context->frame_ptr->locals;                                       \
-		byte *slot = &locals[n];                                                         \
-		byte *a = pop_stack(context, sizeof(ty));                                        \
-		memcpy(slot, a, sizeof(ty));                                                     \
-		break;                                                                           \
-	}                                                                                        \
-	case I_LOAD##suffix: {                                                                   \
-		size_t n = instruction->data.n;                                                  \
-		byte *locals = context->frame_ptr->locals;                                       \
-		byte *slot = &locals[n];                                                         \
-		push_stack(context, slot, sizeof(ty));                                           \
-		break;                                                                           \
-	}                                                                                        \
-	case I_RET##suffix: {                                                                    \
-		STACK_CHECK(sizeof(ty));                                                         \
-		FramePointer *stack_ptr = context->frame_ptr;                                    \
-		FramePointer *stack_ptr_prev = stack_ptr->prev;                                  \
-		size_t return_addr = *(size_t *)(&stack_ptr->return_stack_ptr[-sizeof(size_t)]); \
-		byte *a = pop_stack(context, sizeof(ty));                                        \
-		byte tmp[sizeof(ty)] = {0};                                                      \
-		memcpy(tmp, a, sizeof(ty));                                                      \
-		context->frame_ptr = stack_ptr_prev;                                             \
-		context->pc = return_addr;                                                       \
-		free(stack_ptr);                                                                 \
-		push_stack(context, tmp, sizeof(ty));                                            \
-		break;                                                                           \
-	}                                                                                        \
+	if (label_map->fixup_len >= label_map->fixup_cap) {
+		label_map->fixup_cap *= 2;
+		label_map->fixups =
+			xrealloc(label_map->fixups, sizeof(*label_map->fixups) * label_map->fixup_cap);
+	}
+	label_map->fixups[label_map->fixup_len] = (Fixup){
+		.instruction = i,
+		.next = label->fixup,
+	};
+	label->fixup = label_map->fixup_len++;
+	return false;
+}
 
-static void exec_instruction(Ctx *context, Instruction *instruction)
+/* Define a label, backpatching the jumps waiting on it */
+static bool insert_label(Program *program, const char *name, size_t location, size_t row)
 {
-#define STACK_CHECK(n) do { if (is_empty_stack(context, n)) goto empty_stack; } while(0)
+	LabelMap *label_map = &program->label_map;
+	Label *label = label_map_get(label_map, name);
+	/* First definition wins */
+	if (label->location != LABEL_UNDEFINED) return true;
 
-	switch (instruction->kind) {
-	case I_PPUSH: {
-		void *item = instruction->data.ptr;
-		push_stack(context, &item, sizeof(item));
-		break;
+	label->location = location;
+	label->row = row;
+	for (size_t f = label->fixup; f != FIXUP_NONE; f = label_map->fixups[f].next) {
+		size_t i = label_map->fixups[f].instruction;
+		patch_jump(program, i, location);
 	}
-	case I_PLOAD: {
-		void *data_ptr = instruction->data.ptr;
-		push_stack(context, &data_ptr, sizeof(data_ptr));
+	label->fixup = FIXUP_NONE;
+	return true;
+}
 
-		size_t n = instruction->data.n;
-		byte *locals = context->frame_ptr->locals;
-		byte *slot = &locals[n];
-		push_stack(context, &slot, sizeof(slot));
-		break;
+static size_t page_round(size_t n)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (n + page - 1) / page * page;
+}
+
+/* Reserve address space for a region, settling for less if the system refuses */
+static void data_region_reserve(DataRegion *region)
+{
+	for (size_t cap = DATA_RESERVE_MAX; cap >= DATA_RESERVE_MIN; cap /= 2) {
+		void *base = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (base != MAP_FAILED) {
+			region->base = base;
+			region->cap = cap;
+			return;
+		}
 	}
-	ITYOP_INST(unsigned long, UL, "%lu")
-	ITYOP_INST(int, I, "%d")
-	ITYOP_INST(char, C, "%c")
-	TYOP_INST(float, F, "%f")
-	OPN_INST(int8_t, 8)
-	OPN_INST(int32_t, 32)
-	OPN_INST(int64_t, 64)
-#undef OPN_INST
-#undef TYOP_INST
-#undef ITYOP_INST
+	panic("Failed to reserve the data segment\n");
+}
 
-	case I_CIPRINT: {
-		STACK_CHECK(sizeof(char));
-		byte *stack_ptr = context->frame_ptr->ptr;
-		char *a = (char *)(&stack_ptr[-sizeof(*a)]);
-		printf("%d", *a);
-		break;
+static byte *data_region_alloc(DataRegion *region, size_t len, size_t align)
+{
+	if (!region->base) data_region_reserve(region);
+	size_t offset = (region->len + align - 1) / align * align;
+	if (offset + len > region->cap) panic("Data segment is full\n");
+	region->len = offset + len;
+	return region->base + offset;
+}
+
+/* Swap the used pages for fresh ones, which read as zero and are committed lazily */
+static void data_region_zero(DataRegion *region, bool huge_pages)
+{
+	size_t len = page_round(region->len);
+	if (!len) return;
+	void *base = mmap(region->base, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+	if (base == MAP_FAILED) panic("Failed to reset the data segment\n");
+#ifdef MADV_HUGEPAGE
+	if (huge_pages) madvise(region->base, len, MADV_HUGEPAGE);
+#else
+	(void) huge_pages;
+#endif
+}
+
+/*
+ * Map the file over its own pages of the `files` region. Nothing is read
+ * up front, the program only faults in the pages it touches.
+ */
+static bool data_segment_map_file(DataSegment *segment, Declaration *declaration)
+{
+	int flags = O_RDONLY;
+	int prot = PROT_READ;
+	if (declaration->shared) {
+		flags = O_RDWR;
+		prot |= PROT_WRITE;
 	}
-	case I_RET: {
-		FramePointer *stack_ptr = context->frame_ptr;
-		FramePointer *stack_ptr_prev = stack_ptr->prev;
-		size_t n = instruction->data.n;
-		STACK_CHECK(n);
-		size_t return_addr = *(size_t *)(&stack_ptr->return_stack_ptr[-sizeof(size_t)]);
-		byte *a = pop_stack(context, n);
-		byte tmp[n];
-		memcpy(tmp, a, n);
-		context->frame_ptr = stack_ptr_prev;
-		context->pc = return_addr;
-		free(stack_ptr);
-		push_stack(context, tmp, n);
-		break;
+	int fd = open(declaration->path, flags);
+	if (fd < 0) return false;
+	struct stat sb;
+	if (fstat(fd, &sb) < 0) {
+		close(fd);
+		return false;
 	}
-	case I_JUMPPROC: {
-		size_t argc = instruction->data.proc.argc;
-		FramePointer *stack_ptr = context->frame_ptr;
-		FramePointer *stack_ptr_new = xmalloc(sizeof(FramePointer));
-		// Move previous stack frame
-		stack_ptr->ptr -= argc;
-		stack_ptr_new->ptr = stack_ptr->ptr;
-		stack_ptr_new->start = stack_ptr->start;
-		stack_ptr_new->return_stack_ptr = stack_ptr->return_stack_ptr;
-		stack_ptr_new->prev = stack_ptr;
-		context->frame_ptr = stack_ptr_new;
-		// Push pc onto return stack
-		*(size_t *)stack_ptr_new->return_stack_ptr = context->pc;
-		stack_ptr_new->return_stack_ptr += sizeof(size_t);
-
-		context->pc += instruction->data.proc.location.offset;
-		// Initial locals with args
-		memcpy(stack_ptr_new->locals, stack_ptr_new->ptr, argc);
-		break;
+
+	declaration->len = sb.st_size;
+	size_t len = page_round(declaration->len);
+	declaration->bytes = data_region_alloc(&segment->files, len, sysconf(_SC_PAGESIZE));
+	if (len) {
+		int share = declaration->shared ? MAP_SHARED : MAP_PRIVATE;
+		if (mmap(declaration->bytes, len, prot, share | MAP_FIXED, fd, 0) == MAP_FAILED) {
+			int err = errno;
+			close(fd);
+			errno = err;
+			return false;
+		}
 	}
-	case I_JUMP: {
-		context->pc += instruction->data.offset;
-		break;
+	close(fd);
+	return true;
+}
+
+/* Sets errno when a file-backed declaration can't be mapped */
+static bool data_segment_place(DataSegment *segment, Declaration *declaration)
+{
+	if (declaration->kind == D_EXTERN) {
+		declaration->bytes = extern_symbol(declaration->ident);
+		return true;
 	}
-	case I_JUMPCMP: {
-		STACK_CHECK(1);
-		byte *ptr = &context->frame_ptr->ptr[-1];
-		if (*ptr) {
-			context->pc += instruction->data.offset;
-			break;
-		}
-		break;
+	if (declaration->path) return data_segment_map_file(segment, declaration);
+	if (declaration->init) {
+		declaration->bytes = data_region_alloc(&segment->rodata, declaration->len, declaration->align);
+		memcpy(declaration->bytes, declaration->init, declaration->len);
+		return true;
 	}
-	default:
-		fprintf(stderr, "%s: {%d:UNIMPLMEMENTED:%d\n", __FILE__, __LINE__, instruction->kind);
+
+	size_t align = declaration->align;
+	if (segment->huge_pages && declaration->len >= DATA_HUGE_PAGE) align = DATA_HUGE_PAGE;
+	bool reserved = segment->bss.base != NULL;
+	declaration->bytes = data_region_alloc(&segment->bss, declaration->len, align);
+#ifdef MADV_HUGEPAGE
+	if (!reserved && segment->huge_pages) madvise(segment->bss.base, segment->bss.cap, MADV_HUGEPAGE);
+#else
+	(void) reserved;
+#endif
+	return true;
+}
+
+/* Write back every shared file mapping */
+static void data_segment_sync(DataSegment *segment)
+{
+	size_t len = page_round(segment->files.len);
+	if (len && msync(segment->files.base, len, MS_SYNC) < 0) {
+		fprintf(stderr, "Failed to sync file-backed data: %s\n", strerror(errno));
 	}
+}
 
-	return;
-empty_stack:
-	puts("Stack is empty\n");
-	return;
+/* Called once the last declaration is placed */
+static void data_segment_seal(DataSegment *segment)
+{
+	size_t len = page_round(segment->rodata.len);
+	if (len && mprotect(segment->rodata.base, len, PROT_READ) < 0) {
+		panic("Failed to seal the data segment\n");
+	}
+}
 
-#undef STACK_CHECK
+/* Drop every declaration, the regions stay reserved */
+static void data_segment_clear(DataSegment *segment)
+{
+	data_segment_sync(segment);
+	data_region_zero(&segment->rodata, false);
+	data_region_zero(&segment->bss, segment->huge_pages);
+	data_region_zero(&segment->files, false);
+	segment->rodata.len = 0;
+	segment->bss.len = 0;
+	segment->files.len = 0;
 }
 
-static void context_init(Ctx *context)
+static void data_segment_destroy(DataSegment *segment)
 {
-	context_push_frame(context);
-	context->frame_ptr->ptr = context->stack;
-	context->frame_ptr->start = context->stack;
-	context->frame_ptr->return_stack_ptr = context->return_stack;
-	context->frame_ptr->prev = NULL;
+	if (segment->rodata.base) munmap(segment->rodata.base, segment->rodata.cap);
+	if (segment->bss.base) munmap(segment->bss.base, segment->bss.cap);
+	if (segment->files.base) munmap(segment->files.base, segment->files.cap);
+}
 
-	context->instructions = xmalloc(sizeof(*context->instructions) * 16);
-	context->instruction_cap = 16;
-	context->instruction_len = 0;
+static size_t heap_class_size(size_t class)
+{
+	return (size_t) HEAP_MIN_CLASS << class;
+}
 
-	context->label_map = (LabelMap){
-		.labels = xmalloc(sizeof(*context->label_map.labels) * 16),
-		.cap = 16,
-		.len = 0,
-	};
+/* HEAP_CLASSES for blocks too large for a slab */
+static size_t heap_class(size_t len)
+{
+	size_t class = 0;
+	while (class < HEAP_CLASSES && len > heap_class_size(class)) ++class;
+	return class;
+}
 
-	context->declaration_map = (DeclarationMap){
-		.declarations = xmalloc(sizeof(*context->declaration_map.declarations) * 16),
-		.cap = 16,
-		.len = 0,
+/* `n` fresh chunks, NULL once the reservation is used up */
+static byte *heap_chunks(Heap *heap, size_t n)
+{
+	DataRegion *region = &heap->region;
+	if (!region->base) {
+		data_region_reserve(region);
+		/* Untouched pages of it cost nothing, workers look chunks up without the lock */
+		heap->chunk_cap = region->cap / HEAP_CHUNK;
+		heap->chunks = mmap(NULL, sizeof(*heap->chunks) * heap->chunk_cap, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (heap->chunks == MAP_FAILED) panic("Failed to reserve the heap\n");
+	}
+	if (n > (region->cap - region->len) / HEAP_CHUNK) return NULL;
+	return data_region_alloc(region, n * HEAP_CHUNK, HEAP_CHUNK);
+}
+
+static byte *heap_alloc_large(Heap *heap, size_t run)
+{
+	byte *p = NULL;
+	for (size_t i = 0; i < heap->run_len; ++i) {
+		HeapRun *free_run = &heap->runs[i];
+		if (free_run->run < run) continue;
+		p = heap->region.base + free_run->chunk * HEAP_CHUNK;
+		free_run->chunk += run;
+		free_run->run -= run;
+		if (!free_run->run) heap->runs[i] = heap->runs[--heap->run_len];
+		break;
+	}
+	if (!p) p = heap_chunks(heap, run);
+	if (!p) return NULL;
+
+	heap->chunks[(p - heap->region.base) / HEAP_CHUNK] = (HeapChunk){
+		.kind = HEAP_LARGE,
+		.run = run,
 	};
+	++heap->large_allocs;
+	++heap->large_live;
+	heap->live += run * HEAP_CHUNK;
+	return p;
+}
+
+/* Offset of a free block of `class` from its free list or a new slab, SIZE_MAX when the heap is full */
+static size_t heap_take(Heap *heap, size_t class)
+{
+	HeapClass *c = &heap->classes[class];
+	if (c->free_len) return c->free[--c->free_len];
 
-	context->pc = 0;
+	size_t size = heap_class_size(class);
+	if (c->next == c->end) {
+		byte *slab = heap_chunks(heap, 1);
+		if (!slab) return SIZE_MAX;
+		size_t words = (HEAP_CHUNK / size + 63) / 64;
+		HeapChunk *chunk = &heap->chunks[(slab - heap->region.base) / HEAP_CHUNK];
+		*chunk = (HeapChunk){
+			.kind = HEAP_SLAB,
+			.class = class,
+			.used = xmalloc(sizeof(*chunk->used) * words),
+		};
+		memset(chunk->used, 0, sizeof(*chunk->used) * words);
+		c->next = slab - heap->region.base;
+		c->end = c->next + HEAP_CHUNK;
+	}
+	size_t offset = c->next;
+	c->next += size;
+	return offset;
 }
 
-static void context_destroy(Ctx *context)
+static void heap_give(Heap *heap, size_t class, size_t offset)
 {
-	while (context->frame_ptr) {
-		FramePointer *p = context->frame_ptr;
-		context->frame_ptr = context->frame_ptr->prev;
-		free(p);
+	HeapClass *c = &heap->classes[class];
+	if (c->free_len >= c->free_cap) {
+		c->free_cap = c->free_cap ? c->free_cap * 2 : 64;
+		c->free = xrealloc(c->free, sizeof(*c->free) * c->free_cap);
 	}
-	free(context->label_map.labels);
-	free(context->declaration_map.declarations);
-	free(context->instructions);
+	c->free[c->free_len++] = offset;
+}
+
+/* Flip the slab block at `offset` to `used`, false when it already was */
+static bool heap_mark(Heap *heap, size_t offset, size_t size, bool used)
+{
+	HeapChunk *chunk = &heap->chunks[offset / HEAP_CHUNK];
+	size_t i = offset % HEAP_CHUNK / size;
+	uint64_t bit = (uint64_t) 1 << (i % 64);
+	/* Other workers flip neighbouring blocks without the lock */
+	uint64_t old = used ? __atomic_fetch_or(&chunk->used[i / 64], bit, __ATOMIC_RELAXED)
+		: __atomic_fetch_and(&chunk->used[i / 64], ~bit, __ATOMIC_RELAXED);
+	return !(old & bit) == used;
 }
 
-static void context_push_instruction(Ctx *context, Instruction *instruction)
+byte *heap_alloc(Heap *heap, size_t len)
 {
-	if (context->instruction_len >= context->instruction_cap) {
-		context->instruction_cap *= 2;
-		context->instructions =
-			xrealloc(context->instructions, sizeof(*context->instructions) * context->instruction_cap);
+	size_t class = heap_class(len);
+	if (class == HEAP_CLASSES) {
+		byte *p = heap_alloc_large(heap, (len + HEAP_CHUNK - 1) / HEAP_CHUNK);
+		if (heap->live > heap->peak) heap->peak = heap->live;
+		return p;
 	}
-	context->instructions[context->instruction_len++] = instruction;
+
+	size_t offset = heap_take(heap, class);
+	if (offset == SIZE_MAX) return NULL;
+	size_t size = heap_class_size(class);
+	heap_mark(heap, offset, size, true);
+	HeapClass *c = &heap->classes[class];
+	++c->allocs;
+	++c->live;
+	heap->live += size;
+	if (heap->live > heap->peak) heap->peak = heap->live;
+	return heap->region.base + offset;
 }
 
-// TODO: Use a map
-static bool label_location(Ctx *context, const char *label_name, ssize_t *location)
+/* Size of the live block starting at `p`, 0 when there is none */
+static size_t heap_block_size(Heap *heap, byte *p)
 {
-	LabelMap *label_map = &context->label_map;
-	for (size_t i = 0; i < label_map->len; ++i) {
-		Label *label = &label_map->labels[i];
-		// TODO: Intern
-		if (strcmp(label_name, label->name) == 0) {
-			*location = label->location;
-			return true;
-		}
+	DataRegion *region = &heap->region;
+	/* Chunks past the end are unused, so this doesn't read `len` that other workers grow */
+	if (!region->base || p < region->base || p >= region->base + region->cap) return 0;
+	size_t offset = p - region->base;
+	HeapChunk *chunk = &heap->chunks[offset / HEAP_CHUNK];
+	size_t within = offset % HEAP_CHUNK;
+	switch (chunk->kind) {
+	case HEAP_LARGE:
+		return within == 0 ? chunk->run * HEAP_CHUNK : 0;
+	case HEAP_SLAB: {
+		size_t size = heap_class_size(chunk->class);
+		size_t i = within / size;
+		if (within % size || !(__atomic_load_n(&chunk->used[i / 64], __ATOMIC_RELAXED) >> (i % 64) & 1)) return 0;
+		return size;
+	}
+	default:
+		return 0;
 	}
-	return false;
 }
 
-static bool resolve_load(Ctx *context, const char *data_name, void **data_ptr)
+/* False when `p` isn't a live block */
+static bool heap_free(Heap *heap, byte *p)
 {
-	DeclarationMap *declaration_map = &context->declaration_map;
-	for (size_t i = 0; i < declaration_map->len; ++i) {
-		Declaration *declaration = &declaration_map->declarations[i];
-		// TODO: Intern
-		if (strcmp(data_name, declaration->ident) == 0) {
-			*data_ptr = declaration->bytes;
-			return true;
+	size_t size = heap_block_size(heap, p);
+	if (!size) return false;
+	size_t offset = p - heap->region.base;
+	HeapChunk *chunk = &heap->chunks[offset / HEAP_CHUNK];
+
+	if (chunk->kind == HEAP_LARGE) {
+		if (mmap(p, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+			panic("Failed to release heap pages\n");
+		}
+		if (heap->run_len >= heap->run_cap) {
+			heap->run_cap = heap->run_cap ? heap->run_cap * 2 : 16;
+			heap->runs = xrealloc(heap->runs, sizeof(*heap->runs) * heap->run_cap);
 		}
+		heap->runs[heap->run_len++] = (HeapRun){
+			.chunk = offset / HEAP_CHUNK,
+			.run = chunk->run,
+		};
+		chunk->kind = HEAP_UNUSED;
+		--heap->large_live;
+	} else {
+		if (!heap_mark(heap, offset, size, false)) return false;
+		heap_give(heap, chunk->class, offset);
+		--heap->classes[chunk->class].live;
 	}
-	return false;
+	heap->live -= size;
+	return true;
 }
 
-static void begin_execution(Ctx *context)
+/* A block of `size` serves a realloc to `len` when it's still the right size class, or the same number of chunks */
+static bool heap_fits(size_t size, size_t len)
 {
-	while (context->pc < context->instruction_len) {
-		exec_instruction(context, context->instructions[context->pc++]);
+	size_t class = heap_class(len);
+	return (class < HEAP_CLASSES && heap_class_size(class) == size)
+		|| (class == HEAP_CLASSES && (len + HEAP_CHUNK - 1) / HEAP_CHUNK * HEAP_CHUNK == size);
+}
+
+/* False when `p` isn't a live block, `out` is NULL when out of memory and `p` is left alone */
+static bool heap_realloc(Heap *heap, byte *p, size_t len, byte **out)
+{
+	if (!p) {
+		*out = heap_alloc(heap, len);
+		return true;
+	}
+	size_t size = heap_block_size(heap, p);
+	if (!size) return false;
+	if (heap_fits(size, len)) {
+		*out = p;
+		return true;
 	}
+
+	*out = heap_alloc(heap, len);
+	if (!*out) return true;
+	memcpy(*out, p, len < size ? len : size);
+	heap_free(heap, p);
+	return true;
 }
 
-static int parse_src(Ctx *context, Arena *arena, const char *filename, FILE *file, const size_t len)
+/* Free every block, the reservation stays */
+static void heap_clear(Heap *heap)
 {
-	int errcode = 0;
-	Parser parser = {0};
-	parser_init(&parser, arena, file, len);
+	size_t chunk_len = heap->region.len / HEAP_CHUNK;
+	for (size_t i = 0; i < chunk_len; ++i) free(heap->chunks[i].used);
+	if (chunk_len) memset(heap->chunks, 0, sizeof(*heap->chunks) * chunk_len);
+	for (size_t i = 0; i < HEAP_CLASSES; ++i) {
+		HeapClass *c = &heap->classes[i];
+		*c = (HeapClass){
+			.free = c->free,
+			.free_cap = c->free_cap,
+		};
+	}
+	data_region_zero(&heap->region, false);
+	heap->region.len = 0;
+	heap->run_len = 0;
+	heap->live = 0;
+	heap->large_live = 0;
+}
 
-	for (Node *node = parser_next(&parser);; node = parser_next(&parser)) {
-		/* TODO: Work on error recovery */
-		if (!node) {
-			Span span = parser.span;
-			fprintf(stderr, "%s:%zu:%zu:Parse failed:%s\n", filename, span.start_row, span.start_col, parser.error);
+static void heap_destroy(Heap *heap)
+{
+	for (size_t i = 0; i < heap->region.len / HEAP_CHUNK; ++i) free(heap->chunks[i].used);
+	if (heap->chunks) munmap(heap->chunks, sizeof(*heap->chunks) * heap->chunk_cap);
+	for (size_t i = 0; i < HEAP_CLASSES; ++i) free(heap->classes[i].free);
+	free(heap->runs);
+	if (heap->region.base) munmap(heap->region.base, heap->region.cap);
+}
+
+/* Add what `cache` handed out and took back to the heap's counts, with the heap locked */
+static void heap_cache_settle(Heap *heap, HeapCache *cache)
+{
+	for (size_t i = 0; i < HEAP_CLASSES; ++i) {
+		heap->classes[i].allocs += cache->allocs[i];
+		heap->classes[i].live += cache->live[i];
+		heap->live += cache->live[i] * heap_class_size(i);
+		cache->allocs[i] = 0;
+		cache->live[i] = 0;
+	}
+	/* Below zero until the workers that allocated what was freed here settle too */
+	if ((ptrdiff_t) heap->live > (ptrdiff_t) heap->peak) heap->peak = heap->live;
+}
+
+void heap_cache_drain(Heap *heap, HeapCache *cache)
+{
+	heap_cache_settle(heap, cache);
+	for (size_t i = 0; i < HEAP_CLASSES; ++i) {
+		while (cache->len[i]) heap_give(heap, i, cache->blocks[i][--cache->len[i]]);
+	}
+}
+
+static uint64_t map_hash(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+uint64_t map_hash_bytes(const byte *bytes, size_t len)
+{
+	uint64_t h = map_hash(len);
+	uint64_t word;
+	for (; len >= sizeof(word); bytes += sizeof(word), len -= sizeof(word)) {
+		memcpy(&word, bytes, sizeof(word));
+		h = map_hash(h ^ word);
+	}
+	word = 0;
+	memcpy(&word, bytes, len);
+	return map_hash(h ^ word);
+}
+
+/* Bit `i` set when control byte `i` of the group is `h2` */
+static uint32_t map_match(const int8_t *group, int8_t h2)
+{
+#ifdef __SSE2__
+	__m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2)));
+#else
+	uint32_t bits = 0;
+	for (int i = 0; i < MAP_GROUP; ++i) bits |= (uint32_t)(group[i] == h2) << i;
+	return bits;
+#endif
+}
+
+/* Empty and deleted slots, the only control bytes with the top bit set */
+static uint32_t map_match_free(const int8_t *group)
+{
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+	uint32_t bits = 0;
+	for (int i = 0; i < MAP_GROUP; ++i) bits |= (uint32_t)(group[i] < 0) << i;
+	return bits;
+#endif
+}
+
+static void map_init(Map *map, size_t cap)
+{
+	*map = (Map){
+		.ctrl = xmalloc(cap),
+		.entries = xmalloc(sizeof(*map->entries) * cap),
+		.cap = cap,
+		.live = true,
+	};
+	memset(map->ctrl, MAP_EMPTY, cap);
+}
+
+static uint64_t map_entry_hash(MapEntry *entry)
+{
+	return entry->bytes ? entry->key : map_hash(entry->key);
+}
+
+/* `bytes` is NULL for an integer key, `hash` is map_hash(key) then */
+static size_t map_find(Map *map, uint64_t hash, uint64_t key, const byte *bytes, size_t len)
+{
+	size_t mask = map->cap / MAP_GROUP - 1;
+	size_t g = (hash >> 7) & mask;
+	int8_t h2 = hash & 0x7f;
+	/* Triangular steps visit every group */
+	for (size_t step = 1;; ++step) {
+		int8_t *group = &map->ctrl[g * MAP_GROUP];
+		for (uint32_t bits = map_match(group, h2); bits; bits &= bits - 1) {
+			size_t slot = g * MAP_GROUP + __builtin_ctz(bits);
+			MapEntry *entry = &map->entries[slot];
+			if (!bytes && !entry->bytes && entry->key == key) return slot;
+			if (bytes && entry->bytes && entry->key == hash && entry->len == len && memcmp(entry->bytes, bytes, len) == 0) {
+				return slot;
+			}
+		}
+		if (map_match(group, MAP_EMPTY)) return SIZE_MAX;
+		g = (g + step) & mask;
+	}
+}
+
+/* First empty or deleted slot on the probe sequence of `hash` */
+static size_t map_free_slot(Map *map, uint64_t hash)
+{
+	size_t mask = map->cap / MAP_GROUP - 1;
+	size_t g = (hash >> 7) & mask;
+	for (size_t step = 1;; ++step) {
+		uint32_t bits = map_match_free(&map->ctrl[g * MAP_GROUP]);
+		if (bits) return g * MAP_GROUP + __builtin_ctz(bits);
+		g = (g + step) & mask;
+	}
+}
+
+static void map_rehash(Map *map, size_t cap)
+{
+	Map old = *map;
+	map_init(map, cap);
+	for (size_t i = 0; i < old.cap; ++i) {
+		if (old.ctrl[i] < 0) continue;
+		uint64_t hash = map_entry_hash(&old.entries[i]);
+		size_t slot = map_free_slot(map, hash);
+		map->ctrl[slot] = hash & 0x7f;
+		map->entries[slot] = old.entries[i];
+	}
+	map->len = old.len;
+	map->used = old.len;
+	free(old.ctrl);
+	free(old.entries);
+}
+
+/* Byte string keys are copied into `heap`, false when it is full */
+static bool map_insert(Map *map, Heap *heap, uint64_t key, const byte *bytes, size_t len, uint64_t value)
+{
+	uint64_t hash = bytes ? map_hash_bytes(bytes, len) : map_hash(key);
+	size_t slot = map_find(map, hash, key, bytes, len);
+	if (slot != SIZE_MAX) {
+		map->entries[slot].value = value;
+		return true;
+	}
+
+	if ((map->used + 1) * 8 > map->cap * 7) {
+		/* Mostly tombstones just get swept out */
+		map_rehash(map, map->len * 2 > map->cap ? map->cap * 2 : map->cap);
+	}
+	MapEntry entry = {
+		.key = key,
+		.value = value,
+	};
+	if (bytes) {
+		entry.key = hash;
+		entry.bytes = heap_alloc(heap, len + 1);
+		if (!entry.bytes) return false;
+		memcpy(entry.bytes, bytes, len);
+		entry.bytes[len] = '\0';
+		entry.len = len;
+	}
+	slot = map_free_slot(map, hash);
+	if (map->ctrl[slot] == MAP_EMPTY) ++map->used;
+	map->ctrl[slot] = hash & 0x7f;
+	map->entries[slot] = entry;
+	++map->len;
+	return true;
+}
+
+static MapEntry *map_get(Map *map, uint64_t key, const byte *bytes, size_t len)
+{
+	uint64_t hash = bytes ? map_hash_bytes(bytes, len) : map_hash(key);
+	size_t slot = map_find(map, hash, key, bytes, len);
+	return slot == SIZE_MAX ? NULL : &map->entries[slot];
+}
+
+static bool map_delete(Map *map, Heap *heap, uint64_t key, const byte *bytes, size_t len)
+{
+	uint64_t hash = bytes ? map_hash_bytes(bytes, len) : map_hash(key);
+	size_t slot = map_find(map, hash, key, bytes, len);
+	if (slot == SIZE_MAX) return false;
+	if (map->entries[slot].bytes) heap_free(heap, map->entries[slot].bytes);
+	map->ctrl[slot] = MAP_DELETED;
+	--map->len;
+	return true;
+}
+
+/* Slot of the first entry at or after `cursor`, `cap` past the last one */
+static size_t map_next(Map *map, size_t cursor)
+{
+	while (cursor < map->cap && map->ctrl[cursor] < 0) ++cursor;
+	return cursor;
+}
+
+/* Pass no heap when it is about to be cleared anyway */
+static void map_destroy(Map *map, Heap *heap)
+{
+	for (size_t i = 0; heap && i < map->cap; ++i) {
+		if (map->ctrl[i] >= 0 && map->entries[i].bytes) heap_free(heap, map->entries[i].bytes);
+	}
+	free(map->ctrl);
+	free(map->entries);
+	*map = (Map){0};
+}
+
+static bool insert_declaration(DeclarationMap *declaration_map, Declaration declaration)
+{
+	if (declaration_map->len >= declaration_map->cap) {
+		declaration_map->cap *= 2;
+		declaration_map->declarations =
+			xrealloc(declaration_map->declarations, sizeof(*declaration_map->declarations) * declaration_map->cap);
+	}
+	declaration_map->declarations[declaration_map->len++] = declaration;
+	return true;
+}
+
+static SourceMap *source_map_create(void)
+{
+	SourceMap *source_map = xmalloc(sizeof(*source_map));
+	*source_map = (SourceMap){
+		.names = xmalloc(sizeof(*source_map->names) * 16),
+		.cap = 16,
+		.len = 0,
+		.sections = xmalloc(sizeof(*source_map->sections) * 16),
+		.section_cap = 16,
+		.section_len = 0,
+	};
+	return source_map;
+}
+
+static void source_map_destroy(SourceMap *source_map)
+{
+	if (!source_map) return;
+	free(source_map->names);
+	free(source_map->sections);
+	free(source_map);
+}
+
+static void source_map_reserve(SourceMap *source_map, size_t len)
+{
+	if (len <= source_map->cap) return;
+	while (source_map->cap < len) source_map->cap *= 2;
+	source_map->names = xrealloc(source_map->names, sizeof(*source_map->names) * source_map->cap);
+}
+
+static void source_map_push(SourceMap *source_map, const char *name)
+{
+	source_map_reserve(source_map, source_map->len + 1);
+	source_map->names[source_map->len] = name;
+	++source_map->len;
+}
+
+static void source_map_push_section(SourceMap *source_map, size_t row, enum ParserState state)
+{
+	if (source_map->section_len >= source_map->section_cap) {
+		source_map->section_cap *= 2;
+		source_map->sections =
+			xrealloc(source_map->sections, sizeof(*source_map->sections) * source_map->section_cap);
+	}
+	source_map->sections[source_map->section_len++] = (Section){
+		.row = row,
+		.state = state,
+	};
+}
+
+/* Section in effect after `row` */
+static enum ParserState source_map_state(SourceMap *source_map, size_t row)
+{
+	enum ParserState state = PARSE_TEXT;
+	for (size_t i = 0; i < source_map->section_len && source_map->sections[i].row <= row; ++i) {
+		state = source_map->sections[i].state;
+	}
+	return state;
+}
+
+/* Index of the first instruction past `row` */
+static size_t program_find_row(Program *program, size_t row)
+{
+	size_t lo = 0;
+	size_t hi = program->len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (program->rows[mid] <= row) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/* Make at least `size` bytes usable, false past the reservation */
+static bool stack_commit(Stack *stack, size_t size)
+{
+	size = page_round(size);
+	if (size <= (size_t) (stack->limit - stack->base)) return true;
+	if (size > (size_t) (stack->end - stack->base)) return false;
+	if (mprotect(stack->base, size, PROT_READ | PROT_WRITE) < 0) return false;
+	stack->limit = stack->base + size;
+	return true;
+}
+
+void stack_init(Stack *stack, size_t size, size_t reserve)
+{
+	byte *map = mmap(NULL, reserve + 2 * STACK_GUARD, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED) panic("Failed to reserve stack\n");
+	byte *base = map + STACK_GUARD;
+	*stack = (Stack){
+		.base = base,
+		.limit = base,
+		.end = base + reserve,
+	};
+	if (!stack_commit(stack, size)) panic("Failed to commit stack\n");
+}
+
+void stack_destroy(Stack *stack)
+{
+	if (stack->base) munmap(stack->base - STACK_GUARD, stack->end - stack->base + 2 * STACK_GUARD);
+}
+
+void stack_sizes_max(StackSizes *a, StackSizes b)
+{
+	if (b.operand > a->operand) a->operand = b.operand;
+	if (b.ret > a->ret) a->ret = b.ret;
+}
+
+int vm_commit_stacks(Vm *vm, StackSizes sizes)
+{
+	if (!stack_commit(&vm->stack, sizes.operand) || !stack_commit(&vm->return_stack, sizes.ret)) {
+		fprintf(stderr, "%s:Stack size exceeds the %zu and %zu byte limits\n", vm->context->path, STACK_RESERVE, RETURN_STACK_RESERVE);
+		return -1;
+	}
+	return 0;
+}
+
+/* Source location of instruction `pc` for diagnostics */
+static void print_location(Vm *vm, size_t pc)
+{
+	Ctx *context = vm->context;
+	if (context->parsing || pc >= context->program.len) {
+		fprintf(stderr, "%s:pc %zu", context->path, pc);
+	} else {
+		fprintf(stderr, "%s:%zu", context->path, context->program.rows[pc]);
+	}
+}
+
+void print_frames(Vm *vm)
+{
+	vm_release_streams(vm, false);
+	size_t depth = 0;
+	size_t pc = vm->pc - 1;
+	for (FramePointer *frame = vm->frame_ptr; frame; frame = frame->prev, ++depth) {
+		if (depth < STACK_REPORT_FRAMES) {
+			fprintf(stderr, "  #%zu ", depth);
+			print_location(vm, pc);
+			fprintf(stderr, "\n");
+		}
+		if (frame->prev) pc = *(size_t *)(&frame->return_stack_ptr[-sizeof(size_t)]) - 1;
+		/* The frame below a green thread's procedure only holds what it returns */
+		if (pc + 1 == FIBER_EXIT) break;
+	}
+	if (depth > STACK_REPORT_FRAMES) fprintf(stderr, "  ... %zu more frames\n", depth - STACK_REPORT_FRAMES);
+}
+
+/* Lengths past the guard could reach out of the sandbox */
+static void sandbox_check_len(Vm *vm, uint64_t len)
+{
+	if (len <= SANDBOX_SIZE) return;
+	fprintf(stderr, "Length %" PRIu64 " is larger than the sandbox\n", len);
+	print_frames(vm);
+	abort();
+}
+
+static Map *vm_map(Vm *vm, uint64_t handle)
+{
+	Vm *home = vm->home;
+	if (handle == 0 || handle > home->map_len || !home->maps[handle - 1].live) {
+		fprintf(stderr, "Invalid map handle %" PRIu64 "\n", handle);
+		print_frames(vm);
+		abort();
+	}
+	return &home->maps[handle - 1];
+}
+
+static uint64_t vm_new_map(Vm *vm)
+{
+	Vm *home = vm->home;
+	size_t i = 0;
+	while (i < home->map_len && home->maps[i].live) ++i;
+	if (i == home->map_len) {
+		home->maps = xrealloc(home->maps, sizeof(*home->maps) * ++home->map_len);
+	}
+	map_init(&home->maps[i], MAP_GROUP);
+	return i + 1;
+}
+
+static void vm_clear_maps(Vm *vm)
+{
+	for (size_t i = 0; i < vm->map_len; ++i) {
+		if (vm->maps[i].live) map_destroy(&vm->maps[i], NULL);
+	}
+	free(vm->maps);
+	vm->maps = NULL;
+	vm->map_len = 0;
+}
+
+static void heap_invalid(Vm *vm, const char *op)
+{
+	fprintf(stderr, "Invalid pointer passed to %s\n", op);
+	print_frames(vm);
+	abort();
+}
+
+static void stack_overflow(Vm *vm, const char *name, Stack *stack)
+{
+	fprintf(stderr, "%s stack overflow at %zu bytes\n", name, (size_t) (stack->end - stack->base));
+	print_frames(vm);
+	abort();
+}
+
+/* Double the committed part until it reaches `top`, false past the reservation */
+static bool stack_extend(Stack *stack, byte *top)
+{
+	size_t used = top - stack->base;
+	size_t size = 2 * (stack->limit - stack->base);
+	if (size < used) size = used;
+	if (size > (size_t) (stack->end - stack->base)) size = stack->end - stack->base;
+	return used <= size && stack_commit(stack, size);
+}
+
+/* Slow path of a push that crosses `limit` */
+static void stack_grow(Vm *vm, const char *name, Stack *stack, byte *top)
+{
+	if (!stack_extend(stack, top)) stack_overflow(vm, name, stack);
+}
+
+static void sandbox_map(byte *base, size_t len)
+{
+	if (mmap(base, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+		panic("Failed to map the sandbox\n");
+	}
+}
+
+/* Must run before any declaration is placed */
+static void context_sandbox(Ctx *context)
+{
+	byte *base = mmap(NULL, 2 * SANDBOX_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) panic("Failed to reserve the sandbox\n");
+	Vm *vm = &context->vm;
+	context->sandbox = base;
+	vm->sandbox = base;
+	sandbox_map(base + SANDBOX_LOCALS, SANDBOX_QUARTER - SANDBOX_LOCALS);
+	vm->frame_ptr->locals = base + SANDBOX_LOCALS;
+	vm->heap.region.base = base + SANDBOX_HEAP;
+	vm->heap.region.cap = SANDBOX_QUARTER - SANDBOX_HEAP;
+
+	DataRegion *regions[] = {&context->data.rodata, &context->data.bss, &context->data.files};
+	for (size_t i = 0; i < 3; ++i) {
+		regions[i]->base = base + SANDBOX_QUARTER * (i + 1);
+		regions[i]->cap = SANDBOX_QUARTER;
+		sandbox_map(regions[i]->base, regions[i]->cap);
+	}
+#ifdef MADV_HUGEPAGE
+	if (context->data.huge_pages) madvise(context->data.bss.base, context->data.bss.cap, MADV_HUGEPAGE);
+#endif
+}
+
+/* Operands that could reach outside the sandbox, NULL when the instruction is safe */
+static const char *sandbox_check(Program *program, size_t i)
+{
+	union InstructionData *imm = &program->imms[i];
+	size_t width = 0;
+	switch (program->ops[i]) {
+	case I_LOAD8: case I_STORE8: case I_PLOAD:
+		width = 1;
+		break;
+	case I_LOAD32: case I_STORE32:
+		width = 4;
+		break;
+	case I_LOAD64: case I_STORE64:
+		width = 8;
+		break;
+	case I_JUMPPROC:
+		return imm->proc.argc > LOCAL_SIZE ? "More argument bytes than locals" : NULL;
+	/* Every green thread would need its own share of the locals */
+	case I_SPAWN:
+		return "spawn is not available with --sandbox";
+	case I_PARFOR:
+		return "parfor is not available with --sandbox";
+	case I_RET:
+		return imm->n > STACK_GUARD ? "Return value too large for --sandbox" : NULL;
+	case I_PDEREF: case I_PSET:
+		return imm->n > STACK_GUARD ? "Too many bytes for --sandbox" : NULL;
+	default:
+		return NULL;
+	}
+	return imm->n > LOCAL_SIZE - width ? "Local index out of range" : NULL;
+}
+
+/* The vm running on this thread, the fault handler finds it here */
+static __thread Vm *fault_vm;
+/* Whatever handled SIGSEGV before `stack_fault`, faults that aren't the vm's go there */
+static struct sigaction fault_previous;
+static pthread_once_t fault_once = PTHREAD_ONCE_INIT;
+
+/* The fault handler only writes, nothing in here may lock or allocate */
+static void fault_write(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void fault_print(const char *s)
+{
+	fault_write(STDERR_FILENO, s, strlen(s));
+}
+
+static void fault_print_zu(size_t n)
+{
+	char buf[24];
+	char *p = buf + sizeof(buf);
+	do {
+		*--p = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	fault_write(STDERR_FILENO, p, buf + sizeof(buf) - p);
+}
+
+/* `print_frames` for the fault handler, the streams' buffers go out with plain writes */
+static void fault_frames(Vm *vm)
+{
+	Vm *home = vm->home;
+	for (size_t i = 0; i < home->stream_len; ++i) {
+		Stream *stream = &home->streams[i];
+		if (stream->live && !stream->input && !stream->file && stream->len) fault_write(stream->fd, (char *) stream->buf, stream->len);
+	}
+	Ctx *context = vm->context;
+	size_t depth = 0;
+	size_t pc = vm->pc - 1;
+	for (FramePointer *frame = vm->frame_ptr; frame; frame = frame->prev, ++depth) {
+		if (depth < STACK_REPORT_FRAMES) {
+			fault_print("  #");
+			fault_print_zu(depth);
+			fault_print(" ");
+			fault_print(context->path);
+			if (context->parsing || pc >= context->program.len) {
+				fault_print(":pc ");
+				fault_print_zu(pc);
+			} else {
+				fault_print(":");
+				fault_print_zu(context->program.rows[pc]);
+			}
+			fault_print("\n");
+		}
+		if (frame->prev) pc = *(size_t *)(&frame->return_stack_ptr[-sizeof(size_t)]) - 1;
+		if (pc + 1 == FIBER_EXIT) break;
+	}
+	if (depth > STACK_REPORT_FRAMES) {
+		fault_print("  ... ");
+		fault_print_zu(depth - STACK_REPORT_FRAMES);
+		fault_print(" more frames\n");
+	}
+}
+
+/*
+ * Commit the next chunk when a guarded stack runs past `limit` and retry
+ * the access. An operand stack underflow that got past the pop checks
+ * goes back to `vm_run` to be reported like an empty stack, the rest of
+ * the guard pages and writes to `rodata` end the run. `vm->pc` and the
+ * frames are in memory before every access that can fault, see
+ * `exec_guarded` and `vm_enter`.
+ */
+static void stack_fault(int sig, siginfo_t *info, void *ucontext)
+{
+	(void) ucontext;
+	int saved_errno = errno;
+	byte *addr = info->si_addr;
+	Vm *vm = fault_vm;
+	if (!vm) {
+		/* Not a thread that runs a vm, fault again in the previous handler */
+		sigaction(sig, &fault_previous, NULL);
+		return;
+	}
+	DataRegion *rodata = &vm->context->data.rodata;
+	if (addr >= rodata->base && addr < rodata->base + rodata->cap) {
+		fault_print("Write to read-only data\n");
+		fault_frames(vm);
+		abort();
+	}
+	Stack *stacks[] = {&vm->stack, &vm->return_stack};
+	const char *names[] = {"Operand", "Return"};
+	for (size_t i = 0; i < 2; ++i) {
+		Stack *stack = stacks[i];
+		if (addr >= stack->limit && addr < stack->end && stack_extend(stack, addr + 1)) {
+			errno = saved_errno;
+			return;
+		}
+		if (addr >= stack->limit && addr < stack->end + STACK_GUARD) {
+			fault_print(names[i]);
+			fault_print(" stack overflow at ");
+			fault_print_zu(stack->end - stack->base);
+			fault_print(" bytes\n");
+			fault_frames(vm);
+			abort();
+		}
+		if (addr >= stack->base - STACK_GUARD && addr < stack->base) {
+			if (i == 0 && vm->fault_jump) siglongjmp(*vm->fault_jump, 1);
+			fault_print(names[i]);
+			fault_print(" stack underflow\n");
+			fault_frames(vm);
+			abort();
+		}
+	}
+	sigaction(sig, &fault_previous, NULL);
+}
+
+static void fault_install(void)
+{
+	struct sigaction action = {0};
+	action.sa_sigaction = stack_fault;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGSEGV, &action, &fault_previous) < 0) panic("Failed to install the stack fault handler\n");
+}
+
+void vm_guard_stacks(Vm *vm)
+{
+	vm->guarded = true;
+	pthread_once(&fault_once, fault_install);
+}
+
+static FramePointer *vm_push_frame(Vm *vm)
+{
+	FramePointer *p = xmalloc(sizeof(FramePointer));
+	if (vm->frame_ptr) {
+		p->prev = vm->frame_ptr;
+		p->start = vm->frame_ptr->ptr;
+		p->ptr = vm->frame_ptr->ptr;
+	}
+	vm->frame_ptr = p;
+	return vm->frame_ptr;
+}
+
+static FramePointer *vm_pop_frame(Vm *vm)
+{
+	if (!vm->frame_ptr->prev) return NULL;
+	FramePointer *p = vm->frame_ptr;
+	vm->frame_ptr = vm->frame_ptr->prev;
+	free(p);
+	return vm->frame_ptr;
+}
+
+static bool is_empty_stack(Vm *vm, size_t n)
+{
+	return (vm->frame_ptr->ptr - n) < vm->frame_ptr->start;
+}
+
+/* Guarded stacks fault into `stack_fault` instead, unless the push could jump the guard */
+static inline __attribute__((always_inline)) void push_stack(Vm *vm, void *data, size_t size, const bool guarded)
+{
+	byte *ptr = vm->frame_ptr->ptr;
+	if ((!guarded || size > STACK_GUARD) && ptr + size > vm->stack.limit) {
+		stack_grow(vm, "Operand", &vm->stack, ptr + size);
+	}
+	memcpy(ptr, data, size);
+	vm->frame_ptr->ptr += size;
+}
+
+/* Host address of a program pointer, offsets wrap into the sandbox so there is nothing to check */
+static inline __attribute__((always_inline)) void *vm_addr(Vm *vm, void *ptr, const bool sandboxed)
+{
+	if (!sandboxed) return ptr;
+	return vm->sandbox + (uint32_t) (uintptr_t) ptr;
+}
+
+/* The other way around, for pointers handed to the program */
+static inline __attribute__((always_inline)) void *vm_ptr(Vm *vm, byte *p, const bool sandboxed)
+{
+	if (!sandboxed || !p) return p;
+	return (void *)(uintptr_t)(p - vm->sandbox);
+}
+
+/* Like `vm_addr`, atomics also need the pointer aligned to their width */
+static inline __attribute__((always_inline)) void *vm_atomic_addr(Vm *vm, void *ptr, size_t width, const bool sandboxed)
+{
+	if ((uintptr_t) ptr % width) {
+		fprintf(stderr, "Misaligned %zu byte atomic access at %p\n", width, ptr);
+		print_frames(vm);
+		abort();
+	}
+	return vm_addr(vm, ptr, sandboxed);
+}
+
+/*
+ * The builtins want the memory order as a constant, these switch over the
+ * `MemoryOrder` operand. The parser already rejected the orders an op can't
+ * take, whatever is left falls to seq_cst.
+ */
+#define ATOMIC_FNS(ty, suffix)                                                                          \
+static inline __attribute__((always_inline)) ty atomic_load##suffix(ty *p, size_t order)                \
+{                                                                                                       \
+	switch (order) {                                                                                \
+	case ORDER_RELAXED: return __atomic_load_n(p, __ATOMIC_RELAXED);                                \
+	case ORDER_ACQUIRE: return __atomic_load_n(p, __ATOMIC_ACQUIRE);                                \
+	default: return __atomic_load_n(p, __ATOMIC_SEQ_CST);                                           \
+	}                                                                                               \
+}                                                                                                       \
+static inline __attribute__((always_inline)) void atomic_store##suffix(ty *p, ty v, size_t order)       \
+{                                                                                                       \
+	switch (order) {                                                                                \
+	case ORDER_RELAXED: __atomic_store_n(p, v, __ATOMIC_RELAXED); break;                            \
+	case ORDER_RELEASE: __atomic_store_n(p, v, __ATOMIC_RELEASE); break;                            \
+	default: __atomic_store_n(p, v, __ATOMIC_SEQ_CST); break;                                       \
+	}                                                                                               \
+}                                                                                                       \
+static inline __attribute__((always_inline)) ty atomic_add##suffix(ty *p, ty v, size_t order)           \
+{                                                                                                       \
+	switch (order) {                                                                                \
+	case ORDER_RELAXED: return __atomic_fetch_add(p, v, __ATOMIC_RELAXED);                          \
+	case ORDER_ACQUIRE: return __atomic_fetch_add(p, v, __ATOMIC_ACQUIRE);                          \
+	case ORDER_RELEASE: return __atomic_fetch_add(p, v, __ATOMIC_RELEASE);                          \
+	case ORDER_ACQ_REL: return __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL);                          \
+	default: return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST);                                     \
+	}                                                                                               \
+}                                                                                                       \
+static inline __attribute__((always_inline)) ty atomic_xchg##suffix(ty *p, ty v, size_t order)          \
+{                                                                                                       \
+	switch (order) {                                                                                \
+	case ORDER_RELAXED: return __atomic_exchange_n(p, v, __ATOMIC_RELAXED);                         \
+	case ORDER_ACQUIRE: return __atomic_exchange_n(p, v, __ATOMIC_ACQUIRE);                         \
+	case ORDER_RELEASE: return __atomic_exchange_n(p, v, __ATOMIC_RELEASE);                         \
+	case ORDER_ACQ_REL: return __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL);                         \
+	default: return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);                                    \
+	}                                                                                               \
+}                                                                                                       \
+/* A failed compare can't release, it gets the acquire half of the order */                            \
+static inline __attribute__((always_inline)) bool atomic_cas##suffix(ty *p, ty *expected, ty v, size_t order) \
+{                                                                                                       \
+	switch (order) {                                                                                \
+	case ORDER_RELAXED:                                                                             \
+		return __atomic_compare_exchange_n(p, expected, v, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED); \
+	case ORDER_ACQUIRE:                                                                             \
+		return __atomic_compare_exchange_n(p, expected, v, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE); \
+	case ORDER_RELEASE:                                                                             \
+		return __atomic_compare_exchange_n(p, expected, v, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED); \
+	case ORDER_ACQ_REL:                                                                             \
+		return __atomic_compare_exchange_n(p, expected, v, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); \
+	default:                                                                                        \
+		return __atomic_compare_exchange_n(p, expected, v, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+	}                                                                                               \
+}
+
+ATOMIC_FNS(uint8_t, 8)
+ATOMIC_FNS(uint32_t, 32)
+ATOMIC_FNS(uint64_t, 64)
+
+#undef ATOMIC_FNS
+
+static void *pop_stack(Vm *vm, size_t n)
+{
+	vm->frame_ptr->ptr -= n;
+	byte *top = vm->frame_ptr->ptr;
+	return top;
+}
+
+/* The worker's own free blocks, NULL when it is the only one */
+static HeapCache *vm_heap_cache(Vm *vm)
+{
+	return vm->scheduler && vm->scheduler->worker_len > 1 ? &vm->scheduler->caches[vm->worker] : NULL;
+}
+
+/* Small blocks come from the worker's cache, the heap is only locked to refill it */
+static byte *vm_heap_alloc(Vm *vm, size_t len)
+{
+	Heap *heap = &vm->home->heap;
+	HeapCache *cache = vm_heap_cache(vm);
+	size_t class = heap_class(len);
+	if (!cache || class == HEAP_CLASSES) {
+		vm_lock_heap(vm);
+		byte *p = heap_alloc(heap, len);
+		vm_unlock_heap(vm);
+		return p;
+	}
+
+	if (!cache->len[class]) {
+		vm_lock_heap(vm);
+		heap_cache_settle(heap, cache);
+		while (cache->len[class] < HEAP_CACHE_BLOCKS / 2) {
+			size_t offset = heap_take(heap, class);
+			if (offset == SIZE_MAX) break;
+			cache->blocks[class][cache->len[class]++] = offset;
+		}
+		vm_unlock_heap(vm);
+		if (!cache->len[class]) return NULL;
+	}
+	size_t offset = cache->blocks[class][--cache->len[class]];
+	heap_mark(heap, offset, heap_class_size(class), true);
+	++cache->allocs[class];
+	++cache->live[class];
+	return heap->region.base + offset;
+}
+
+/* False when `p` isn't a live block. A full cache gives half its blocks of that class back */
+static bool vm_heap_free(Vm *vm, byte *p)
+{
+	Heap *heap = &vm->home->heap;
+	HeapCache *cache = vm_heap_cache(vm);
+	size_t size = cache ? heap_block_size(heap, p) : 0;
+	if (!size || size > heap_class_size(HEAP_CLASSES - 1)) {
+		vm_lock_heap(vm);
+		bool ok = heap_free(heap, p);
+		vm_unlock_heap(vm);
+		return ok;
+	}
+
+	size_t offset = p - heap->region.base;
+	if (!heap_mark(heap, offset, size, false)) return false;
+	size_t class = heap_class(size);
+	if (cache->len[class] == HEAP_CACHE_BLOCKS) {
+		vm_lock_heap(vm);
+		heap_cache_settle(heap, cache);
+		while (cache->len[class] > HEAP_CACHE_BLOCKS / 2) heap_give(heap, class, cache->blocks[class][--cache->len[class]]);
+		vm_unlock_heap(vm);
+	}
+	cache->blocks[class][cache->len[class]++] = offset;
+	--cache->live[class];
+	return true;
+}
+
+/* heap_realloc through the worker's cache */
+static bool vm_heap_realloc(Vm *vm, byte *p, size_t len, byte **out)
+{
+	if (!vm_heap_cache(vm)) return heap_realloc(&vm->home->heap, p, len, out);
+	if (!p) {
+		*out = vm_heap_alloc(vm, len);
+		return true;
+	}
+	size_t size = heap_block_size(&vm->home->heap, p);
+	if (!size) return false;
+	if (heap_fits(size, len)) {
+		*out = p;
+		return true;
+	}
+
+	*out = vm_heap_alloc(vm, len);
+	if (!*out) return true;
+	memcpy(*out, p, len < size ? len : size);
+	vm_heap_free(vm, p);
+	return true;
+}
+
+/* The print instructions go through the vm's stdout buffer, shared by the workers */
+static void vm_print(Vm *vm, const void *bytes, size_t len)
+{
+	vm_lock_heap(vm);
+	stream_write(&vm->home->streams[STREAM_OUT], bytes, len);
+	vm_unlock_heap(vm);
+}
+
+void vm_print_u64(Vm *vm, uint64_t n)
+{
+	char digits[20];
+	char *p = digits + sizeof(digits);
+	do *--p = '0' + n % 10;
+	while (n /= 10);
+	vm_print(vm, p, digits + sizeof(digits) - p);
+}
+
+void vm_print_i64(Vm *vm, int64_t n)
+{
+	char digits[21];
+	char *p = digits + sizeof(digits);
+	uint64_t u = n < 0 ? -(uint64_t) n : (uint64_t) n;
+	do *--p = '0' + u % 10;
+	while (u /= 10);
+	if (n < 0) *--p = '-';
+	vm_print(vm, p, digits + sizeof(digits) - p);
+}
+
+void vm_print_char(Vm *vm, char c)
+{
+	vm_print(vm, &c, 1);
+}
+
+void vm_print_float(Vm *vm, double f)
+{
+	/* Wide enough for any float */
+	char digits[64];
+	int n = snprintf(digits, sizeof(digits), "%f", f);
+	vm_print(vm, digits, n);
+}
+
+#define TYOP_INST(ty, prefix, print)                               \
+	case I_##prefix##PUSH: {                                   \
+		void *data = &imm->lit.data;                       \
+		push_stack(vm, data, sizeof(ty), guarded);    \
+		break;                                             \
+	}                                                          \
+	case I_##prefix##ADD: {                                    \
+		STACK_CHECK(sizeof(ty) * 2);                       \
+		ty *b = pop_stack(vm, sizeof(*b));            \
+		ty *a = pop_stack(vm, sizeof(*a));            \
+		ty item = *a + *b;                                 \
+		push_stack(vm, &item, sizeof(item), guarded); \
+		break;                                             \
+	}                                                          \
+	case I_##prefix##SUB: {                                    \
+		STACK_CHECK(sizeof(ty) * 2);                       \
+		ty *b = pop_stack(vm, sizeof(*b));            \
+		ty *a = pop_stack(vm, sizeof(*a));            \
+		ty item = *a - *b;                                 \
+		push_stack(vm, &item, sizeof(item), guarded); \
+		break;                                             \
+	}                                                          \
+	case I_##prefix##MULT: {                                   \
+		STACK_CHECK(sizeof(ty) * 2);                       \
+		ty *b = pop_stack(vm, sizeof(*b));            \
+		ty *a = pop_stack(vm, sizeof(*a));            \
+		ty item = *a * *b;                                 \
+		push_stack(vm, &item, sizeof(item), guarded); \
+		break;                                             \
+	}                                                          \
+	case I_##prefix##DIV: {                                    \
+		STACK_CHECK(sizeof(ty) * 2);                       \
+		ty *b = pop_stack(vm, sizeof(*b));            \
+		ty *a = pop_stack(vm, sizeof(*a));            \
+		ty item = *a / *b;                                 \
+		push_stack(vm, &item, sizeof(item), guarded); \
+		break;                                             \
+	}                                                          \
+	case I_##prefix##PRINT: {                                  \
+		STACK_CHECK(sizeof(ty));                           \
+		byte *stack_ptr = vm->frame_ptr->ptr;         \
+		ty *a = (ty *)(&stack_ptr[-sizeof(*a)]);           \
+		print(vm, *a);                                     \
+		break;                                             \
+	}                                                          \
+	case I_##prefix##CEQ: {                                    \
+		STACK_CHECK(sizeof(ty) * 2);                       \
+		byte *stack_ptr = vm->frame_ptr->ptr;         \
+		ty *b = (ty *)(&stack_ptr[-(sizeof(*b) * 1)]);     \
+		ty *a = (ty *)(&stack_ptr[-(sizeof(*a) * 2)]);     \
+		bool item = *a == *b;                              \
+		push_stack(vm, &item, 1, guarded);            \
+		break;                                             \
+	}                                                          \
+	case I_##prefix##CLT: {                                    \
+		STACK_CHECK(sizeof(ty) * 2);                       \
+		byte *stack_ptr = vm->frame_ptr->ptr;         \
+		ty *b = (ty *)&stack_ptr[-(sizeof(*b) * 1)];       \
+		ty *a = (ty *)&stack_ptr[-(sizeof(*a) * 2)];       \
+		bool item = *a < *b;                               \
+		push_stack(vm, &item, 1, guarded);            \
+		break;                                             \
+	}                                                          \
+	case I_##prefix##CLE: {                                    \
+		STACK_CHECK(sizeof(ty) * 2);                       \
+		byte *stack_ptr = vm->frame_ptr->ptr;         \
+		ty *b = (ty *)&stack_ptr[-(sizeof(*b) * 1)];       \
+		ty *a = (ty *)&stack_ptr[-(sizeof(*a) * 2)];       \
+		bool item = *a <= *b;                              \
+		push_stack(vm, &item, 1, guarded);            \
+		break;                                             \
+	}                                                          \
+	case I_##prefix##CGT: {                                    \
+		STACK_CHECK(sizeof(ty) * 2);                       \
+		byte *stack_ptr = vm->frame_ptr->ptr;         \
+		ty *b = (ty *)&stack_ptr[-(sizeof(*b) * 1)];       \
+		ty *a = (ty *)&stack_ptr[-(sizeof(*a) * 2)];       \
+		bool item = *a > *b;                               \
+		push_stack(vm, &item, 1, guarded);            \
+		break;                                             \
+	}                                                          \
+	case I_##prefix##CGE: {                                    \
+		STACK_CHECK(sizeof(ty) * 2);                       \
+		byte *stack_ptr = vm->frame_ptr->ptr;         \
+		ty *b = (ty *)&stack_ptr[-(sizeof(*b) * 1)];       \
+		ty *a = (ty *)&stack_ptr[-(sizeof(*a) * 2)];       \
+		bool item = *a >= *b;                              \
+		push_stack(vm, &item, 1, guarded);            \
+		break;                                             \
+	}
+
+/* Integer types also have `mod` operation */
+#define ITYOP_INST(ty, prefix, print)                              \
+	TYOP_INST(ty, prefix, print)                               \
+	case I_##prefix##MOD: {                                    \
+		STACK_CHECK(sizeof(ty) * 2);                       \
+		ty *b = pop_stack(vm, sizeof(*b));            \
+		ty *a = pop_stack(vm, sizeof(*a));            \
+		ty item = *a % *b;                                 \
+		push_stack(vm, &item, sizeof(item), guarded); \
+		break;                                             \
+	}                                                          \
+
+#define OPN_INST(ty, suffix)                                                                     \
+	case I_PDEREF##suffix: {                                                                 \
+		STACK_CHECK(sizeof(ty *));                                                       \
+		ty **item = pop_stack(vm, sizeof(*item));                                   \
+		ty *src = vm_addr(vm, *item, sandboxed);                                    \
+		push_stack(vm, src, sizeof(*src), guarded);                                 \
+		break;                                                                           \
+	}                                                                                        \
+	case I_PSET##suffix: {                                                                   \
+		STACK_CHECK(sizeof(ty *) + sizeof(ty));                                          \
+		ty **a = pop_stack(vm, sizeof(*a));                                         \
+		ty *b = pop_stack(vm, sizeof(*b));                                          \
+		*(ty *)vm_addr(vm, *a, sandboxed) = *b;                                     \
+		break;                                                                           \
+	}                                                                                        \
+	case I_POP##suffix: {                                                                    \
+		STACK_CHECK(sizeof(ty));                                                         \
+		pop_stack(vm, sizeof(ty));                                                  \
+		break;                                                                           \
+	}                                                                                        \
+	case I_SWAP##suffix: {                                                                   \
+		STACK_CHECK(sizeof(ty) * 2);                                                     \
+		byte *a = pop_stack(vm, sizeof(ty));                                        \
+		byte *b = pop_stack(vm, sizeof(ty));                                        \
+		byte tmp[sizeof(ty)] = {0};                                                      \
+		memcpy(tmp, b, sizeof(ty));                                                      \
+		push_stack(vm, a, sizeof(ty), guarded);                                     \
+		push_stack(vm, tmp, sizeof(ty), guarded);                                   \
+		break;                                                                           \
+	}                                                                                        \
+	case I_DUPE##suffix: {                                                                   \
+		STACK_CHECK(sizeof(ty));                                                         \
+		byte *stack_ptr = vm->frame_ptr->ptr;                                       \
+		byte *a = &stack_ptr[-sizeof(ty)];                                               \
+		push_stack(vm, a, sizeof(ty), guarded);                                     \
+		break;                                                                           \
+	}                                                                                        \
+	case I_COPY##suffix: {                                                                   \
+		STACK_CHECK(sizeof(ty));                                                         \
+		byte *stack_ptr = vm->frame_ptr->ptr;                                       \
+		byte *a = &stack_ptr[-sizeof(ty)];                                               \
+		size_t n = imm->n;                                                               \
+		for (size_t i = 0; i < n; ++i) {                                                 \
+			push_stack(vm, a, sizeof(ty), guarded);                             \
+		}                                                                                \
+		break;                                                                           \
+	}                                                                                        \
+	case I_STORE##suffix: {                                                                  \
+		STACK_CHECK(sizeof(ty));                                                         \
+		size_t n = imm->n;                                                               \
+		byte *locals = vm->frame_ptr->locals;                                       \
+		byte *slot = &locals[n];                                                         \
+		byte *a = pop_stack(vm, sizeof(ty));                                        \
+		memcpy(slot, a, sizeof(ty));                                                     \
+		break;                                                                           \
+	}                                                                                        \
+	case I_LOAD##suffix: {                                                                   \
+		size_t n = imm->n;                                                               \
+		byte *locals = vm->frame_ptr->locals;                                       \
+		byte *slot = &locals[n];                                                         \
+		push_stack(vm, slot, sizeof(ty), guarded);                                  \
+		break;                                                                           \
+	}                                                                                        \
+	case I_RET##suffix: {                                                                    \
+		STACK_CHECK(sizeof(ty));                                                         \
+		FramePointer *stack_ptr = vm->frame_ptr;                                    \
+		FramePointer *stack_ptr_prev = stack_ptr->prev;                                  \
+		size_t return_addr = *(size_t *)(&stack_ptr->return_stack_ptr[-sizeof(size_t)]); \
+		byte *a = pop_stack(vm, sizeof(ty));                                        \
+		byte tmp[sizeof(ty)] = {0};                                                      \
+		memcpy(tmp, a, sizeof(ty));                                                      \
+		vm->frame_ptr = stack_ptr_prev;                                             \
+		vm->pc = return_addr;                                                       \
+		free(stack_ptr);                                                                 \
+		push_stack(vm, tmp, sizeof(ty), guarded);                                   \
+		break;                                                                           \
+	}                                                                                        \
+
+#define ATOMIC_INST(ty, suffix)                                                                  \
+	case I_ALOAD##suffix: {                                                                  \
+		STACK_CHECK(sizeof(void *));                                                     \
+		void *ptr = *(void **)pop_stack(vm, sizeof(ptr));                                \
+		ty item = atomic_load##suffix(vm_atomic_addr(vm, ptr, sizeof(ty), sandboxed), imm->n); \
+		push_stack(vm, &item, sizeof(item), guarded);                                    \
+		break;                                                                           \
+	}                                                                                        \
+	case I_ASTORE##suffix: {                                                                 \
+		STACK_CHECK(sizeof(void *) + sizeof(ty));                                        \
+		void *ptr = *(void **)pop_stack(vm, sizeof(ptr));                                \
+		ty item = *(ty *)pop_stack(vm, sizeof(item));                                    \
+		atomic_store##suffix(vm_atomic_addr(vm, ptr, sizeof(ty), sandboxed), item, imm->n); \
+		break;                                                                           \
+	}                                                                                        \
+	case I_AADD##suffix: {                                                                   \
+		STACK_CHECK(sizeof(void *) + sizeof(ty));                                        \
+		void *ptr = *(void **)pop_stack(vm, sizeof(ptr));                                \
+		ty *item = pop_stack(vm, sizeof(*item));                                         \
+		*item = atomic_add##suffix(vm_atomic_addr(vm, ptr, sizeof(ty), sandboxed), *item, imm->n); \
+		push_stack(vm, item, sizeof(*item), guarded);                                    \
+		break;                                                                           \
+	}                                                                                        \
+	case I_AXCHG##suffix: {                                                                  \
+		STACK_CHECK(sizeof(void *) + sizeof(ty));                                        \
+		void *ptr = *(void **)pop_stack(vm, sizeof(ptr));                                \
+		ty *item = pop_stack(vm, sizeof(*item));                                         \
+		*item = atomic_xchg##suffix(vm_atomic_addr(vm, ptr, sizeof(ty), sandboxed), *item, imm->n); \
+		push_stack(vm, item, sizeof(*item), guarded);                                    \
+		break;                                                                           \
+	}                                                                                        \
+	case I_ACAS##suffix: {                                                                   \
+		STACK_CHECK(sizeof(void *) + sizeof(ty) * 2);                                    \
+		void *ptr = *(void **)pop_stack(vm, sizeof(ptr));                                \
+		ty desired = *(ty *)pop_stack(vm, sizeof(desired));                              \
+		ty *expected = pop_stack(vm, sizeof(*expected));                                 \
+		ty item = *expected;                                                             \
+		bool ok = atomic_cas##suffix(vm_atomic_addr(vm, ptr, sizeof(ty), sandboxed), &item, desired, imm->n); \
+		push_stack(vm, &item, sizeof(item), guarded);                                    \
+		push_stack(vm, &ok, 1, guarded);                                                 \
+		break;                                                                           \
+	}
+
+/* Call the procedure at `target` with the top `argc` bytes as its first locals, it returns to `vm->pc` */
+static inline __attribute__((always_inline)) void vm_enter(Vm *vm, size_t target, size_t argc, const bool guarded, const bool sandboxed)
+{
+	FramePointer *stack_ptr = vm->frame_ptr;
+	// Push pc onto return stack
+	byte *return_ptr = stack_ptr->return_stack_ptr;
+	byte *return_top = return_ptr + sizeof(size_t);
+	if (!guarded && return_top > vm->return_stack.limit) {
+		stack_grow(vm, "Return", &vm->return_stack, return_top);
+	}
+	/* Still in the caller's frame when this faults, the new one is only linked after */
+	*(size_t *)return_ptr = vm->pc;
+	if (guarded) __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+	FramePointer *stack_ptr_new = xmalloc(sizeof(FramePointer));
+	// Move previous stack frame
+	stack_ptr->ptr -= argc;
+	stack_ptr_new->ptr = stack_ptr->ptr;
+	stack_ptr_new->start = stack_ptr->start;
+	stack_ptr_new->return_stack_ptr = return_top;
+	stack_ptr_new->prev = stack_ptr;
+	/* The return stack runs out long before the sandbox's locals */
+	stack_ptr_new->locals = sandboxed ? stack_ptr->locals + LOCAL_SIZE : stack_ptr_new->local_storage;
+	vm->frame_ptr = stack_ptr_new;
+
+	vm->pc = target;
+	// Initial locals with args
+	memcpy(stack_ptr_new->locals, stack_ptr_new->ptr, argc);
+}
+
+/*
+ * Pop the arguments, call the host procedure and push what it returned.
+ * Without one the C function of that name gets the arguments as 8 byte
+ * words, in the order they were pushed, and its 8 byte result is pushed.
+ */
+static void vm_call_extern(Vm *vm, union InstructionData *imm)
+{
+	Ctx *context = vm->context;
+	size_t argc = imm->proc.argc;
+	size_t index = imm->proc.location.offset;
+	Extern *ext = index < context->extern_len ? &context->externs[index] : NULL;
+	if (!ext || (!ext->fn && !ext->sym)) {
+		fprintf(stderr, "Extern %s is not a host procedure or a symbol of the process\n", ext ? ext->name : "call");
+		print_frames(vm);
+		abort();
+	}
+	if (argc > LOCAL_SIZE || is_empty_stack(vm, argc)) {
+		fprintf(stderr, "Not enough bytes on the stack for %s\n", ext->name);
+		print_frames(vm);
+		abort();
+	}
+	/* C code writes through stdio, flush both sides so the output stays in order */
+	vm_lock_heap(vm);
+	vm_flush_streams(vm);
+	vm_unlock_heap(vm);
+	if (!ext->fn) {
+		uint64_t ret = extern_call(vm, ext, pop_stack(vm, argc), argc);
+		fflush(stdout);
+		push_stack(vm, &ret, sizeof(ret), vm->guarded);
+		return;
+	}
+	/* The host may call back in and push over them */
+	byte args[LOCAL_SIZE];
+	memcpy(args, pop_stack(vm, argc), argc);
+	byte ret[PISS_RET_MAX];
+	size_t n = ext->fn((Piss *) context, ext->user, args, argc, ret);
+	fflush(stdout);
+	if (n > PISS_RET_MAX) {
+		fprintf(stderr, "%s returned %zu bytes, more than %d\n", ext->name, n, PISS_RET_MAX);
+		print_frames(vm);
+		abort();
+	}
+	push_stack(vm, ret, n, vm->guarded);
+}
+
+/*
+ * Instantiated once per stack and memory mode. With `guarded` the pushes
+ * carry no bounds checks, running off the end of a stack faults in its
+ * guard pages instead. Pops are checked against the frame's start either
+ * way. With `sandboxed` pointers are translated by `vm_addr`.
+ */
+static inline __attribute__((always_inline)) void exec_instruction(Vm *vm, enum InstructionKind kind, union InstructionData *imm,
+	const bool guarded, const bool sandboxed)
+{
+#define STACK_CHECK(n) do { if (is_empty_stack(vm, n)) goto empty_stack; } while(0)
+
+	switch (kind) {
+	case I_PPUSH: {
+		byte *item = imm->ptr;
+		/* Zero-filled data belongs to the vm, the rest of the declarations are shared */
+		size_t offset = (uintptr_t) item - (uintptr_t) vm->bss_origin;
+		if (offset < vm->bss.len) item = vm->bss.base + offset;
+		push_stack(vm, &item, sizeof(item), guarded);
+		break;
+	}
+	case I_PLOAD: {
+		void *data_ptr = imm->ptr;
+		push_stack(vm, &data_ptr, sizeof(data_ptr), guarded);
+
+		size_t n = imm->n;
+		byte *locals = vm->frame_ptr->locals;
+		void *slot = vm_ptr(vm, &locals[n], sandboxed);
+		push_stack(vm, &slot, sizeof(slot), guarded);
+		break;
+	}
+	ITYOP_INST(unsigned long, UL, vm_print_u64)
+	ITYOP_INST(int, I, vm_print_i64)
+	ITYOP_INST(char, C, vm_print_char)
+	TYOP_INST(float, F, vm_print_float)
+	OPN_INST(int8_t, 8)
+	OPN_INST(int32_t, 32)
+	OPN_INST(int64_t, 64)
+	ATOMIC_INST(uint8_t, 8)
+	ATOMIC_INST(uint32_t, 32)
+	ATOMIC_INST(uint64_t, 64)
+#undef OPN_INST
+#undef TYOP_INST
+#undef ITYOP_INST
+#undef ATOMIC_INST
+
+	case I_FENCE: {
+		switch (imm->n) {
+		case ORDER_ACQUIRE: __atomic_thread_fence(__ATOMIC_ACQUIRE); break;
+		case ORDER_RELEASE: __atomic_thread_fence(__ATOMIC_RELEASE); break;
+		case ORDER_ACQ_REL: __atomic_thread_fence(__ATOMIC_ACQ_REL); break;
+		default: __atomic_thread_fence(__ATOMIC_SEQ_CST); break;
+		}
+		break;
+	}
+	case I_CIPRINT: {
+		STACK_CHECK(sizeof(char));
+		byte *stack_ptr = vm->frame_ptr->ptr;
+		char *a = (char *)(&stack_ptr[-sizeof(*a)]);
+		vm_print_i64(vm, *a);
+		break;
+	}
+	case I_RET: {
+		FramePointer *stack_ptr = vm->frame_ptr;
+		FramePointer *stack_ptr_prev = stack_ptr->prev;
+		size_t n = imm->n;
+		STACK_CHECK(n);
+		size_t return_addr = *(size_t *)(&stack_ptr->return_stack_ptr[-sizeof(size_t)]);
+		byte *a = pop_stack(vm, n);
+		byte tmp[n];
+		memcpy(tmp, a, n);
+		vm->frame_ptr = stack_ptr_prev;
+		vm->pc = return_addr;
+		free(stack_ptr);
+		push_stack(vm, tmp, n, guarded);
+		break;
+	}
+	case I_JUMPPROC: {
+		vm_enter(vm, vm->pc + imm->proc.location.offset, imm->proc.argc, guarded, sandboxed);
+		break;
+	}
+	case I_CALLEXT: {
+		vm_call_extern(vm, imm);
+		break;
+	}
+	case I_SPAWN: {
+		size_t argc = imm->proc.argc;
+		STACK_CHECK(argc);
+		if (!vm->scheduler) scheduler_start(vm);
+		byte *args = pop_stack(vm, argc);
+		uint64_t item = scheduler_spawn(vm, vm->pc + imm->proc.location.offset, args, argc);
+		push_stack(vm, &item, sizeof(item), guarded);
+		break;
+	}
+	case I_PARFOR: {
+		STACK_CHECK(sizeof(uint64_t) * 2);
+		uint64_t end = *(uint64_t *)pop_stack(vm, sizeof(end));
+		uint64_t start = *(uint64_t *)pop_stack(vm, sizeof(start));
+		if (!vm->scheduler) scheduler_start(vm);
+		scheduler_parfor(vm, vm->pc + imm->proc.location.offset, start, end, imm->proc.argc);
+		break;
+	}
+	case I_YIELD: {
+		if (vm->scheduler) scheduler_yield(vm);
+		break;
+	}
+	case I_JOIN: {
+		STACK_CHECK(sizeof(uint64_t));
+		uint64_t handle = *(uint64_t *)pop_stack(vm, sizeof(handle));
+		scheduler_join(vm, handle);
+		break;
+	}
+	case I_JUMP: {
+		vm->pc += imm->offset;
+		break;
+	}
+	case I_SYNC: {
+		data_segment_sync(&vm->context->data);
+		break;
+	}
+	case I_PDEREF: {
+		STACK_CHECK(sizeof(void *));
+		size_t n = imm->n;
+		void *ptr = *(void **)pop_stack(vm, sizeof(ptr));
+		push_stack(vm, vm_addr(vm, ptr, sandboxed), n, guarded);
+		break;
+	}
+	case I_PSET: {
+		size_t n = imm->n;
+		STACK_CHECK(sizeof(void *) + n);
+		void *ptr = *(void **)pop_stack(vm, sizeof(ptr));
+		byte *src = pop_stack(vm, n);
+		memcpy(vm_addr(vm, ptr, sandboxed), src, n);
+		break;
+	}
+	case I_MEMCPY:
+	case I_MEMMOVE: {
+		STACK_CHECK(sizeof(uint64_t) + sizeof(void *) * 2);
+		uint64_t len = *(uint64_t *)pop_stack(vm, sizeof(len));
+		void *src = *(void **)pop_stack(vm, sizeof(src));
+		void *dst = *(void **)pop_stack(vm, sizeof(dst));
+		if (sandboxed) sandbox_check_len(vm, len);
+		if (kind == I_MEMCPY) memcpy(vm_addr(vm, dst, sandboxed), vm_addr(vm, src, sandboxed), len);
+		else memmove(vm_addr(vm, dst, sandboxed), vm_addr(vm, src, sandboxed), len);
+		break;
+	}
+	case I_MEMSET: {
+		STACK_CHECK(sizeof(uint64_t) + 1 + sizeof(void *));
+		uint64_t len = *(uint64_t *)pop_stack(vm, sizeof(len));
+		byte c = *(byte *)pop_stack(vm, 1);
+		void *dst = *(void **)pop_stack(vm, sizeof(dst));
+		if (sandboxed) sandbox_check_len(vm, len);
+		memset(vm_addr(vm, dst, sandboxed), c, len);
+		break;
+	}
+	case I_MEMCMP: {
+		STACK_CHECK(sizeof(uint64_t) + sizeof(void *) * 2);
+		uint64_t len = *(uint64_t *)pop_stack(vm, sizeof(len));
+		void *b = *(void **)pop_stack(vm, sizeof(b));
+		void *a = *(void **)pop_stack(vm, sizeof(a));
+		if (sandboxed) sandbox_check_len(vm, len);
+		int item = memcmp(vm_addr(vm, a, sandboxed), vm_addr(vm, b, sandboxed), len);
+		push_stack(vm, &item, sizeof(item), guarded);
+		break;
+	}
+	case I_MEMCHR: {
+		STACK_CHECK(sizeof(uint64_t) + 1 + sizeof(void *));
+		uint64_t len = *(uint64_t *)pop_stack(vm, sizeof(len));
+		byte c = *(byte *)pop_stack(vm, 1);
+		void *p = *(void **)pop_stack(vm, sizeof(p));
+		if (sandboxed) sandbox_check_len(vm, len);
+		void *item = vm_ptr(vm, memchr(vm_addr(vm, p, sandboxed), c, len), sandboxed);
+		push_stack(vm, &item, sizeof(item), guarded);
+		break;
+	}
+	case I_STRLEN: {
+		STACK_CHECK(sizeof(void *));
+		void *p = *(void **)pop_stack(vm, sizeof(p));
+		/* Inside the sandbox, a missing terminator runs into the guard */
+		uint64_t item = strlen(vm_addr(vm, p, sandboxed));
+		push_stack(vm, &item, sizeof(item), guarded);
+		break;
+	}
+	case I_CHNEW: {
+		STACK_CHECK(sizeof(uint64_t) * 2);
+		uint64_t size = *(uint64_t *)pop_stack(vm, sizeof(size));
+		uint64_t cap = *(uint64_t *)pop_stack(vm, sizeof(cap));
+		vm_lock_heap(vm);
+		uint64_t item = vm_new_channel(vm, cap, size);
+		vm_unlock_heap(vm);
+		push_stack(vm, &item, sizeof(item), guarded);
+		break;
+	}
+	case I_CHFREE: {
+		STACK_CHECK(sizeof(uint64_t));
+		uint64_t handle = *(uint64_t *)pop_stack(vm, sizeof(handle));
+		vm_lock_heap(vm);
+		vm_free_channel(vm, handle);
+		vm_unlock_heap(vm);
+		break;
+	}
+	case I_CHCLOSE: {
+		STACK_CHECK(sizeof(uint64_t));
+		uint64_t handle = *(uint64_t *)pop_stack(vm, sizeof(handle));
+		channel_close(vm, vm_channel(vm, handle));
+		break;
+	}
+	/* The channel ops leave their operands in place until they go through, see `channel_park` */
+	case I_CHSEND: {
+		STACK_CHECK(sizeof(uint64_t) + sizeof(void *));
+		byte *top = vm->frame_ptr->ptr;
+		void *src = *(void **)&top[-sizeof(void *)];
+		Channel *chan = vm_channel(vm, *(uint64_t *)&top[-sizeof(void *) - sizeof(uint64_t)]);
+		if (sandboxed) sandbox_check_len(vm, chan->size);
+		if (__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE)) channel_closed(vm);
+		if (!channel_send(chan, vm_addr(vm, src, sandboxed))) {
+			channel_park(vm, chan, true);
+			break;
+		}
+		pop_stack(vm, sizeof(uint64_t) + sizeof(void *));
+		channel_wake(vm, chan, false, 1);
+		break;
+	}
+	case I_CHRECV: {
+		STACK_CHECK(sizeof(uint64_t) + sizeof(void *));
+		byte *top = vm->frame_ptr->ptr;
+		byte *dst = vm_addr(vm, *(void **)&top[-sizeof(void *)], sandboxed);
+		Channel *chan = vm_channel(vm, *(uint64_t *)&top[-sizeof(void *) - sizeof(uint64_t)]);
+		if (sandboxed) sandbox_check_len(vm, chan->size);
+		bool ok = channel_recv(chan, dst);
+		/* Whatever was sent before the close still comes out */
+		if (!ok && !__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE)) {
+			channel_park(vm, chan, false);
+			break;
+		}
+		if (!ok) ok = channel_recv(chan, dst);
+		pop_stack(vm, sizeof(uint64_t) + sizeof(void *));
+		push_stack(vm, &ok, 1, guarded);
+		if (ok) channel_wake(vm, chan, true, 1);
+		break;
+	}
+	case I_CHSENDN: {
+		STACK_CHECK(sizeof(uint64_t) * 2 + sizeof(void *));
+		byte *top = vm->frame_ptr->ptr;
+		uint64_t *count = (uint64_t *)&top[-sizeof(uint64_t)];
+		byte **src = (byte **)&top[-sizeof(uint64_t) - sizeof(void *)];
+		Channel *chan = vm_channel(vm, *(uint64_t *)&top[-sizeof(uint64_t) * 2 - sizeof(void *)]);
+		if (sandboxed) sandbox_check_len(vm, chan->size);
+		if (__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE)) channel_closed(vm);
+		size_t sent = 0;
+		while (sent < *count && channel_send(chan, vm_addr(vm, *src + sent * chan->size, sandboxed))) ++sent;
+		if (sent) channel_wake(vm, chan, false, sent);
+		if (sent < *count) {
+			/* Pick up from the first message that didn't fit */
+			*count -= sent;
+			*src += sent * chan->size;
+			channel_park(vm, chan, true);
+			break;
+		}
+		pop_stack(vm, sizeof(uint64_t) * 2 + sizeof(void *));
+		break;
+	}
+	case I_CHRECVN: {
+		STACK_CHECK(sizeof(uint64_t) * 2 + sizeof(void *));
+		byte *top = vm->frame_ptr->ptr;
+		uint64_t count = *(uint64_t *)&top[-sizeof(uint64_t)];
+		byte *dst = *(byte **)&top[-sizeof(uint64_t) - sizeof(void *)];
+		Channel *chan = vm_channel(vm, *(uint64_t *)&top[-sizeof(uint64_t) * 2 - sizeof(void *)]);
+		if (sandboxed) sandbox_check_len(vm, chan->size);
+		uint64_t item = 0;
+		while (item < count && channel_recv(chan, vm_addr(vm, dst + item * chan->size, sandboxed))) ++item;
+		if (!item && count) {
+			if (!__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE)) {
+				channel_park(vm, chan, false);
+				break;
+			}
+			while (item < count && channel_recv(chan, vm_addr(vm, dst + item * chan->size, sandboxed))) ++item;
+		}
+		pop_stack(vm, sizeof(uint64_t) * 2 + sizeof(void *));
+		push_stack(vm, &item, sizeof(item), guarded);
+		if (item) channel_wake(vm, chan, true, item);
+		break;
+	}
+	case I_SOPEN: {
+		STACK_CHECK(1 + sizeof(void *));
+		char mode = *(char *)pop_stack(vm, 1);
+		void *path = *(void **)pop_stack(vm, sizeof(path));
+		vm_lock_heap(vm);
+		uint64_t item = vm_open_stream(vm, vm_addr(vm, path, sandboxed), mode);
+		vm_unlock_heap(vm);
+		push_stack(vm, &item, sizeof(item), guarded);
+		break;
+	}
+	case I_SREAD:
+	case I_SREADLN: {
+		STACK_CHECK(sizeof(uint64_t) * 2 + sizeof(void *));
+		uint64_t len = *(uint64_t *)pop_stack(vm, sizeof(len));
+		void *dst = *(void **)pop_stack(vm, sizeof(dst));
+		uint64_t handle = *(uint64_t *)pop_stack(vm, sizeof(handle));
+		if (sandboxed) sandbox_check_len(vm, len);
+		vm_lock_heap(vm);
+		Stream *stream = vm_stream_dir(vm, handle, true);
+		/* Prompts show up before the program waits for an answer */
+		if (handle == STREAM_IN + 1) stream_flush(&vm->home->streams[STREAM_OUT]);
+		ssize_t n = kind == I_SREAD ? stream_read(stream, vm_addr(vm, dst, sandboxed), len)
+			: stream_read_line(stream, vm_addr(vm, dst, sandboxed), len);
+		vm_unlock_heap(vm);
+		if (n < 0) stream_failed(vm, handle, "read");
+		uint64_t item = n;
+		push_stack(vm, &item, sizeof(item), guarded);
+		break;
+	}
+	case I_SWRITE: {
+		STACK_CHECK(sizeof(uint64_t) * 2 + sizeof(void *));
+		uint64_t len = *(uint64_t *)pop_stack(vm, sizeof(len));
+		void *src = *(void **)pop_stack(vm, sizeof(src));
+		uint64_t handle = *(uint64_t *)pop_stack(vm, sizeof(handle));
+		if (sandboxed) sandbox_check_len(vm, len);
+		vm_lock_heap(vm);
+		bool ok = stream_write(vm_stream_dir(vm, handle, false), vm_addr(vm, src, sandboxed), len);
+		vm_unlock_heap(vm);
+		if (!ok) stream_failed(vm, handle, "write");
+		break;
+	}
+	case I_SFLUSH:
+	case I_SCLOSE: {
+		STACK_CHECK(sizeof(uint64_t));
+		uint64_t handle = *(uint64_t *)pop_stack(vm, sizeof(handle));
+		vm_lock_heap(vm);
+		Stream *stream = vm_stream(vm, handle);
+		bool ok = kind == I_SCLOSE && handle > STREAM_STD ? stream_close(stream) : stream_flush(stream);
+		vm_unlock_heap(vm);
+		if (!ok) stream_failed(vm, handle, kind == I_SCLOSE ? "close" : "flush");
+		break;
+	}
+	case I_HMNEW: {
+		vm_lock_heap(vm);
+		uint64_t item = vm_new_map(vm);
+		vm_unlock_heap(vm);
+		push_stack(vm, &item, sizeof(item), guarded);
+		break;
+	}
+	case I_HMFREE: {
+		STACK_CHECK(sizeof(uint64_t));
+		uint64_t handle = *(uint64_t *)pop_stack(vm, sizeof(handle));
+		vm_lock_heap(vm);
+		map_destroy(vm_map(vm, handle), &vm->home->heap);
+		vm_unlock_heap(vm);
+		break;
+	}
+	case I_HMLEN: {
+		STACK_CHECK(sizeof(uint64_t));
+		uint64_t handle = *(uint64_t *)pop_stack(vm, sizeof(handle));
+		vm_lock_heap(vm);
+		uint64_t item = vm_map(vm, handle)->len;
+		vm_unlock_heap(vm);
+		push_stack(vm, &item, sizeof(item), guarded);
+		break;
+	}
+	case I_HMSET:
+	case I_HMSETS: {
+		STACK_CHECK(kind == I_HMSET ? sizeof(uint64_t) * 3 : sizeof(uint64_t) * 3 + sizeof(void *));
+		uint64_t value = *(uint64_t *)pop_stack(vm, sizeof(value));
+		/* The length of a byte string key */
+		uint64_t key = *(uint64_t *)pop_stack(vm, sizeof(key));
+		byte *bytes = NULL;
+		if (kind == I_HMSETS) {
+			bytes = vm_addr(vm, *(void **)pop_stack(vm, sizeof(void *)), sandboxed);
+			if (sandboxed) sandbox_check_len(vm, key);
+		}
+		uint64_t handle = *(uint64_t *)pop_stack(vm, sizeof(handle));
+		vm_lock_heap(vm);
+		if (!map_insert(vm_map(vm, handle), &vm->home->heap, key, bytes, key, value)) {
+			panic("Heap is full\n");
+		}
+		vm_unlock_heap(vm);
+		break;
+	}
+	case I_HMGET:
+	case I_HMGETS:
+	case I_HMDEL:
+	case I_HMDELS: {
+		bool strings = kind == I_HMGETS || kind == I_HMDELS;
+		STACK_CHECK(strings ? sizeof(uint64_t) * 2 + sizeof(void *) : sizeof(uint64_t) * 2);
+		/* The length of a byte string key */
+		uint64_t key = *(uint64_t *)pop_stack(vm, sizeof(key));
+		byte *bytes = NULL;
+		if (strings) {
+			bytes = vm_addr(vm, *(void **)pop_stack(vm, sizeof(void *)), sandboxed);
+			if (sandboxed) sandbox_check_len(vm, key);
+		}
+		uint64_t handle = *(uint64_t *)pop_stack(vm, sizeof(handle));
+		vm_lock_heap(vm);
+		Map *map = vm_map(vm, handle);
+		bool found;
+		uint64_t value = 0;
+		if (kind == I_HMGET || kind == I_HMGETS) {
+			MapEntry *entry = map_get(map, key, bytes, key);
+			if (entry) value = entry->value;
+			found = entry != NULL;
+		} else {
+			found = map_delete(map, &vm->home->heap, key, bytes, key);
+		}
+		vm_unlock_heap(vm);
+		if (kind == I_HMGET || kind == I_HMGETS) push_stack(vm, &value, sizeof(value), guarded);
+		push_stack(vm, &found, 1, guarded);
+		break;
+	}
+	case I_HMNEXT: {
+		STACK_CHECK(sizeof(uint64_t) * 2);
+		uint64_t cursor = *(uint64_t *)pop_stack(vm, sizeof(cursor));
+		uint64_t handle = *(uint64_t *)pop_stack(vm, sizeof(handle));
+		vm_lock_heap(vm);
+		Map *map = vm_map(vm, handle);
+		size_t slot = map_next(map, cursor);
+		uint64_t key = 0;
+		uint64_t value = 0;
+		bool found = slot < map->cap;
+		if (found) {
+			MapEntry *entry = &map->entries[slot];
+			key = entry->bytes ? (uint64_t)(uintptr_t) vm_ptr(vm, entry->bytes, sandboxed) : entry->key;
+			value = entry->value;
+			cursor = slot + 1;
+		}
+		vm_unlock_heap(vm);
+		push_stack(vm, &key, sizeof(key), guarded);
+		push_stack(vm, &value, sizeof(value), guarded);
+		push_stack(vm, &cursor, sizeof(cursor), guarded);
+		push_stack(vm, &found, 1, guarded);
+		break;
+	}
+	case I_ALLOC: {
+		STACK_CHECK(sizeof(uint64_t));
+		uint64_t len = *(uint64_t *)pop_stack(vm, sizeof(len));
+		void *item = vm_ptr(vm, vm_heap_alloc(vm, len), sandboxed);
+		push_stack(vm, &item, sizeof(item), guarded);
+		break;
+	}
+	case I_FREE: {
+		STACK_CHECK(sizeof(void *));
+		void *ptr = *(void **)pop_stack(vm, sizeof(ptr));
+		if (ptr && !vm_heap_free(vm, vm_addr(vm, ptr, sandboxed))) heap_invalid(vm, "free");
+		break;
+	}
+	case I_REALLOC: {
+		STACK_CHECK(sizeof(uint64_t) + sizeof(void *));
+		uint64_t len = *(uint64_t *)pop_stack(vm, sizeof(len));
+		void *ptr = *(void **)pop_stack(vm, sizeof(ptr));
+		byte *block;
+		if (!vm_heap_realloc(vm, ptr ? vm_addr(vm, ptr, sandboxed) : NULL, len, &block)) heap_invalid(vm, "realloc");
+		void *item = vm_ptr(vm, block, sandboxed);
+		push_stack(vm, &item, sizeof(item), guarded);
+		break;
+	}
+	case I_JUMPCMP: {
+		STACK_CHECK(1);
+		byte *ptr = &vm->frame_ptr->ptr[-1];
+		if (*ptr) {
+			vm->pc += imm->offset;
+			break;
+		}
+		break;
+	}
+	default:
+		fprintf(stderr, "%s: {%d:UNIMPLMEMENTED:%d\n", __FILE__, __LINE__, kind);
+	}
+
+	return;
+empty_stack:
+	vm_print(vm, "Stack is empty\n\n", sizeof("Stack is empty\n\n") - 1);
+	return;
+
+#undef STACK_CHECK
+}
+
+typedef void (*ExecFn)(Vm *vm, enum InstructionKind kind, union InstructionData *imm);
+
+static void exec_checked(Vm *vm, enum InstructionKind kind, union InstructionData *imm)
+{
+	exec_instruction(vm, kind, imm, false, false);
+}
+
+/* What an underflow goes back to, in memory before the instruction can fault */
+static inline __attribute__((always_inline)) void vm_fault_mark(Vm *vm)
+{
+	vm->fault_frame = vm->frame_ptr;
+	vm->fault_ptr = vm->frame_ptr->ptr;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+static void exec_guarded(Vm *vm, enum InstructionKind kind, union InstructionData *imm)
+{
+	vm_fault_mark(vm);
+	exec_instruction(vm, kind, imm, true, false);
+}
+
+static void exec_sandboxed(Vm *vm, enum InstructionKind kind, union InstructionData *imm)
+{
+	exec_instruction(vm, kind, imm, false, true);
+}
+
+static void exec_guarded_sandboxed(Vm *vm, enum InstructionKind kind, union InstructionData *imm)
+{
+	vm_fault_mark(vm);
+	exec_instruction(vm, kind, imm, true, true);
+}
+
+/* Back from `stack_fault`, the instruction is dropped like one that found the stack empty */
+static void vm_fault_underflow(Vm *vm)
+{
+	vm->frame_ptr = vm->fault_frame;
+	vm->frame_ptr->ptr = vm->fault_ptr;
+	vm_print(vm, "Stack is empty\n\n", sizeof("Stack is empty\n\n") - 1);
+}
+
+static ExecFn vm_exec(Vm *vm)
+{
+	static const ExecFn execs[2][2] = {
+		{ exec_checked, exec_sandboxed },
+		{ exec_guarded, exec_guarded_sandboxed },
+	};
+	return execs[vm->guarded][vm->sandbox != NULL];
+}
+
+static void vm_init_frame(Vm *vm)
+{
+	vm_push_frame(vm);
+	vm->frame_ptr->ptr = vm->stack.base;
+	vm->frame_ptr->start = vm->stack.base;
+	vm->frame_ptr->return_stack_ptr = vm->return_stack.base;
+	vm->frame_ptr->locals = vm->frame_ptr->local_storage;
+	if (vm->sandbox) vm->frame_ptr->locals = vm->sandbox + SANDBOX_LOCALS;
+	vm->frame_ptr->prev = NULL;
+}
+
+void vm_init(Vm *vm, Ctx *context)
+{
+	stack_init(&vm->stack, STACK_SIZE, STACK_RESERVE);
+	stack_init(&vm->return_stack, STACK_SIZE, RETURN_STACK_RESERVE);
+	vm->frame_ptr = NULL;
+	vm->guarded = false;
+	vm->fault_jump = NULL;
+	vm->sandbox = NULL;
+	vm_init_frame(vm);
+	vm->heap = (Heap){0};
+	vm->maps = NULL;
+	vm->map_len = 0;
+	memset(vm->channels, 0, sizeof(vm->channels));
+	vm->channel_len = 0;
+	vm->retired = NULL;
+	vm->bss = (DataRegion){0};
+	vm->bss_origin = NULL;
+	vm->streams = xmalloc(sizeof(*vm->streams) * STREAM_STD);
+	memset(vm->streams, 0, sizeof(*vm->streams) * STREAM_STD);
+	vm->stream_len = STREAM_STD;
+	vm_std_streams(vm);
+	vm->home = vm;
+	vm->scheduler = NULL;
+	vm->fiber = NULL;
+	vm->worker = 0;
+	vm->tick = 0;
+	vm->context = context;
+
+	vm->pc = 0;
+}
+
+void vm_private_bss(Vm *vm, DataRegion *bss)
+{
+	vm->bss_origin = bss->base;
+	if (!bss->len) return;
+	size_t cap = page_round(bss->len);
+	byte *base = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) panic("Failed to reserve the data segment\n");
+	vm->bss = (DataRegion){ .base = base, .len = bss->len, .cap = cap };
+}
+
+void vm_reset(Vm *vm)
+{
+	while (vm->frame_ptr) {
+		FramePointer *p = vm->frame_ptr;
+		vm->frame_ptr = vm->frame_ptr->prev;
+		free(p);
+	}
+	vm_init_frame(vm);
+	data_region_zero(&vm->bss, vm->context->data.huge_pages);
+	vm_clear_maps(vm);
+	vm_clear_channels(vm);
+	vm_clear_streams(vm);
+	heap_clear(&vm->heap);
+	vm->pc = 0;
+}
+
+void vm_destroy(Vm *vm)
+{
+	while (vm->frame_ptr) {
+		FramePointer *p = vm->frame_ptr;
+		vm->frame_ptr = vm->frame_ptr->prev;
+		free(p);
+	}
+	stack_destroy(&vm->stack);
+	stack_destroy(&vm->return_stack);
+	vm_clear_maps(vm);
+	vm_clear_channels(vm);
+	vm_clear_streams(vm);
+	for (size_t i = 0; i < vm->stream_len; ++i) free(vm->streams[i].buf);
+	free(vm->streams);
+	heap_destroy(&vm->heap);
+	if (vm->bss.base) munmap(vm->bss.base, vm->bss.cap);
+}
+
+#ifdef DEBUG
+/*
+ * Hold an instruction that ran to its end to the stack effect instructions.h
+ * gives it. Ones that jumped, parked, switched threads or found the stack
+ * empty are let through.
+ */
+static void vm_check_effect(Vm *vm, enum InstructionKind kind, FramePointer *frame, byte *before, size_t next)
+{
+	const InstructionInfo *info = &instruction_info[kind];
+	if (info->pop == EFFECT_VAR || info->push == EFFECT_VAR) return;
+	if (vm->frame_ptr != frame || vm->pc != next) return;
+	ptrdiff_t effect = frame->ptr - before;
+	if (effect == 0 && is_empty_stack(vm, info->pop)) return;
+	if (effect != info->push - info->pop) {
+		panic("%s moved the stack by %td bytes, instructions.h says %d\n", info->name, effect, info->push - info->pop);
+	}
+}
+#endif
+
+void vm_run(Vm *vm, Program *program)
+{
+	sigjmp_buf fault_jump;
+	sigjmp_buf *outer_jump = vm->fault_jump;
+	Vm *outer_vm = fault_vm;
+	pthread_once(&fault_once, fault_install);
+	fault_vm = vm;
+	if (vm->guarded) {
+		vm->fault_jump = &fault_jump;
+		if (sigsetjmp(fault_jump, 1)) vm_fault_underflow(vm);
+	}
+	ExecFn exec = vm_exec(vm);
+	do {
+		while (vm->pc < program->len) {
+			size_t pc = vm->pc++;
+#ifdef DEBUG
+			FramePointer *frame = vm->frame_ptr;
+			byte *before = frame->ptr;
+			exec(vm, program->ops[pc], &program->imms[pc]);
+			vm_check_effect(vm, program->ops[pc], frame, before, pc + 1);
+#else
+			exec(vm, program->ops[pc], &program->imms[pc]);
+#endif
+		}
+	} while (vm->scheduler && scheduler_exit(vm));
+	if (vm->scheduler && vm->home == vm) scheduler_destroy(vm);
+	if (vm->home == vm) vm_flush_streams(vm);
+	vm->fault_jump = outer_jump;
+	fault_vm = outer_vm;
+}
+
+void context_init(Ctx *context, const char *path)
+{
+	vm_init(&context->vm, context);
+	context->path = path;
+	context->parsing = false;
+	context->sandbox = NULL;
+	context->workers = 1;
+	program_init(&context->program);
+	context->data = (DataSegment){0};
+
+	context->arenas = NULL;
+	context->arena_len = 0;
+	context->source_map = NULL;
+	context->externs = NULL;
+	context->extern_len = 0;
+	context->extern_cap = 0;
+}
+
+/* Put the program back in its initial state so it can run again */
+static void context_reset(Ctx *context)
+{
+	vm_reset(&context->vm);
+	data_region_zero(&context->data.bss, context->data.huge_pages);
+}
+
+void context_destroy(Ctx *context)
+{
+	vm_destroy(&context->vm);
+	program_destroy(&context->program);
+	data_segment_destroy(&context->data);
+	if (context->sandbox) munmap(context->sandbox, 2 * SANDBOX_SIZE);
+	for (size_t i = 0; i < context->arena_len; ++i) {
+		arena_destroy(context->arenas[i]);
+	}
+	free(context->arenas);
+	source_map_destroy(context->source_map);
+	free(context->externs);
+}
+
+static bool resolve_load(Ctx *context, const char *data_name, void **data_ptr)
+{
+	DeclarationMap *declaration_map = &context->program.declaration_map;
+	for (size_t i = 0; i < declaration_map->len; ++i) {
+		Declaration *declaration = &declaration_map->declarations[i];
+		// TODO: Intern
+		if (strcmp(data_name, declaration->ident) == 0) {
+			*data_ptr = declaration->bytes;
+			if (context->sandbox) *data_ptr = (void *)(uintptr_t)((byte *)declaration->bytes - context->sandbox);
+			return true;
+		}
+	}
+	return false;
+}
+
+void begin_execution(Ctx *context)
+{
+	vm_run(&context->vm, &context->program);
+}
+
+static void chunk_push_error(ParseChunk *chunk, Span span, const char *error)
+{
+	if (chunk->error_len >= chunk->error_cap) {
+		chunk->error_cap *= 2;
+		chunk->errors =
+			xrealloc(chunk->errors, sizeof(*chunk->errors) * chunk->error_cap);
+	}
+	chunk->errors[chunk->error_len++] = (ParseError){
+		.span = span,
+		.error = error,
+	};
+}
+
+static void chunk_init(ParseChunk *chunk, const char *path, FILE *file, Arena *arena, off_t offset, size_t len)
+{
+	chunk->path = path;
+	chunk->file = file;
+	chunk->offset = offset;
+	chunk->len = len;
+	chunk->state = PARSE_TEXT;
+	chunk->end_state = PARSE_TEXT;
+	chunk->rows = 0;
+	chunk->arena = arena;
+	chunk->scratch_peak = 0;
+	chunk->sandboxed = false;
+	program_init(&chunk->program);
+
+	chunk->errors = xmalloc(sizeof(*chunk->errors) * 16);
+	chunk->error_cap = 16;
+	chunk->error_len = 0;
+	chunk->source_map = NULL;
+}
+
+static void chunk_reset(ParseChunk *chunk)
+{
+	program_clear(&chunk->program);
+	chunk->error_len = 0;
+	if (chunk->source_map) {
+		chunk->source_map->len = 0;
+		chunk->source_map->section_len = 0;
+	}
+	arena_clear(chunk->arena);
+}
+
+static void chunk_destroy(ParseChunk *chunk)
+{
+	program_destroy(&chunk->program);
+	free(chunk->errors);
+	source_map_destroy(chunk->source_map);
+}
+
+static void *parse_chunk(void *arg)
+{
+	ParseChunk *chunk = arg;
+	Arena *arena = chunk->arena;
+	Program *program = &chunk->program;
+	Parser parser = {0};
+	parser_init(&parser, arena, program, chunk->file, chunk->offset, chunk->len);
+	parser.state = chunk->state;
+
+	Node stmt;
+	Node *node = &stmt;
+	for (;;) {
+		/* TODO: Work on error recovery */
+		if (!parser_next(&parser, node)) {
+			chunk_push_error(chunk, parser.span, parser.error);
+			continue;
+		} else if (node->kind == N_EOF) {
+			break;
+		}
+
+		switch (node->kind) {
+		case N_INSTRUCTION: {
+			size_t i = program->len - 1;
+			const char *name = is_jump(program->ops[i]) ? jump_label(program, i) : NULL;
+			if (chunk->source_map) source_map_push(chunk->source_map, name);
+			if (name) reference_label(program, name, i);
+			const char *error = chunk->sandboxed ? sandbox_check(program, i) : NULL;
+			if (error) chunk_push_error(chunk, node->span, error);
+			break;
+		}
+		case N_LABEL:
+			if (!insert_label(program, node->data.s, program->len, node->span.start_row)) {
+				panic("Failed to create label");
+			}
+			break;
+		case N_DECLARATION:
+			if (chunk->sandboxed && node->data.declaration.kind == D_EXTERN) {
+				chunk_push_error(chunk, node->span, "extern is not available with --sandbox");
+			}
+			if (!insert_declaration(&program->declaration_map, node->data.declaration)) {
+				panic("Failed to create declaration");
+			}
+			break;
+		case N_SECTION:
+			if (chunk->source_map) source_map_push_section(chunk->source_map, node->span.start_row, node->data.section);
+			break;
+		case N_STACK:
+			stack_sizes_max(&program->stack, node->data.stack);
+			break;
+		default:
+			panic("Unimplemented");
+		}
+	}
+	chunk->end_state = parser.state;
+	chunk->rows = parser.lexer.row;
+	chunk->scratch_peak = parser.lexer.scratch->peak;
+	parser_destroy(&parser);
+
+	return NULL;
+}
+
+/* Split `[0, len)` into chunks that each end just after a newline */
+static size_t split_chunks(FILE *file, size_t len, long *offsets, size_t max)
+{
+	size_t n = 1;
+	long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+	if (len < PARALLEL_PARSE_MIN || nproc <= 1) return n;
+
+	size_t count = len / PARALLEL_CHUNK_MIN;
+	if (count > (size_t) nproc) count = nproc;
+	if (count > max) count = max;
+	size_t target = len / count;
+
+	for (size_t i = 1; i < count; ++i) {
+		long offset = target * i;
+		if (offset <= offsets[n - 1]) continue;
+		if (fseek(file, offset, SEEK_SET) < 0) break;
+		int c;
+		while ((c = fgetc(file)) != EOF && c != '\n') ++offset;
+		if (c == EOF) break;
+		offsets[n++] = offset + 1;
+	}
+	if (fseek(file, 0, SEEK_SET) < 0) panic("Failed to seek file\n");
+
+	return n;
+}
+
+static void context_push_arena(Ctx *context, Arena *arena)
+{
+	context->arenas = xrealloc(context->arenas, sizeof(*context->arenas) * (context->arena_len + 1));
+	context->arenas[context->arena_len++] = arena;
+}
+
+/*
+ * Append a parsed chunk to the context, shifting label locations by the
+ * number of instructions before it and rows by the lines before it.
+ */
+static int context_merge_chunk(Ctx *context, ParseChunk *chunk, size_t row_base)
+{
+	if (chunk->scratch_peak > context->scratch_peak) context->scratch_peak = chunk->scratch_peak;
+	int errcode = 0;
+	Program *program = &context->program;
+	size_t base = program->len;
+	program_reserve(program, base + chunk->program.len);
+	memcpy(&program->ops[base], chunk->program.ops, sizeof(*program->ops) * chunk->program.len);
+	memcpy(&program->imms[base], chunk->program.imms, sizeof(*program->imms) * chunk->program.len);
+	for (size_t i = 0; i < chunk->program.len; ++i) {
+		program->rows[base + i] = chunk->program.rows[i] + row_base;
+	}
+	program->len += chunk->program.len;
+	stack_sizes_max(&program->stack, chunk->program.stack);
+	if (context->source_map && chunk->source_map) {
+		SourceMap *source_map = chunk->source_map;
+		for (size_t i = 0; i < source_map->len; ++i) {
+			source_map_push(context->source_map, source_map->names[i]);
+		}
+		for (size_t i = 0; i < source_map->section_len; ++i) {
+			Section *section = &source_map->sections[i];
+			source_map_push_section(context->source_map, section->row + row_base, section->state);
+		}
+	}
+	LabelMap *label_map = &chunk->program.label_map;
+	for (size_t i = 0; i < label_map->len; ++i) {
+		Label *label = &label_map->labels[i];
+		if (label->location != LABEL_UNDEFINED) {
+			if (!insert_label(program, label->name, label->location + base, label->row + row_base)) {
+				panic("Failed to create label");
+			}
+			continue;
+		}
+		/* Jumps to labels outside of the chunk */
+		for (size_t f = label->fixup; f != FIXUP_NONE; f = label_map->fixups[f].next) {
+			size_t j = label_map->fixups[f].instruction + base;
+			reference_label(program, label->name, j);
+		}
+	}
+	for (size_t i = 0; i < chunk->program.declaration_map.len; ++i) {
+		Declaration declaration = chunk->program.declaration_map.declarations[i];
+		declaration.span.start_row += row_base;
+		declaration.span.end_row += row_base;
+		if (!data_segment_place(&context->data, &declaration)) {
+			fprintf(stderr, "%s:%zu:%zu:Failed to map %s:%s\n", chunk->path, declaration.span.start_row,
+				declaration.span.start_col, declaration.path, strerror(errno));
+			errcode = -1;
+		}
+		if (!insert_declaration(&program->declaration_map, declaration)) {
+			panic("Failed to create declaration");
+		}
+	}
+	for (size_t i = 0; i < chunk->error_len; ++i) {
+		ParseError *error = &chunk->errors[i];
+		size_t row = error->span.start_row + row_base;
+		fprintf(stderr, "%s:%zu:%zu:Parse failed:%s\n", chunk->path, row, error->span.start_col, error->error);
+		errcode = -1;
+	}
+
+	return errcode;
+}
+
+/* Turn the jumpprocs waiting on `label` into calls of the extern of that name. 1 when there is no such extern */
+static int resolve_extern(Ctx *context, Label *label)
+{
+	size_t slot = extern_slot(context, label->name);
+	if (slot == SIZE_MAX) return 1;
+	Program *program = &context->program;
+	LabelMap *label_map = &program->label_map;
+	for (size_t f = label->fixup; f != FIXUP_NONE; f = label_map->fixups[f].next) {
+		size_t i = label_map->fixups[f].instruction;
+		if (program->ops[i] != I_JUMPPROC) {
+			fprintf(stderr, "%s:%zu:Only jumpproc can call the extern %s\n", context->path, program->rows[i], label->name);
+			return -1;
+		}
+		program->ops[i] = I_CALLEXT;
+		program->imms[i].proc.location.offset = slot;
+	}
+	return 0;
+}
+
+/* Reported at the first jump to it */
+static void label_missing(Ctx *context, Label *label)
+{
+	Program *program = &context->program;
+	LabelMap *label_map = &program->label_map;
+	size_t first = SIZE_MAX;
+	for (size_t f = label->fixup; f != FIXUP_NONE; f = label_map->fixups[f].next) {
+		if (label_map->fixups[f].instruction < first) first = label_map->fixups[f].instruction;
+	}
+	if (first == SIZE_MAX) fprintf(stderr, "%s:Jump location doesn't exist:%s\n", context->path, label->name);
+	else fprintf(stderr, "%s:%zu:Jump location doesn't exist:%s\n", context->path, program->rows[first], label->name);
+}
+
+static int resolve_instructions(Ctx *context)
+{
+	int errcode = 0;
+	Program *program = &context->program;
+	context->extern_len = 0;
+	for (size_t i = 0; i < program->len; ++i) {
+		if (program->ops[i] != I_CALLEXT) continue;
+		const char *name = program->imms[i].proc.location.s;
+		size_t slot = extern_slot(context, name);
+		if (slot == SIZE_MAX) {
+			fprintf(stderr, "%s:Extern does not exist\n", name);
+			errcode = -1;
+			continue;
+		}
+		program->imms[i].proc.location.offset = slot;
+	}
+
+	LabelMap *label_map = &context->program.label_map;
+	for (size_t i = 0; i < label_map->len; ++i) {
+		Label *label = &label_map->labels[i];
+		if (label->location != LABEL_UNDEFINED) continue;
+		int status = resolve_extern(context, label);
+		if (status > 0) label_missing(context, label);
+		if (status) errcode = -1;
+	}
+
+	for (size_t i = 0; i < program->len; ++i) {
+		if (program->ops[i] == I_PPUSH) {
+			void *data_ptr;
+			if (!resolve_load(context, program->imms[i].lit.data.s, &data_ptr)) {
+				fprintf(stderr, "%s:Data name does not exist\n", program->imms[i].lit.data.s);
+				errcode = -1;
+				continue;
+			}
+			program->imms[i].ptr = data_ptr;
+		}
+	}
+
+	return errcode;
+}
+
+int parse_src(Ctx *context, Arena *arena, const char *filename, FILE *file, const size_t len)
+{
+	int errcode = 0;
+	long offsets[PARALLEL_CHUNK_MAX];
+	ParseChunk chunks[PARALLEL_CHUNK_MAX];
+	size_t chunk_len = 1;
+	offsets[0] = 0;
+	/* Chunks pread the one fd, memory streams from fmemopen have none */
+	if (len != LEXER_UNBOUNDED && fileno(file) >= 0) chunk_len = split_chunks(file, len, offsets, PARALLEL_CHUNK_MAX);
+
+	for (size_t i = 0; i < chunk_len; ++i) {
+		size_t end = i + 1 < chunk_len ? (size_t) offsets[i + 1] : len;
+		size_t chunk_size = len == LEXER_UNBOUNDED ? len : end - offsets[i];
+		Arena *chunk_arena = arena;
+		if (i > 0) {
+			chunk_arena = arena_create(arena->size);
+			context_push_arena(context, chunk_arena);
+		}
+		chunk_init(&chunks[i], filename, file, chunk_arena, chunk_len > 1 ? offsets[i] : -1, chunk_size);
+		if (context->source_map) chunks[i].source_map = source_map_create();
+		chunks[i].sandboxed = context->sandbox != NULL;
+	}
+
+	if (chunk_len == 1) {
+		parse_chunk(&chunks[0]);
+	} else {
+		for (size_t i = 0; i < chunk_len; ++i) {
+			if (pthread_create(&chunks[i].thread, NULL, parse_chunk, &chunks[i])) {
+				panic("Failed to spawn parse worker\n");
+			}
+		}
+		for (size_t i = 0; i < chunk_len; ++i) {
+			pthread_join(chunks[i].thread, NULL);
+		}
+	}
+
+	size_t row_base = 0;
+	for (size_t i = 0; i < chunk_len; ++i) {
+		ParseChunk *chunk = &chunks[i];
+		/* Guessed the wrong section for this chunk */
+		if (i > 0 && chunk->state != chunks[i - 1].end_state) {
+			chunk_reset(chunk);
+			chunk->state = chunks[i - 1].end_state;
+			parse_chunk(chunk);
+		}
+		if (context_merge_chunk(context, chunk, row_base)) errcode = -1;
+		row_base += chunk->rows;
+	}
+
+	for (size_t i = 0; i < chunk_len; ++i) {
+		chunk_destroy(&chunks[i]);
+	}
+	data_segment_seal(&context->data);
+	if (errcode != 0) return errcode;
+	if (vm_commit_stacks(&context->vm, context->program.stack)) return -1;
+
+	return resolve_instructions(context);
+}
+
+static void pipeline_init(Pipeline *pipeline, Ctx *context, Arena *arena, const char *path, FILE *file, size_t len)
+{
+	pipeline->op_blocks = calloc(PIPELINE_BLOCK_MAX, sizeof(*pipeline->op_blocks));
+	pipeline->imm_blocks = calloc(PIPELINE_BLOCK_MAX, sizeof(*pipeline->imm_blocks));
+	if (!pipeline->op_blocks || !pipeline->imm_blocks) panic("Failed to allocate pipeline\n");
+	pipeline->frontier = 0;
+	pipeline->unresolved = xmalloc(PIPELINE_BLOCK_SIZE);
+	pipeline->unresolved_cap = PIPELINE_BLOCK_SIZE;
+
+	pipeline->published = 0;
+	pipeline->waiting = 0;
+	pipeline->done = false;
+	pipeline->errcode = 0;
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->cond, NULL);
+
+	pipeline->context = context;
+	pipeline->arena = arena;
+	pipeline->path = path;
+	pipeline->file = file;
+	pipeline->file_len = len;
+}
+
+static void pipeline_destroy(Pipeline *pipeline)
+{
+	for (size_t i = 0; i < PIPELINE_BLOCK_MAX && pipeline->op_blocks[i]; ++i) {
+		free(pipeline->op_blocks[i]);
+		free(pipeline->imm_blocks[i]);
+	}
+	free(pipeline->op_blocks);
+	free(pipeline->imm_blocks);
+	free(pipeline->unresolved);
+	pthread_mutex_destroy(&pipeline->lock);
+	pthread_cond_destroy(&pipeline->cond);
+}
+
+/* Start tracking the instruction the parser just appended at `i` */
+static void pipeline_track(Pipeline *pipeline, size_t i)
+{
+	if (i / PIPELINE_BLOCK_SIZE >= PIPELINE_BLOCK_MAX) panic("Program too large to pipeline\n");
+	if (i >= pipeline->unresolved_cap) {
+		pipeline->unresolved_cap *= 2;
+		pipeline->unresolved = xrealloc(pipeline->unresolved, pipeline->unresolved_cap);
+	}
+	pipeline->unresolved[i] = 0;
+}
+
+/* Copy `[from, to)` of the program into the blocks, only called by the parser thread */
+static void pipeline_copy(Pipeline *pipeline, size_t from, size_t to)
+{
+	Program *program = &pipeline->context->program;
+	for (size_t i = from; i < to; ++i) {
+		size_t block = i / PIPELINE_BLOCK_SIZE;
+		if (i % PIPELINE_BLOCK_SIZE == 0) {
+			pipeline->op_blocks[block] = xmalloc(sizeof(**pipeline->op_blocks) * PIPELINE_BLOCK_SIZE);
+			pipeline->imm_blocks[block] = xmalloc(sizeof(**pipeline->imm_blocks) * PIPELINE_BLOCK_SIZE);
+		}
+		pipeline->op_blocks[block][i % PIPELINE_BLOCK_SIZE] = program->ops[i];
+		pipeline->imm_blocks[block][i % PIPELINE_BLOCK_SIZE] = program->imms[i];
+	}
+}
+
+/* Advance the frontier past resolved instructions and hand them over */
+static void pipeline_publish(Pipeline *pipeline)
+{
+	size_t len = pipeline->context->program.len;
+	size_t frontier = pipeline->frontier;
+	while (frontier < len && !pipeline->unresolved[frontier]) ++frontier;
+	if (frontier == pipeline->frontier) return;
+	pipeline_copy(pipeline, pipeline->frontier, frontier);
+	pipeline->frontier = frontier;
+
+	__atomic_store_n(&pipeline->published, frontier, __ATOMIC_SEQ_CST);
+	/* Only pay for the lock when the interpreter is actually parked */
+	if (__atomic_load_n(&pipeline->waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pipeline->lock);
+		pthread_cond_signal(&pipeline->cond);
+		pthread_mutex_unlock(&pipeline->lock);
+	}
+}
+
+static void pipeline_finish(Pipeline *pipeline, int errcode)
+{
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->errcode = errcode;
+	__atomic_store_n(&pipeline->done, true, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+/* Block until the instruction at `pc` is published, or parsing is over */
+static size_t pipeline_wait(Pipeline *pipeline, size_t pc)
+{
+	size_t published;
+	/* Give the parser a chance to catch up before parking */
+	for (int spin = 0; spin < PIPELINE_SPIN; ++spin) {
+		published = __atomic_load_n(&pipeline->published, __ATOMIC_ACQUIRE);
+		if (pc < published) return published;
+		sched_yield();
+	}
+
+	pthread_mutex_lock(&pipeline->lock);
+	__atomic_store_n(&pipeline->waiting, 1, __ATOMIC_SEQ_CST);
+	while ((published = __atomic_load_n(&pipeline->published, __ATOMIC_SEQ_CST)) <= pc && !pipeline->done) {
+		pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+	}
+	__atomic_store_n(&pipeline->waiting, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pipeline->lock);
+	return published;
+}
+
+static void *parse_pipelined(void *arg)
+{
+	Pipeline *pipeline = arg;
+	Ctx *context = pipeline->context;
+	Program *program = &context->program;
+	LabelMap *label_map = &program->label_map;
+	int errcode = 0;
+	Parser parser = {0};
+	parser_init(&parser, pipeline->arena, program, pipeline->file, -1, pipeline->file_len);
+
+	Node stmt;
+	Node *node = &stmt;
+	for (;;) {
+		if (!parser_next(&parser, node)) {
+			Span span = parser.span;
+			fprintf(stderr, "%s:%zu:%zu:Parse failed:%s\n", pipeline->path, span.start_row, span.start_col, parser.error);
 			errcode = -1;
 			continue;
 		} else if (node->kind == N_EOF) {
@@ -546,100 +3277,727 @@ static int parse_src(Ctx *context, Arena *arena, const char *filename, FILE *fil
 		}
 
 		switch (node->kind) {
-		case N_INSTRUCTION:
-			/* Get the offset since the region can reallocate */
-			context_push_instruction(context, (Instruction *) ((size_t) &node->data.instruction - (size_t) arena->region));
+		case N_INSTRUCTION: {
+			size_t i = program->len - 1;
+			pipeline_track(pipeline, i);
+			const char *error = context->sandbox ? sandbox_check(program, i) : NULL;
+			if (error) {
+				fprintf(stderr, "%s:%zu:%zu:Parse failed:%s\n", pipeline->path, node->span.start_row, node->span.start_col, error);
+				errcode = -1;
+			}
+			if (is_jump(program->ops[i])) {
+				if (!reference_label(program, jump_label(program, i), i)) {
+					pipeline->unresolved[i] = 1;
+				}
+			} else if (program->ops[i] == I_CALLEXT) {
+				/* Calls wait for the parse to end, so the table can still grow under them */
+				size_t slot = extern_slot(context, program->imms[i].proc.location.s);
+				if (slot != SIZE_MAX) program->imms[i].proc.location.offset = slot;
+				else pipeline->unresolved[i] = 1;
+			} else if (program->ops[i] == I_PPUSH) {
+				void *data_ptr;
+				if (resolve_load(context, program->imms[i].lit.data.s, &data_ptr)) {
+					program->imms[i].ptr = data_ptr;
+				} else {
+					pipeline->unresolved[i] = 1;
+				}
+			}
 			break;
-		case N_LABEL:
-			if (!insert_label(&context->label_map, node->data.s, context->instruction_len)) {
+		}
+		case N_LABEL: {
+			Label *label = label_map_get(label_map, node->data.s);
+			for (size_t f = label->fixup; f != FIXUP_NONE; f = label_map->fixups[f].next) {
+				pipeline->unresolved[label_map->fixups[f].instruction] = 0;
+			}
+			if (!insert_label(program, node->data.s, program->len, node->span.start_row)) {
 				panic("Failed to create label");
 			}
 			break;
-		case N_DECLARATION:
-			if (!insert_declaration(&context->declaration_map, node->data.declaration)) {
+		}
+		case N_DECLARATION: {
+			Declaration *declaration = &node->data.declaration;
+			if (context->sandbox && declaration->kind == D_EXTERN) {
+				fprintf(stderr, "%s:%zu:%zu:Parse failed:extern is not available with --sandbox\n", pipeline->path,
+					declaration->span.start_row, declaration->span.start_col);
+				errcode = -1;
+			}
+			if (!data_segment_place(&context->data, declaration)) {
+				fprintf(stderr, "%s:%zu:%zu:Failed to map %s:%s\n", pipeline->path, declaration->span.start_row,
+					declaration->span.start_col, declaration->path, strerror(errno));
+				errcode = -1;
+			}
+			if (!insert_declaration(&program->declaration_map, node->data.declaration)) {
 				panic("Failed to create declaration");
 			}
 			break;
+		}
+		case N_SECTION:
+			break;
+		/* The interpreter may already be growing the stacks, let them */
+		case N_STACK:
+			break;
 		default:
 			panic("Unimplemented");
 		}
+
+		/* Nothing after a parse error gets to run */
+		if (errcode == 0) pipeline_publish(pipeline);
 	}
-	if (errcode != 0) return errcode;
-	// Resolve labels
-	for (size_t i = 0; i < context->instruction_len; ++i) {
-		/* Set the offset back to the region address */
-		context->instructions[i] = (Instruction *) ((size_t) arena->region + (size_t) context->instructions[i]);
-		Instruction *instruction = context->instructions[i];
-		if (instruction->kind == I_JUMP || instruction->kind == I_JUMPCMP) {
-			ssize_t location;
-			if (!label_location(context, instruction->data.s, &location)) {
-				// TODO: Handle better
-				panic("%s:Jump location doesn't exist\n", instruction->data.s);
-			}
 
-			instruction->data.offset = location - i - 1;
+	/* Like `resolve_instructions`, for what is still behind the frontier */
+	if (errcode == 0) {
+		for (size_t i = 0; i < label_map->len; ++i) {
+			Label *label = &label_map->labels[i];
+			if (label->location != LABEL_UNDEFINED) continue;
+			int status = resolve_extern(context, label);
+			if (status > 0) label_missing(context, label);
+			if (status) {
+				errcode = -1;
+				continue;
+			}
+			for (size_t f = label->fixup; f != FIXUP_NONE; f = label_map->fixups[f].next) {
+				pipeline->unresolved[label_map->fixups[f].instruction] = 0;
+			}
+		}
+		for (size_t i = pipeline->frontier; i < program->len; ++i) {
+			if (!pipeline->unresolved[i]) continue;
+			if (program->ops[i] == I_CALLEXT) {
+				const char *name = program->imms[i].proc.location.s;
+				size_t slot = extern_slot(context, name);
+				if (slot == SIZE_MAX) {
+					fprintf(stderr, "%s:Extern does not exist\n", name);
+					errcode = -1;
+					continue;
+				}
+				program->imms[i].proc.location.offset = slot;
+				pipeline->unresolved[i] = 0;
+			} else if (program->ops[i] == I_PPUSH) {
+				/* Loads of data declared after their use */
+				void *data_ptr;
+				if (!resolve_load(context, program->imms[i].lit.data.s, &data_ptr)) {
+					fprintf(stderr, "%s:Data name does not exist\n", program->imms[i].lit.data.s);
+					errcode = -1;
+					continue;
+				}
+				program->imms[i].ptr = data_ptr;
+				pipeline->unresolved[i] = 0;
+			}
 		}
+	}
+	if (errcode == 0) pipeline_publish(pipeline);
+	data_segment_seal(&context->data);
+	context->scratch_peak = parser.lexer.scratch->peak;
+	parser_destroy(&parser);
+	pipeline_finish(pipeline, errcode);
+
+	return NULL;
+}
+
+/* Instructions that wait for the parse to succeed, with `hold` all of those with effects outside the process */
+static bool pipeline_waits(Pipeline *pipeline, uint8_t op)
+{
+	if (op == I_CALLEXT) return true;
+	return pipeline->hold && (op == I_SOPEN || op == I_SCLOSE || op == I_SYNC);
+}
+
+/* Once parsing is over, let any held output out or end the run on a parse error */
+static bool pipeline_release(Pipeline *pipeline, Vm *vm)
+{
+	pipeline->parsing = false;
+	if (pipeline->hold) vm_release_streams(vm, pipeline->errcode != 0);
+	return pipeline->errcode == 0;
+}
+
+/* Run instructions as soon as the parser thread has resolved them */
+static int run_pipelined(Ctx *context, Arena *arena, const char *path, FILE *file, size_t len, bool hold)
+{
+	Pipeline pipeline = {0};
+	pipeline_init(&pipeline, context, arena, path, file, len);
+	pipeline.hold = hold;
+	context->parsing = true;
+	if (pthread_create(&pipeline.thread, NULL, parse_pipelined, &pipeline)) {
+		panic("Failed to spawn parser thread\n");
+	}
 
-		if (instruction->kind == I_JUMPPROC) {
-			ssize_t location;
-			if (!label_location(context, instruction->data.proc.location.s, &location)) {
-				// TODO: Handle better
-				panic("%s:Jump location doesn't exist\n", instruction->data.s);
+	size_t published = 0;
+	Vm *vm = &context->vm;
+	sigjmp_buf fault_jump;
+	pthread_once(&fault_once, fault_install);
+	fault_vm = vm;
+	if (vm->guarded) {
+		vm->fault_jump = &fault_jump;
+		if (sigsetjmp(fault_jump, 1)) {
+			vm_fault_underflow(vm);
+			/* Lost with the jump, ask again */
+			published = 0;
+		}
+	}
+	ExecFn exec = vm_exec(vm);
+	/* Green threads stay on this thread, the others can't follow the parser */
+	context->workers = 1;
+	pipeline.parsing = true;
+	if (hold) vm_hold_streams(vm);
+	for (;;) {
+		if (pipeline.parsing && __atomic_load_n(&pipeline.done, __ATOMIC_ACQUIRE) && !pipeline_release(&pipeline, vm)) break;
+		if (vm->pc >= published) {
+			if (vm->pc != FIBER_EXIT) published = pipeline_wait(&pipeline, vm->pc);
+			if (vm->pc >= published) {
+				if (vm->scheduler && scheduler_exit(vm)) continue;
+				break;
 			}
-			instruction->data.proc.location.offset = location - i - 1;
 		}
+		size_t pc = vm->pc;
+		size_t block = pc / PIPELINE_BLOCK_SIZE;
+		uint8_t op = pipeline.op_blocks[block][pc % PIPELINE_BLOCK_SIZE];
+		if (pipeline.parsing && pipeline_waits(&pipeline, op)) {
+			pipeline_wait(&pipeline, FIBER_EXIT - 1);
+			continue;
+		}
+		vm->pc++;
+		exec(vm, op, &pipeline.imm_blocks[block][pc % PIPELINE_BLOCK_SIZE]);
+	}
+
+	if (vm->scheduler) scheduler_destroy(vm);
+	pthread_join(pipeline.thread, NULL);
+	if (pipeline.parsing) pipeline_release(&pipeline, vm);
+	vm_flush_streams(vm);
+	vm->fault_jump = NULL;
+	fault_vm = NULL;
+	int errcode = pipeline.errcode;
+	pipeline_destroy(&pipeline);
+	return errcode;
+}
+
+char *read_stream(FILE *f, size_t *len)
+{
+	size_t cap = 1024 * 64;
+	char *buf = xmalloc(cap);
+	size_t n = 0;
+	size_t got;
+	while ((got = fread(buf + n, 1, cap - n, f)) > 0) {
+		n += got;
+		if (n == cap) buf = xrealloc(buf, cap *= 2);
+	}
+	*len = n;
+	return buf;
+}
+
+char *read_file(const char *path, size_t *len)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) return NULL;
+	char *buf = read_stream(f, len);
+	fclose(f);
+	return buf;
+}
+
+size_t count_lines(const char *src, size_t len)
+{
+	size_t lines = 0;
+	for (const char *p = src; (p = memchr(p, '\n', len - (p - src))); ++p) ++lines;
+	if (len && src[len - 1] != '\n') ++lines;
+	return lines;
+}
+
+static bool watch_stat(Watch *watch, struct stat *sb)
+{
+	if (stat(watch->path, sb) < 0) return false;
+	return sb->st_size != watch->size
+		|| sb->st_mtim.tv_sec != watch->mtime.tv_sec
+		|| sb->st_mtim.tv_nsec != watch->mtime.tv_nsec;
+}
+
+/* Sleep until the watched file changes, returning its new contents */
+static char *watch_wait(Watch *watch, size_t *len)
+{
+	struct timespec poll = { 0, WATCH_POLL_NS };
+	struct stat sb;
+	for (;;) {
+		while (!watch_stat(watch, &sb)) nanosleep(&poll, NULL);
+		watch->mtime = sb.st_mtim;
+		watch->size = sb.st_size;
+		char *src = read_file(watch->path, len);
+		if (!src) continue;
+		if (*len != watch->len || memcmp(src, watch->src, *len) != 0) return src;
+		free(src);
+	}
+}
+
+static void watch_accept(Watch *watch, char *src, size_t len)
+{
+	free(watch->src);
+	watch->src = src;
+	watch->len = len;
+	watch->lines = count_lines(src, len);
+}
+
+/* Throw away the whole program and parse it from scratch */
+static int watch_full(Ctx *context, Arena *arena, Watch *watch)
+{
+	program_clear(&context->program);
+	data_segment_clear(&context->data);
+	context->source_map->len = 0;
+	context->source_map->section_len = 0;
+	for (size_t i = 0; i < context->arena_len; ++i) {
+		arena_destroy(context->arenas[i]);
+	}
+	context->arena_len = 0;
+	arena_clear(arena);
+
+	FILE *f = fopen(watch->path, "rb");
+	if (!f) {
+		fprintf(stderr, "%s: cannot open\n", watch->path);
+		return -1;
+	}
+	int errcode = parse_src(context, arena, watch->path, f, watch->len);
+	fclose(f);
+	watch->stale = errcode != 0;
+	return errcode;
+}
+
+/*
+ * Splice a freshly parsed chunk over the instructions that came from rows
+ * `(row_lo, row_hi]` of the old source. Rows after the edit move by
+ * `drow`. Only jumps whose target may have moved are re-resolved.
+ */
+static int context_splice_chunk(Ctx *context, ParseChunk *chunk, size_t row_lo, size_t row_hi, ssize_t drow)
+{
+	Program *program = &context->program;
+	SourceMap *source_map = context->source_map;
+	SourceMap *chunk_map = chunk->source_map;
+	size_t start = program_find_row(program, row_lo);
+	size_t old_end = program_find_row(program, row_hi);
+	size_t n_new = chunk->program.len;
+	ssize_t dcount = n_new - (old_end - start);
+	size_t suffix = program->len - old_end;
+	size_t len = program->len + dcount;
+
+	/* Move the instructions after the edit and drop the new ones in */
+	program_reserve(program, len);
+	source_map_reserve(source_map, len);
+	memmove(&program->ops[start + n_new], &program->ops[old_end], sizeof(*program->ops) * suffix);
+	memmove(&program->imms[start + n_new], &program->imms[old_end], sizeof(*program->imms) * suffix);
+	memmove(&program->rows[start + n_new], &program->rows[old_end], sizeof(*program->rows) * suffix);
+	memmove(&source_map->names[start + n_new], &source_map->names[old_end], sizeof(*source_map->names) * suffix);
+	memcpy(&program->ops[start], chunk->program.ops, sizeof(*program->ops) * n_new);
+	memcpy(&program->imms[start], chunk->program.imms, sizeof(*program->imms) * n_new);
+	for (size_t i = 0; i < n_new; ++i) {
+		program->rows[start + i] = chunk->program.rows[i] + row_lo;
+		source_map->names[start + i] = chunk_map->names[i];
+	}
+	for (size_t i = start + n_new; i < len; ++i) program->rows[i] += drow;
+	program->len = len;
+	source_map->len = len;
+
+	/* Sections */
+	size_t kept = 0;
+	Section *sections = source_map->sections;
+	size_t section_len = source_map->section_len;
+	Section *merged = xmalloc(sizeof(*merged) * (section_len + chunk_map->section_len + 1));
+	for (size_t i = 0; i < section_len && sections[i].row <= row_lo; ++i) merged[kept++] = sections[i];
+	for (size_t i = 0; i < chunk_map->section_len; ++i) {
+		merged[kept] = chunk_map->sections[i];
+		merged[kept++].row += row_lo;
+	}
+	for (size_t i = 0; i < section_len; ++i) {
+		if (sections[i].row <= row_hi) continue;
+		merged[kept] = sections[i];
+		merged[kept++].row += drow;
+	}
+	free(source_map->sections);
+	source_map->sections = merged;
+	source_map->section_len = kept;
+	source_map->section_cap = section_len + chunk_map->section_len + 1;
+
+	/* Rebuild the labels in source order */
+	/* Rebuilt without fixups, so inserting never patches anything */
+	LabelMap old = program->label_map;
+	LabelMap *label_map = &program->label_map;
+	label_map_init(label_map);
+	for (size_t i = 0; i < old.len; ++i) {
+		Label *label = &old.labels[i];
+		if (label->row <= row_lo) insert_label(program, label->name, label->location, label->row);
+	}
+	for (size_t i = 0; i < chunk->program.label_map.len; ++i) {
+		Label *label = &chunk->program.label_map.labels[i];
+		if (label->location == LABEL_UNDEFINED) continue;
+		insert_label(program, label->name, label->location + start, label->row + row_lo);
+	}
+	for (size_t i = 0; i < old.len; ++i) {
+		Label *label = &old.labels[i];
+		if (label->row > row_hi) insert_label(program, label->name, label->location + dcount, label->row + drow);
+	}
+	label_map_destroy(&old);
 
-		if (instruction->kind == I_PPUSH) {
+	int errcode = 0;
+	for (size_t i = 0; i < len; ++i) {
+		const char *name = source_map->names[i];
+		bool in_chunk = i >= start && i < start + n_new;
+		/* Errors are left for the full re-parse that follows to report */
+		if (in_chunk && program->ops[i] == I_PPUSH) {
 			void *data_ptr;
-			if (!resolve_load(context, instruction->data.lit.data.s, &data_ptr)) {
-				// TODO: Handle better
-				panic("%s:Data name does not exist\n", instruction->data.lit.data.s);
+			if (!resolve_load(context, program->imms[i].lit.data.s, &data_ptr)) {
+				errcode = -1;
+				continue;
+			}
+			program->imms[i].ptr = data_ptr;
+			continue;
+		}
+		if (!name) continue;
+
+		if (!in_chunk) {
+			size_t old_i = i < start ? i : i - dcount;
+			size_t target = old_i + 1 + jump_offset(program, i);
+			bool before = target < start;
+			bool after = target > old_end;
+			/* Both ends on the same side of the edit */
+			if ((before && i < start) || (after && i >= start + n_new)) continue;
+			/* Jumps across the edit just move by the instruction delta */
+			if (before || after) {
+				patch_jump(program, i, (before ? target : target + dcount));
+				continue;
 			}
-			instruction->data.ptr = data_ptr;
 		}
+
+		Label *label = label_map_get(label_map, name);
+		if (label->location == LABEL_UNDEFINED) {
+			errcode = -1;
+			continue;
+		}
+		patch_jump(program, i, label->location);
+	}
+
+	return errcode;
+}
+
+/* Re-parse only the lines that differ between the resident program and `src` */
+static int watch_update(Ctx *context, Watch *watch, char *src, size_t len)
+{
+	if (watch->stale) return -1;
+
+	/* Common prefix, in whole lines */
+	size_t prefix_lines = 0;
+	size_t prefix_off = 0;
+	for (size_t i = 0; i < len && i < watch->len && src[i] == watch->src[i]; ++i) {
+		if (src[i] == '\n') {
+			++prefix_lines;
+			prefix_off = i + 1;
+		}
+	}
+
+	/* Common suffix, in whole lines, not overlapping the prefix */
+	size_t suffix = 0;
+	while (suffix < len - prefix_off && suffix < watch->len - prefix_off
+			&& src[len - 1 - suffix] == watch->src[watch->len - 1 - suffix]) {
+		++suffix;
+	}
+	size_t suffix_off = len - suffix;
+	while (suffix_off < len && suffix_off > prefix_off && src[suffix_off - 1] != '\n') ++suffix_off;
+	size_t suffix_lines = count_lines(src + suffix_off, len - suffix_off);
+
+	size_t lines = count_lines(src, len);
+	size_t row_lo = prefix_lines;
+	size_t row_hi = watch->lines - suffix_lines;
+	SourceMap *source_map = context->source_map;
+
+	/* Declarations own memory that running code may point at */
+	for (size_t i = 0; i < context->program.declaration_map.len; ++i) {
+		size_t row = context->program.declaration_map.declarations[i].span.start_row;
+		if (row > row_lo && row <= row_hi) return -1;
+	}
+
+	/* The old splices can only go all at once, with a full re-parse */
+	size_t held = 0;
+	for (size_t i = 0; i < context->arena_len; ++i) {
+		held += context->arenas[i]->size + context->arenas[i]->retired_used;
+	}
+	if (held > WATCH_SPLICE_MAX) return -1;
+
+	Arena *arena = arena_create(1024 * 32);
+	context_push_arena(context, arena);
+	/* From the source that was diffed, the file may have changed again since */
+	FILE *file = suffix_off > prefix_off ? fmemopen(src + prefix_off, suffix_off - prefix_off, "rb") : NULL;
+	ParseChunk chunk = {0};
+	chunk_init(&chunk, watch->path, file, arena, -1, suffix_off - prefix_off);
+	chunk.state = source_map_state(source_map, row_lo);
+	chunk.source_map = source_map_create();
+	chunk.sandboxed = context->sandbox != NULL;
+	parse_chunk(&chunk);
+	if (file) fclose(file);
+
+	int errcode = 0;
+	for (size_t i = 0; i < chunk.error_len; ++i) {
+		ParseError *error = &chunk.errors[i];
+		fprintf(stderr, "%s:%zu:%zu:Parse failed:%s\n", watch->path, error->span.start_row + row_lo, error->span.start_col, error->error);
+		errcode = -2;
+	}
+	/* A section change, new data or a stack directive leaks past the edit */
+	if (chunk.end_state != source_map_state(source_map, row_hi) || chunk.program.declaration_map.len > 0
+			|| chunk.program.stack.operand || chunk.program.stack.ret) {
+		errcode = -1;
+	}
+	if (errcode == 0) {
+		errcode = context_splice_chunk(context, &chunk, row_lo, row_hi, (ssize_t) lines - watch->lines);
+		if (errcode) watch->stale = true;
 	}
+	chunk_destroy(&chunk);
 
 	return errcode;
 }
 
+/* Run the program, then re-assemble and re-run it every time the file changes */
+static int watch_program(Ctx *context, Arena *arena, const char *path)
+{
+	Watch watch = {0};
+	watch.path = path;
+	watch.size = -1;
+	context->source_map = source_map_create();
+
+	size_t len;
+	char *src = watch_wait(&watch, &len);
+	watch_accept(&watch, src, len);
+	bool ok = watch_full(context, arena, &watch) == 0;
+
+	for (;;) {
+		if (ok) {
+			begin_execution(context);
+			fflush(stdout);
+		}
+		fprintf(stderr, "--- watching %s\n", path);
+
+		src = watch_wait(&watch, &len);
+		int errcode = watch_update(context, &watch, src, len);
+		if (errcode == -2) {
+			/* Keep the last good program, the next edit diffs against it */
+			free(src);
+			ok = false;
+			continue;
+		}
+		watch_accept(&watch, src, len);
+		if (errcode) errcode = watch_full(context, arena, &watch);
+		ok = errcode == 0;
+		if (ok) context_reset(context);
+	}
+
+	return 0;
+}
+
+void vm_push_input(Vm *vm, const char *input, size_t len)
+{
+	byte *copy = heap_alloc(&vm->heap, len + 1);
+	if (!copy) panic("Heap is full\n");
+	memcpy(copy, input, len);
+	copy[len] = '\0';
+	uint64_t len64 = len;
+	push_stack(vm, &copy, sizeof(copy), false);
+	push_stack(vm, &len64, sizeof(len64), false);
+}
+
+void vm_call_proc(Vm *vm, Program *program, size_t pc, const void *args, size_t argc)
+{
+	if (argc) push_stack(vm, (void *) args, argc, vm->guarded);
+	vm->pc = program->len;
+	vm_enter(vm, pc, argc, vm->guarded, vm->sandbox != NULL);
+	vm_run(vm, program);
+}
+
+static void print_stats(Ctx *context, Arena *arena)
+{
+	size_t parse_peak = arena->peak;
+	for (size_t i = 0; i < context->arena_len; ++i) {
+		parse_peak += context->arenas[i]->peak;
+	}
+	fprintf(stderr, "arena: parse   %zu bytes peak over %zu arenas\n", parse_peak, context->arena_len + 1);
+	fprintf(stderr, "arena: scratch %zu bytes peak\n", context->scratch_peak);
+
+	Heap *heap = &context->vm.heap;
+	fprintf(stderr, "heap:  %zu bytes live, %zu bytes peak\n", heap->live, heap->peak);
+	for (size_t i = 0; i < HEAP_CLASSES; ++i) {
+		HeapClass *c = &heap->classes[i];
+		if (c->allocs) fprintf(stderr, "heap:  %6zu bytes %zu allocs, %zu live\n", heap_class_size(i), c->allocs, c->live);
+	}
+	if (heap->large_allocs) fprintf(stderr, "heap:   large %zu allocs, %zu live\n", heap->large_allocs, heap->large_live);
+}
+
+#ifndef PISS_LIBRARY
 int main(int argc, char **argv)
 {
 	char *program_name = argv[0];
-	const char *path = argv[1];
+	const char *path = NULL;
+	bool pipelined = false;
+	bool hold = false;
+	bool watch = false;
+	bool arena_stats = false;
+	bool huge_pages = false;
+	bool guard_pages = false;
+	bool sandbox = false;
+	const char *batch = NULL;
+	const char *serve = NULL;
+	const char *connect_to = NULL;
+	bool stdin_line = false;
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	long workers = 1;
+	long lanes = 0;
+	StackSizes stack_sizes = {0};
+	int status = 0;
 	struct stat sb = {0};
-	if (argc < 2) {
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--pipeline") == 0) {
+			pipelined = true;
+		} else if (strcmp(argv[i], "--pipeline-hold") == 0) {
+			pipelined = true;
+			hold = true;
+		} else if (strcmp(argv[i], "--watch") == 0) {
+			watch = true;
+		} else if (strcmp(argv[i], "--arena-stats") == 0) {
+			arena_stats = true;
+		} else if (strcmp(argv[i], "--huge-pages") == 0) {
+			huge_pages = true;
+		} else if (strcmp(argv[i], "--guard-pages") == 0) {
+			guard_pages = true;
+		} else if (strcmp(argv[i], "--sandbox") == 0) {
+			sandbox = true;
+		} else if (strcmp(argv[i], "--stack-size") == 0 || strcmp(argv[i], "--return-stack-size") == 0) {
+			char *end = NULL;
+			unsigned long long size = i + 1 < argc ? strtoull(argv[i + 1], &end, 0) : 0;
+			if (!end || *end != '\0' || end == argv[i + 1]) {
+				fprintf(stderr, "%s: %s expects a size in bytes\n", program_name, argv[i]);
+				goto error_1;
+			}
+			if (argv[i][2] == 's') stack_sizes.operand = size;
+			else stack_sizes.ret = size;
+			++i;
+		} else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+			batch = argv[++i];
+		} else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+			serve = argv[++i];
+		} else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc) {
+			connect_to = argv[++i];
+		} else if (strcmp(argv[i], "--stdin-line") == 0) {
+			stdin_line = true;
+		} else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--workers") == 0) {
+			char *end = NULL;
+			long n = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+			if (!end || *end != '\0' || end == argv[i + 1] || n < 1) {
+				fprintf(stderr, "%s: %s expects a number of threads\n", program_name, argv[i]);
+				goto error_1;
+			}
+			if (argv[i][1] == 'j') jobs = n;
+			else workers = n;
+			++i;
+		} else if (strcmp(argv[i], "--lanes") == 0) {
+			char *end = NULL;
+			lanes = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+			if (!end || *end != '\0' || (lanes != 8 && lanes != 16)) {
+				fprintf(stderr, "%s: --lanes expects 8 or 16\n", program_name);
+				goto error_1;
+			}
+			++i;
+		} else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+			fprintf(stderr, "%s: unknown option %s\n", program_name, argv[i]);
+			print_help();
+			goto error_1;
+		} else {
+			path = argv[i];
+		}
+	}
+	if (serve) {
+		if (batch || watch || pipelined || sandbox || path) {
+			fprintf(stderr, "%s: --serve takes no file and can't be combined with --batch, --watch, --pipeline or --sandbox\n", program_name);
+			goto error_1;
+		}
+		Serve *daemon = calloc(1, sizeof(*daemon));
+		if (!daemon) panic("Failed to allocate the program cache\n");
+		daemon->huge_pages = huge_pages;
+		daemon->guard_pages = guard_pages;
+		daemon->workers = workers;
+		daemon->stack = stack_sizes;
+		return run_serve(daemon, serve) ? 1 : 0;
+	}
+	if (!path) {
 		print_help();
 		goto error_1;
 	}
+	if (connect_to) return serve_connect(connect_to, path, stdin_line);
+	if (stdin_line) {
+		fprintf(stderr, "%s: --stdin-line only works with --connect\n", program_name);
+		goto error_1;
+	}
+	if (batch && (watch || pipelined || sandbox)) {
+		fprintf(stderr, "%s: --batch can't be combined with --watch, --pipeline or --sandbox\n", program_name);
+		goto error_1;
+	}
+	if (lanes && !batch) {
+		fprintf(stderr, "%s: --lanes only works with --batch\n", program_name);
+		goto error_1;
+	}
+	if (jobs < 1) jobs = 1;
+	if (watch) {
+		Ctx context = {0};
+		Arena *arena = arena_create(1024 * 32);
+		context_init(&context, path);
+		context.data.huge_pages = huge_pages;
+		context.workers = workers;
+		if (guard_pages) vm_guard_stacks(&context.vm);
+		if (sandbox) context_sandbox(&context);
+		if (vm_commit_stacks(&context.vm, stack_sizes)) return 1;
+		watch_program(&context, arena, path);
+		context_destroy(&context);
+		arena_destroy(arena);
+		return 0;
+	}
 
-	FILE *f = fopen(path, "rb");
+	FILE *f = stdin;
+	if (strcmp(path, "-") == 0) {
+		path = "<stdin>";
+	} else {
+		f = fopen(path, "rb");
+	}
 	if (!f) {
 		fprintf(stderr, "%s: cannot find %s: No such file or directory\n", program_name, path);
 		goto error_1;
 	}
-	if (lstat(path, &sb) < 0) {
+	if (fstat(fileno(f), &sb) < 0) {
 		fprintf(stderr, "%s: failed to stat %s\n", program_name, path);
 		goto error_2;
 	}
 
 	Ctx context = {0};
 	Arena *arena = arena_create(1024 * 32);
-	context_init(&context);
+	context_init(&context, path);
+	context.data.huge_pages = huge_pages;
+	context.workers = workers;
+	if (guard_pages) vm_guard_stacks(&context.vm);
+	if (sandbox) context_sandbox(&context);
+	if (vm_commit_stacks(&context.vm, stack_sizes)) goto error_3;
 
-	size_t len = sb.st_size;
-	if (parse_src(&context, arena, path, f, len)) goto error_3;
-	if (fclose(f)) panic("Failed to close file\n");
-	begin_execution(&context);
+	/* Pipes and other streams are lexed until EOF */
+	size_t len = S_ISREG(sb.st_mode) ? (size_t) sb.st_size : LEXER_UNBOUNDED;
+	if (pipelined) {
+		if (run_pipelined(&context, arena, path, f, len, hold)) goto error_3;
+		if (fclose(f)) panic("Failed to close file\n");
+	} else {
+		if (parse_src(&context, arena, path, f, len)) goto error_3;
+		if (fclose(f)) panic("Failed to close file\n");
+		if (batch) {
+			status = run_batch(&context, batch, jobs, stack_sizes, lanes) ? 1 : 0;
+		} else {
+			begin_execution(&context);
+		}
+	}
+	if (arena_stats) print_stats(&context, arena);
 	context_destroy(&context);
 	arena_destroy(arena);
 
-	return 0;
+	return status;
 
 error_3:
 	context_destroy(&context);
 	arena_destroy(arena);
 error_2:
-	free(f);
+	fclose(f);
 error_1:
 	return 1;
 }
+
+#endif /* PISS_LIBRARY */
@@ -1,7 +1,7 @@
 #ifndef ASS_H
 #define ASS_H
 
-#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
 #define _XOPEN_SOURCE_EXTENDED
 
 #include <assert.h>
@@ -35,7 +35,11 @@
 #define dprintf(...) ;
 #endif
 #define BUF_SIZE (1024 * 4)
+/* Initial size of the operand and return stacks, they grow up to their reserve */
 #define STACK_SIZE (1024 * 16)
+#define STACK_RESERVE ((size_t) 1 << 30)
+/* Each call also allocates a frame, so this caps recursion at 128Ki calls */
+#define RETURN_STACK_RESERVE ((size_t) 1 << 20)
 #define LOCAL_SIZE 256
 
 enum DataSize {
@@ -54,15 +58,35 @@ union Data {
 	double d;
 };
 
+#define LABEL_UNDEFINED SIZE_MAX
+#define FIXUP_NONE SIZE_MAX
+
 typedef struct Label {
 	const char *name;
 	size_t location;
+	/* Source row of the definition */
+	size_t row;
+	/* Head of the chain of jumps waiting for this label */
+	size_t fixup;
 } Label;
 
+typedef struct Fixup {
+	size_t instruction;
+	size_t next;
+} Fixup;
+
 typedef struct LabelMap {
 	Label *labels;
 	size_t cap;
 	size_t len;
+
+	/* Open-addressed index into `labels`, 0 marks an empty bucket */
+	size_t *buckets;
+	size_t bucket_cap;
+
+	Fixup *fixups;
+	size_t fixup_cap;
+	size_t fixup_len;
 } LabelMap;
 
 #define arena_xalloc(arena, size) _arena_xalloc(__FILE__, __LINE__, arena, size)
@@ -75,4 +99,13 @@ void *_xmalloc(char *filename, int row, size_t size);
 
 void *_xrealloc(char *filename, int row, void *ptr, size_t size);
 
+char *read_stream(FILE *f, size_t *len);
+
+Label *label_map_find(LabelMap *label_map, const char *name);
+
+/* The whole file, NULL when it can't be opened */
+char *read_file(const char *path, size_t *len);
+
+size_t count_lines(const char *src, size_t len);
+
 #endif
@@ -0,0 +1,162 @@
+#define _XOPEN_SOURCE 700
+#define _XOPEN_SOURCE_EXTENDED
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "lanes.h"
+#include "stream.h"
+
+/* Next job from the worker's own queue */
+static bool batch_take(BatchWorker *worker, size_t *job)
+{
+	pthread_mutex_lock(&worker->lock);
+	bool found = worker->next < worker->end;
+	if (found) *job = worker->next++;
+	pthread_mutex_unlock(&worker->lock);
+	return found;
+}
+
+/* Move the back half of another worker's queue over and take its first job */
+static bool batch_steal(BatchWorker *worker, size_t *job)
+{
+	Batch *batch = worker->batch;
+	for (size_t i = 1; i < batch->worker_len; ++i) {
+		BatchWorker *victim = &batch->workers[(worker->index + i) % batch->worker_len];
+		pthread_mutex_lock(&victim->lock);
+		size_t left = victim->end - victim->next;
+		size_t end = victim->end;
+		victim->end -= (left + 1) / 2;
+		size_t start = victim->end;
+		pthread_mutex_unlock(&victim->lock);
+		if (start == end) continue;
+
+		pthread_mutex_lock(&worker->lock);
+		worker->next = start + 1;
+		worker->end = end;
+		pthread_mutex_unlock(&worker->lock);
+		*job = start;
+		return true;
+	}
+	return false;
+}
+
+/* The job's line goes in the vm's heap and starts on the stack as a pointer and a length */
+static void batch_run_job(Vm *vm, Program *program, BatchJob *job)
+{
+	FILE *out = open_memstream(&job->output, &job->output_len);
+	if (!out) panic("Failed to buffer job output\n");
+	vm_redirect(vm, out);
+
+	vm_push_input(vm, job->input, job->len);
+	vm_run(vm, program);
+
+	vm_redirect(vm, NULL);
+	if (fclose(out)) panic("Failed to buffer job output\n");
+	vm_reset(vm);
+}
+
+static void *batch_worker(void *arg)
+{
+	BatchWorker *worker = arg;
+	Batch *batch = worker->batch;
+	Ctx *context = batch->context;
+	size_t job;
+	if (batch->lanes) {
+		Lanes *lanes = xmalloc(sizeof(*lanes));
+		lanes_init(lanes, batch);
+		while (batch_take(worker, &job) || batch_steal(worker, &job)) lanes_run_group(lanes, batch, job);
+		lanes_destroy(lanes);
+		free(lanes);
+		return NULL;
+	}
+
+	Vm *vm = &worker->vm;
+	vm_init(vm, context);
+	if (context->vm.guarded) vm_guard_stacks(vm);
+	if (vm_commit_stacks(vm, batch->stack)) abort();
+	vm_private_bss(vm, &context->data.bss);
+
+	while (batch_take(worker, &job) || batch_steal(worker, &job)) {
+		batch_run_job(vm, &context->program, &batch->jobs[job]);
+	}
+
+	vm_destroy(vm);
+	return NULL;
+}
+
+int run_batch(Ctx *context, const char *path, size_t threads, StackSizes stack, size_t lanes)
+{
+	Program *program = &context->program;
+	if (lanes) {
+		int errcode = 0;
+		for (size_t i = 0; i < program->len; ++i) {
+			const char *error = lanes_check(program, i);
+			if (!error) continue;
+			fprintf(stderr, "%s:%zu:%s: %s\n", context->path, program->rows[i], error, instruction_info[program->ops[i]].name);
+			errcode = -1;
+		}
+		if (errcode) return errcode;
+	}
+
+	size_t len;
+	char *src = read_file(path, &len);
+	if (!src) {
+		fprintf(stderr, "%s: cannot open\n", path);
+		return -1;
+	}
+
+	Batch batch = {0};
+	batch.context = context;
+	batch.stack = stack;
+	stack_sizes_max(&batch.stack, context->program.stack);
+	batch.jobs = xmalloc(sizeof(*batch.jobs) * (count_lines(src, len) + 1));
+	for (char *line = src, *end; line < src + len; line = end + 1) {
+		end = memchr(line, '\n', src + len - line);
+		if (!end) end = src + len;
+		if (end == line) continue;
+		batch.jobs[batch.job_len++] = (BatchJob){ .input = line, .len = end - line };
+	}
+
+	/* With --lanes the queues hand out groups of jobs */
+	size_t units = batch.job_len;
+	if (lanes) {
+		batch.lanes = lanes;
+		batch.ipdom = post_dominators(program);
+		units = (batch.job_len + lanes - 1) / lanes;
+	}
+	batch.worker_len = threads < units ? threads : units;
+	batch.workers = xmalloc(sizeof(*batch.workers) * (batch.worker_len + 1));
+	for (size_t i = 0; i < batch.worker_len; ++i) {
+		BatchWorker *worker = &batch.workers[i];
+		worker->next = units * i / batch.worker_len;
+		worker->end = units * (i + 1) / batch.worker_len;
+		pthread_mutex_init(&worker->lock, NULL);
+		worker->index = i;
+		worker->batch = &batch;
+	}
+	for (size_t i = 0; i < batch.worker_len; ++i) {
+		if (pthread_create(&batch.workers[i].thread, NULL, batch_worker, &batch.workers[i])) {
+			panic("Failed to spawn batch worker\n");
+		}
+	}
+	for (size_t i = 0; i < batch.worker_len; ++i) {
+		pthread_join(batch.workers[i].thread, NULL);
+	}
+	/* Finished workers can still be stolen from until every one is joined */
+	for (size_t i = 0; i < batch.worker_len; ++i) {
+		pthread_mutex_destroy(&batch.workers[i].lock);
+	}
+
+	for (size_t i = 0; i < batch.job_len; ++i) {
+		fwrite(batch.jobs[i].output, 1, batch.jobs[i].output_len, stdout);
+		free(batch.jobs[i].output);
+	}
+	free(batch.workers);
+	free(batch.jobs);
+	free(batch.ipdom);
+	free(src);
+	return 0;
+}
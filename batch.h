@@ -0,0 +1,51 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "vm.h"
+
+/* A line of the --batch file and what the program printed for it */
+typedef struct BatchJob {
+	const char *input;
+	size_t len;
+	char *output;
+	size_t output_len;
+} BatchJob;
+
+/*
+ * A thread of the --batch pool. It works through its own jobs from the
+ * front and, once they run out, steals the back half of another worker's.
+ * Its vm is reset between jobs rather than rebuilt.
+ */
+typedef struct BatchWorker {
+	/* Jobs `[next, end)` are still queued */
+	size_t next;
+	size_t end;
+	pthread_mutex_t lock;
+
+	Vm vm;
+	size_t index;
+	struct Batch *batch;
+	pthread_t thread;
+} BatchWorker;
+
+typedef struct Batch {
+	Ctx *context;
+	StackSizes stack;
+	BatchJob *jobs;
+	size_t job_len;
+	BatchWorker *workers;
+	size_t worker_len;
+	/* Jobs run together with --lanes, the queues hold groups of them. 0 runs them one by one */
+	size_t lanes;
+	/* Immediate post-dominator of each instruction, for --lanes */
+	size_t *ipdom;
+} Batch;
+
+/*
+ * Run the assembled program once per line of `path` on `threads` threads,
+ * then print what each run printed in the order of the lines. With `lanes`
+ * each thread runs that many lines at once.
+ */
+int run_batch(Ctx *context, const char *path, size_t threads, StackSizes stack, size_t lanes);
+
+#endif /* BATCH_H */
@@ -0,0 +1,13 @@
+# Summing the bytes of each line: one --batch run against a process per line
+seq 1 10000 | awk '{ printf "job %d of the batch benchmark\n", $1 }' > jobs.txt
+head -n 1000 jobs.txt > jobs1000.txt
+cat > each.sh <<'END'
+while read -r line; do
+	printf '%s\n' "$line" | "$ASS" --batch /dev/stdin "$BENCH/batch_job.pissm"
+done < jobs1000.txt
+END
+best "1000 jobs, a process each" sh each.sh
+best "1000 jobs, --batch -j 1" "$ASS" --batch jobs1000.txt -j 1 "$BENCH/batch_job.pissm"
+best "10000 jobs, --batch -j 1" "$ASS" --batch jobs.txt -j 1 "$BENCH/batch_job.pissm"
+best "10000 jobs, --batch" "$ASS" --batch jobs.txt "$BENCH/batch_job.pissm"
+best "10000 jobs, --batch --lanes 8" "$ASS" --batch jobs.txt --lanes 8 "$BENCH/batch_job.pissm"
@@ -0,0 +1,7 @@
+# 1M 8 byte messages through a 256 slot channel one at a time and 64 at a time,
+# and 100000 round trips between two threads over 1 slot channels
+for workers in 1 2; do
+	best "1M messages, chsend/chrecv, --workers $workers" "$ASS" --workers $workers "$BENCH/chan_single.pissm"
+	best "1M messages, chsendn/chrecvn, --workers $workers" "$ASS" --workers $workers "$BENCH/chan_batch.pissm"
+	best "100000 round trips, --workers $workers" "$ASS" --workers $workers "$BENCH/chan_pingpong.pissm"
+done
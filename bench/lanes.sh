@@ -0,0 +1,7 @@
+# Arithmetic on each line's hash: jobs in lockstep lanes against one at a time
+seq 1 10000 | awk '{ printf "job %d of the lanes benchmark\n", $1 }' > jobs.txt
+best "10000 jobs, --batch -j 1" "$ASS" --batch jobs.txt -j 1 "$BENCH/lanes_job.pissm"
+best "10000 jobs, --batch -j 1 --lanes 8" "$ASS" --batch jobs.txt -j 1 --lanes 8 "$BENCH/lanes_job.pissm"
+best "10000 jobs, --batch -j 1 --lanes 16" "$ASS" --batch jobs.txt -j 1 --lanes 16 "$BENCH/lanes_job.pissm"
+best "10000 jobs, --batch" "$ASS" --batch jobs.txt "$BENCH/lanes_job.pissm"
+best "10000 jobs, --batch --lanes 8" "$ASS" --batch jobs.txt --lanes 8 "$BENCH/lanes_job.pissm"
@@ -0,0 +1,6 @@
+# 100 passes over 64K, a pderef8/pset8 loop against one bulk memory op per pass
+best "copy, byte loop" "$ASS" "$BENCH/copy_bytes.pissm"
+best "copy, memcpy" "$ASS" "$BENCH/copy_memcpy.pissm"
+best "scan for the last byte, byte loop" "$ASS" "$BENCH/scan_bytes.pissm"
+best "scan for the last byte, memchr" "$ASS" "$BENCH/scan_memchr.pissm"
+best "copy, byte loop, --guard-pages" "$ASS" --guard-pages "$BENCH/copy_bytes.pissm"
@@ -0,0 +1,7 @@
+# parfor over a 1M element dd array 8 times, and 16 green threads counting to 400000
+for workers in 1 2 4 8 16; do
+	best "parfor, --workers $workers" "$ASS" --workers $workers "$BENCH/parfor.pissm"
+done
+for workers in 1 2 4 8 16; do
+	best "16 green threads, --workers $workers" "$ASS" --workers $workers "$BENCH/green.pissm"
+done
@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Benchmarks, run from the repository root after an -O2 build
+#
+#   bench/run.sh [path/to/ass] [name...]
+#
+# name.sh runs in a scratch directory with $ASS, $BENCH and $TMP set and
+# times commands with `best LABEL command...`, which prints the best wall
+# clock time of 3 runs. Their output goes to $TMP/out.
+
+ASS=${1:-./ass}
+ASS=$(cd "$(dirname "$ASS")" && pwd)/$(basename "$ASS")
+[ $# -gt 0 ] && shift
+BENCH=$(cd "$(dirname "$0")" && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+export ASS BENCH TMP
+
+best() {
+	label=$1
+	shift
+	min=
+	for run in 1 2 3; do
+		start=$(date +%s%N)
+		"$@" > "$TMP/out" 2>&1 < /dev/null
+		end=$(date +%s%N)
+		time=$(((end - start) / 1000))
+		if [ -z "$min" ] || [ $time -lt $min ]; then min=$time; fi
+	done
+	printf '  %-48s %7d.%03d ms\n' "$label" $((min / 1000)) $((min % 1000))
+}
+
+if [ $# -eq 0 ]; then set -- "$BENCH"/*.sh; fi
+echo "$(nproc) processors"
+for bench in "$@"; do
+	name=$(basename "${bench%.sh}")
+	[ "$name" = run ] && continue
+	echo "$name"
+	(cd "$TMP" && . "$BENCH/$name.sh")
+done
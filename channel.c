@@ -0,0 +1,165 @@
+#define _XOPEN_SOURCE 700
+#define _XOPEN_SOURCE_EXTENDED
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel.h"
+
+uint64_t vm_new_channel(Vm *vm, uint64_t cap, uint64_t size)
+{
+	if (cap > SIZE_MAX / 2 || (size && cap > SIZE_MAX / 2 / size)) {
+		fprintf(stderr, "Channel of %" PRIu64 " messages of %" PRIu64 " bytes is too large\n", cap, size);
+		print_frames(vm);
+		abort();
+	}
+	Channel *chan = xmalloc(sizeof(*chan));
+	*chan = (Channel){0};
+	chan->cap = 2;
+	while (chan->cap < cap) chan->cap *= 2;
+	chan->size = size;
+	chan->seqs = xmalloc(sizeof(*chan->seqs) * chan->cap);
+	for (size_t i = 0; i < chan->cap; ++i) chan->seqs[i] = i;
+	chan->slots = xmalloc(size * chan->cap + 1);
+	pthread_mutex_init(&chan->lock, NULL);
+
+	Vm *home = vm->home;
+	size_t i = 0;
+	while (i < home->channel_len && *channel_slot(home, i)) ++i;
+	if (i == home->channel_len) {
+		size_t k = 0;
+		size_t first = 0;
+		while (i >= first + ((size_t) CHANNEL_CHUNK << k)) first += (size_t) CHANNEL_CHUNK << k++;
+		if (k == CHANNEL_CHUNKS) panic("Too many channels\n");
+		if (!home->channels[k]) {
+			size_t n = (size_t) CHANNEL_CHUNK << k;
+			home->channels[k] = xmalloc(sizeof(**home->channels) * n);
+			memset(home->channels[k], 0, sizeof(**home->channels) * n);
+		}
+	}
+	__atomic_store_n(channel_slot(home, i), chan, __ATOMIC_RELEASE);
+	if (i == home->channel_len) __atomic_store_n(&home->channel_len, i + 1, __ATOMIC_RELEASE);
+	return i + 1;
+}
+
+static void channel_destroy(Channel *chan)
+{
+	pthread_mutex_destroy(&chan->lock);
+	free(chan->seqs);
+	free(chan->slots);
+	free(chan);
+}
+
+void vm_free_channel(Vm *vm, uint64_t handle)
+{
+	Channel *chan = vm_channel(vm, handle);
+	pthread_mutex_lock(&chan->lock);
+	bool parked = chan->senders || chan->receivers;
+	pthread_mutex_unlock(&chan->lock);
+	if (parked) {
+		fprintf(stderr, "Free of channel %" PRIu64 " while threads wait on it\n", handle);
+		print_frames(vm);
+		abort();
+	}
+	Vm *home = vm->home;
+	__atomic_store_n(channel_slot(home, handle - 1), NULL, __ATOMIC_RELEASE);
+	if (vm->scheduler && vm->scheduler->worker_len > 1) {
+		chan->retired = home->retired;
+		home->retired = chan;
+		return;
+	}
+	channel_destroy(chan);
+}
+
+void vm_clear_channels(Vm *vm)
+{
+	for (size_t i = 0; i < vm->channel_len; ++i) {
+		Channel *chan = *channel_slot(vm, i);
+		if (chan) channel_destroy(chan);
+	}
+	for (size_t k = 0; k < CHANNEL_CHUNKS; ++k) {
+		free(vm->channels[k]);
+		vm->channels[k] = NULL;
+	}
+	vm->channel_len = 0;
+	while (vm->retired) {
+		Channel *chan = vm->retired;
+		vm->retired = chan->retired;
+		channel_destroy(chan);
+	}
+}
+
+/* Whether a send or receive would go through now, for a thread about to park */
+static bool channel_ready(Channel *chan, bool sending)
+{
+	if (__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE)) return true;
+	uint64_t pos = __atomic_load_n(sending ? &chan->tail : &chan->head, __ATOMIC_RELAXED);
+	uint64_t seq = __atomic_load_n(&chan->seqs[pos & (chan->cap - 1)], __ATOMIC_ACQUIRE);
+	return (int64_t) (seq - (sending ? pos : pos + 1)) >= 0;
+}
+
+void channel_park(Vm *vm, Channel *chan, bool sending)
+{
+	Fiber **list = sending ? &chan->senders : &chan->receivers;
+	size_t *waiting = sending ? &chan->waiting_senders : &chan->waiting_receivers;
+	if (!vm->scheduler) scheduler_start(vm);
+	--vm->pc;
+
+	pthread_mutex_lock(&chan->lock);
+	__atomic_add_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+	/* Pairs with the fence in `channel_wake`, either it sees us waiting or we see what it did */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (channel_ready(chan, sending)) {
+		__atomic_sub_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&chan->lock);
+		return;
+	}
+	/* Saved before anyone can see it, like in `scheduler_join` */
+	Fiber *fiber = vm->fiber;
+	fiber_save(vm);
+	fiber->next = NULL;
+	while (*list) list = &(*list)->next;
+	*list = fiber;
+	pthread_mutex_unlock(&chan->lock);
+	scheduler_switch(vm);
+}
+
+void channel_wake(Vm *vm, Channel *chan, bool senders, size_t n)
+{
+	Fiber **list = senders ? &chan->senders : &chan->receivers;
+	size_t *waiting = senders ? &chan->waiting_senders : &chan->waiting_receivers;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(waiting, __ATOMIC_RELAXED)) return;
+
+	pthread_mutex_lock(&chan->lock);
+	Fiber *woken = *list;
+	Fiber **end = list;
+	for (; n && *end; --n) {
+		end = &(*end)->next;
+		__atomic_sub_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+	}
+	*list = *end;
+	*end = NULL;
+	pthread_mutex_unlock(&chan->lock);
+
+	for (Fiber *next; woken; woken = next) {
+		next = woken->next;
+		scheduler_ready(vm, woken);
+	}
+}
+
+void channel_close(Vm *vm, Channel *chan)
+{
+	__atomic_store_n(&chan->closed, true, __ATOMIC_RELEASE);
+	channel_wake(vm, chan, true, SIZE_MAX);
+	channel_wake(vm, chan, false, SIZE_MAX);
+}
+
+void channel_closed(Vm *vm)
+{
+	fprintf(stderr, "Send on a closed channel\n");
+	print_frames(vm);
+	abort();
+}
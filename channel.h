@@ -0,0 +1,135 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scheduler.h"
+
+/* Keeps the two ends of a channel from sharing a cache line */
+#define CACHE_LINE 64
+
+/*
+ * A bounded queue of fixed-size messages that any number of threads send
+ * to and receive from at once. Each slot has a sequence number that tells
+ * whose turn it is, so neither side takes `lock` unless it has to park on
+ * a full or empty channel.
+ */
+typedef struct Channel {
+	/* Positions of the next receive and the next send */
+	uint64_t head __attribute__((aligned(CACHE_LINE)));
+	uint64_t tail __attribute__((aligned(CACHE_LINE)));
+	/* A power of two, at least 2 */
+	size_t cap __attribute__((aligned(CACHE_LINE)));
+	size_t size;
+	uint64_t *seqs;
+	byte *slots;
+	bool closed;
+	/* Parked threads, the counts are read without `lock` by the other side */
+	Fiber *senders;
+	Fiber *receivers;
+	size_t waiting_senders;
+	size_t waiting_receivers;
+	pthread_mutex_t lock;
+	/* Next on the vm's `retired` list once freed */
+	struct Channel *retired;
+} Channel;
+
+/* Where the channel with handle `i + 1` is kept */
+static inline Channel **channel_slot(Vm *home, size_t i)
+{
+	size_t k = 0;
+	while (i >= (size_t) CHANNEL_CHUNK << k) i -= (size_t) CHANNEL_CHUNK << k++;
+	return &home->channels[k][i];
+}
+
+static inline Channel *vm_channel(Vm *vm, uint64_t handle)
+{
+	Vm *home = vm->home;
+	Channel *chan = NULL;
+	if (handle != 0 && handle <= __atomic_load_n(&home->channel_len, __ATOMIC_ACQUIRE)) {
+		chan = __atomic_load_n(channel_slot(home, handle - 1), __ATOMIC_ACQUIRE);
+	}
+	if (!chan) {
+		fprintf(stderr, "Invalid channel handle %" PRIu64 "\n", handle);
+		print_frames(vm);
+		abort();
+	}
+	return chan;
+}
+
+/* Copy a message in, false when the channel is full */
+static inline bool channel_send(Channel *chan, const void *src)
+{
+	uint64_t pos = __atomic_load_n(&chan->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		size_t i = pos & (chan->cap - 1);
+		uint64_t seq = __atomic_load_n(&chan->seqs[i], __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t) (seq - pos);
+		if (diff < 0) return false;
+		/* Another sender took `pos`, or `pos` went stale */
+		if (diff > 0) {
+			pos = __atomic_load_n(&chan->tail, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&chan->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			memcpy(&chan->slots[i * chan->size], src, chan->size);
+			__atomic_store_n(&chan->seqs[i], pos + 1, __ATOMIC_RELEASE);
+			return true;
+		}
+	}
+}
+
+/* Copy the oldest message out, false when the channel is empty */
+static inline bool channel_recv(Channel *chan, void *dst)
+{
+	uint64_t pos = __atomic_load_n(&chan->head, __ATOMIC_RELAXED);
+	for (;;) {
+		size_t i = pos & (chan->cap - 1);
+		uint64_t seq = __atomic_load_n(&chan->seqs[i], __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t) (seq - (pos + 1));
+		if (diff < 0) return false;
+		if (diff > 0) {
+			pos = __atomic_load_n(&chan->head, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&chan->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			memcpy(dst, &chan->slots[i * chan->size], chan->size);
+			/* Free for the send one lap later */
+			__atomic_store_n(&chan->seqs[i], pos + chan->cap, __ATOMIC_RELEASE);
+			return true;
+		}
+	}
+}
+
+/* Called with the heap locked */
+uint64_t vm_new_channel(Vm *vm, uint64_t cap, uint64_t size);
+
+/*
+ * Called with the heap locked. Aborts while threads are parked on the
+ * channel. When other workers may still be inside a send or receive on
+ * it, it is only destroyed with the rest of the table.
+ */
+void vm_free_channel(Vm *vm, uint64_t handle);
+
+void vm_clear_channels(Vm *vm);
+
+/*
+ * Park the running thread until the other side of `chan` gets somewhere.
+ * The instruction runs again when it wakes, so its operands stay on the
+ * stack and it parks again if another thread got there first.
+ */
+void channel_park(Vm *vm, Channel *chan, bool sending);
+
+/* Wake up to `n` of the threads parked on one side of `chan`, oldest first */
+void channel_wake(Vm *vm, Channel *chan, bool senders, size_t n);
+
+/* Wake every parked thread, receives still get what was sent before */
+void channel_close(Vm *vm, Channel *chan);
+
+/* Abort on a send to a closed channel */
+void channel_closed(Vm *vm);
+
+#endif /* CHANNEL_H */
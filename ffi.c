@@ -0,0 +1,157 @@
+#define _XOPEN_SOURCE 700
+#define _XOPEN_SOURCE_EXTENDED
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ffi.h"
+
+void *extern_symbol(const char *name)
+{
+	void *self = dlopen(NULL, RTLD_LAZY);
+	return self ? dlsym(self, name) : NULL;
+}
+
+/* Word `i` of the arguments on the operand stack */
+static inline uint64_t extern_arg(const byte *args, size_t i)
+{
+	uint64_t word;
+	memcpy(&word, args + i * sizeof(word), sizeof(word));
+	return word;
+}
+
+/*
+ * One trampoline per argument count. The words go straight from the
+ * operand stack into the C calling convention's integer registers and the
+ * result comes back from its return register.
+ */
+typedef uint64_t Word;
+typedef Word (*ExternCall)(void (*sym)(void), const byte *args);
+
+static Word extern_call0(void (*sym)(void), const byte *a)
+{
+	(void) a;
+	return ((Word (*)(void)) sym)();
+}
+
+static Word extern_call1(void (*sym)(void), const byte *a)
+{
+	return ((Word (*)(Word)) sym)(extern_arg(a, 0));
+}
+
+static Word extern_call2(void (*sym)(void), const byte *a)
+{
+	return ((Word (*)(Word, Word)) sym)(extern_arg(a, 0), extern_arg(a, 1));
+}
+
+static Word extern_call3(void (*sym)(void), const byte *a)
+{
+	return ((Word (*)(Word, Word, Word)) sym)(extern_arg(a, 0), extern_arg(a, 1), extern_arg(a, 2));
+}
+
+static Word extern_call4(void (*sym)(void), const byte *a)
+{
+	return ((Word (*)(Word, Word, Word, Word)) sym)(extern_arg(a, 0), extern_arg(a, 1), extern_arg(a, 2),
+		extern_arg(a, 3));
+}
+
+static Word extern_call5(void (*sym)(void), const byte *a)
+{
+	return ((Word (*)(Word, Word, Word, Word, Word)) sym)(extern_arg(a, 0), extern_arg(a, 1), extern_arg(a, 2),
+		extern_arg(a, 3), extern_arg(a, 4));
+}
+
+static Word extern_call6(void (*sym)(void), const byte *a)
+{
+	return ((Word (*)(Word, Word, Word, Word, Word, Word)) sym)(extern_arg(a, 0), extern_arg(a, 1), extern_arg(a, 2),
+		extern_arg(a, 3), extern_arg(a, 4), extern_arg(a, 5));
+}
+
+static const ExternCall extern_calls[] = {
+	extern_call0, extern_call1, extern_call2, extern_call3, extern_call4, extern_call5, extern_call6,
+};
+#define EXTERN_ARGS_MAX (sizeof(extern_calls) / sizeof(*extern_calls) - 1)
+
+/*
+ * Calling printf and friends through a fixed prototype is undefined, the
+ * ABI may pass the variable part differently (SysV counts vector
+ * registers in %al). These pass every word after the first as a variadic
+ * argument. C needs one fixed parameter, so there's no zero word call.
+ */
+typedef Word (*ExternVariadic)(Word, ...);
+
+static Word extern_vcall1(void (*sym)(void), const byte *a)
+{
+	return ((ExternVariadic) sym)(extern_arg(a, 0));
+}
+
+static Word extern_vcall2(void (*sym)(void), const byte *a)
+{
+	return ((ExternVariadic) sym)(extern_arg(a, 0), extern_arg(a, 1));
+}
+
+static Word extern_vcall3(void (*sym)(void), const byte *a)
+{
+	return ((ExternVariadic) sym)(extern_arg(a, 0), extern_arg(a, 1), extern_arg(a, 2));
+}
+
+static Word extern_vcall4(void (*sym)(void), const byte *a)
+{
+	return ((ExternVariadic) sym)(extern_arg(a, 0), extern_arg(a, 1), extern_arg(a, 2), extern_arg(a, 3));
+}
+
+static Word extern_vcall5(void (*sym)(void), const byte *a)
+{
+	return ((ExternVariadic) sym)(extern_arg(a, 0), extern_arg(a, 1), extern_arg(a, 2), extern_arg(a, 3),
+		extern_arg(a, 4));
+}
+
+static Word extern_vcall6(void (*sym)(void), const byte *a)
+{
+	return ((ExternVariadic) sym)(extern_arg(a, 0), extern_arg(a, 1), extern_arg(a, 2), extern_arg(a, 3),
+		extern_arg(a, 4), extern_arg(a, 5));
+}
+
+static const ExternCall extern_vcalls[] = {
+	NULL, extern_vcall1, extern_vcall2, extern_vcall3, extern_vcall4, extern_vcall5, extern_vcall6,
+};
+
+uint64_t extern_call(Vm *vm, const Extern *ext, const byte *args, size_t argc)
+{
+	if (argc % sizeof(uint64_t) || argc / sizeof(uint64_t) > EXTERN_ARGS_MAX) {
+		fprintf(stderr, "Calls to %s take up to %zu 8 byte words\n", ext->name, EXTERN_ARGS_MAX);
+		print_frames(vm);
+		abort();
+	}
+	if (ext->variadic && argc == 0) {
+		fprintf(stderr, "Calls to %s take at least one 8 byte word, it is variadic\n", ext->name);
+		print_frames(vm);
+		abort();
+	}
+	const ExternCall *calls = ext->variadic ? extern_vcalls : extern_calls;
+	return calls[argc / sizeof(uint64_t)](ext->sym, args);
+}
+
+size_t extern_slot(Ctx *context, const char *name)
+{
+	for (size_t i = 0; i < context->extern_len; ++i) {
+		if (strcmp(context->externs[i].name, name) == 0) return i;
+	}
+	DeclarationMap *declaration_map = &context->program.declaration_map;
+	for (size_t i = 0; i < declaration_map->len; ++i) {
+		Declaration *declaration = &declaration_map->declarations[i];
+		if (declaration->kind != D_EXTERN || strcmp(declaration->ident, name) != 0) continue;
+		if (context->extern_len == context->extern_cap) {
+			context->extern_cap = context->extern_cap ? context->extern_cap * 2 : 8;
+			context->externs = xrealloc(context->externs, sizeof(*context->externs) * context->extern_cap);
+		}
+		Extern *ext = &context->externs[context->extern_len];
+		*ext = (Extern){ .name = declaration->ident, .variadic = declaration->variadic };
+		/* POSIX guarantees a dlsym address converts to a function pointer */
+		*(void **) &ext->sym = declaration->bytes;
+		return context->extern_len++;
+	}
+	return SIZE_MAX;
+}
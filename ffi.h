@@ -0,0 +1,31 @@
+#ifndef FFI_H
+#define FFI_H
+
+#include "vm.h"
+
+/* A host procedure for an extern the program calls */
+typedef struct Extern {
+	const char *name;
+	/* NULL until the host registers one */
+	PissNative fn;
+	void *user;
+	/* The C function of that name, called when there is no `fn` */
+	void (*sym)(void);
+	/* Declared `extern variadic`, `sym` is called through a prototype ending in ... */
+	bool variadic;
+} Extern;
+
+/* Address of `name` in the process or the libraries it loaded, NULL when there is none */
+void *extern_symbol(const char *name);
+
+/*
+ * Call the C function of `ext` with the `argc` bytes at `args` as 8 byte
+ * words and return its 8 byte result. Aborts when the words don't fit
+ * a trampoline.
+ */
+uint64_t extern_call(Vm *vm, const Extern *ext, const byte *args, size_t argc);
+
+/* Slot of the extern `name` in the context's table, SIZE_MAX when nothing by that name is declared extern */
+size_t extern_slot(Ctx *context, const char *name);
+
+#endif /* FFI_H */
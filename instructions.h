@@ -1,102 +1,167 @@
 /*** Instructions ***/
-INSTR(POP8,     "pop8")
-INSTR(POP32,    "pop32")
-INSTR(POP64,    "pop64")
-
-INSTR(ULPUSH,   "ulpush")
-INSTR(ULADD,    "uladd")
-INSTR(ULSUB,    "ulsub")
-INSTR(ULMULT,   "ulmult")
-INSTR(ULDIV,    "uldiv")
-INSTR(ULMOD,    "ulmod")
-INSTR(ULPRINT,  "ulprint")
-
-INSTR(IPUSH,    "ipush")
-INSTR(IADD,     "iadd")
-INSTR(ISUB,     "isub")
-INSTR(IMULT,    "imult")
-INSTR(IDIV,     "idiv")
-INSTR(IMOD,     "imod")
-INSTR(IPRINT,   "iprint")
-
-INSTR(FPUSH,    "fpush")
-INSTR(FADD,     "fadd")
-INSTR(FSUB,     "fsub")
-INSTR(FMULT,    "fmult")
-INSTR(FDIV,     "fdiv")
-INSTR(FPRINT,   "fprint")
-
-INSTR(CPUSH,    "cpush")
-INSTR(CADD,     "cadd")
-INSTR(CSUB,     "csub")
-INSTR(CMULT,    "cmult")
-INSTR(CDIV,     "cdiv")
-INSTR(CMOD,     "cmod")
-INSTR(CPRINT,   "cprint")
-INSTR(CIPRINT,  "ciprint")
-
-INSTR(PPUSH,    "ppush")
-INSTR(PLOAD,    "pload")
-INSTR(PDEREF8,  "pderef8")
-INSTR(PDEREF32, "pderef32")
-INSTR(PDEREF64, "pderef64")
-INSTR(PDEREF,   "pderef")
-INSTR(PSET8,    "pset8")
-INSTR(PSET32,   "pset32")
-INSTR(PSET64,   "pset64")
-INSTR(PSET,     "pset")
-
-INSTR(JUMP,     "jump")
-INSTR(JUMPCMP,  "jumpcmp")
-INSTR(JUMPPROC, "jumpproc")
-
-INSTR(DUPE8,    "dupe8")
-INSTR(DUPE32,   "dupe32")
-INSTR(DUPE64,   "dupe64")
-
-INSTR(SWAP8,    "swap8")
-INSTR(SWAP32,   "swap32")
-INSTR(SWAP64,   "swap64")
-
-INSTR(COPY8,    "copy8")
-INSTR(COPY32,   "copy32")
-INSTR(COPY64,   "copy64")
-
-INSTR(STORE8,   "store8")
-INSTR(STORE32,  "store32")
-INSTR(STORE64,  "store64")
-
-INSTR(LOAD8,    "load8")
-INSTR(LOAD32,   "load32")
-INSTR(LOAD64,   "load64")
-
-INSTR(RET8,     "ret8")
-INSTR(RET32,    "ret32")
-INSTR(RET64,    "ret64")
-
-INSTR(RET,      "ret")
+/*
+ * INSTR(name, keyword, operand shape, allowed literal kinds,
+ *       bytes popped, bytes pushed)
+ *
+ * `EFFECT_VAR` marks a stack effect that depends on the operand.
+ */
+INSTR(POP8,     "pop8",     OPERAND_NONE,  0,              1,          0)
+INSTR(POP32,    "pop32",    OPERAND_NONE,  0,              4,          0)
+INSTR(POP64,    "pop64",    OPERAND_NONE,  0,              8,          0)
+
+INSTR(ULPUSH,   "ulpush",   OPERAND_LIT,   L_INT | L_UINT, 0,          8)
+INSTR(ULADD,    "uladd",    OPERAND_NONE,  0,              16,         8)
+INSTR(ULSUB,    "ulsub",    OPERAND_NONE,  0,              16,         8)
+INSTR(ULMULT,   "ulmult",   OPERAND_NONE,  0,              16,         8)
+INSTR(ULDIV,    "uldiv",    OPERAND_NONE,  0,              16,         8)
+INSTR(ULMOD,    "ulmod",    OPERAND_NONE,  0,              16,         8)
+INSTR(ULPRINT,  "ulprint",  OPERAND_NONE,  0,              0,          0)
+
+INSTR(IPUSH,    "ipush",    OPERAND_LIT,   L_INT | L_UINT, 0,          4)
+INSTR(IADD,     "iadd",     OPERAND_NONE,  0,              8,          4)
+INSTR(ISUB,     "isub",     OPERAND_NONE,  0,              8,          4)
+INSTR(IMULT,    "imult",    OPERAND_NONE,  0,              8,          4)
+INSTR(IDIV,     "idiv",     OPERAND_NONE,  0,              8,          4)
+INSTR(IMOD,     "imod",     OPERAND_NONE,  0,              8,          4)
+INSTR(IPRINT,   "iprint",   OPERAND_NONE,  0,              0,          0)
+
+INSTR(FPUSH,    "fpush",    OPERAND_LIT,   L_FLOAT,        0,          4)
+INSTR(FADD,     "fadd",     OPERAND_NONE,  0,              8,          4)
+INSTR(FSUB,     "fsub",     OPERAND_NONE,  0,              8,          4)
+INSTR(FMULT,    "fmult",    OPERAND_NONE,  0,              8,          4)
+INSTR(FDIV,     "fdiv",     OPERAND_NONE,  0,              8,          4)
+INSTR(FPRINT,   "fprint",   OPERAND_NONE,  0,              0,          0)
+
+INSTR(CPUSH,    "cpush",    OPERAND_LIT,   L_INT | L_UINT, 0,          1)
+INSTR(CADD,     "cadd",     OPERAND_NONE,  0,              2,          1)
+INSTR(CSUB,     "csub",     OPERAND_NONE,  0,              2,          1)
+INSTR(CMULT,    "cmult",    OPERAND_NONE,  0,              2,          1)
+INSTR(CDIV,     "cdiv",     OPERAND_NONE,  0,              2,          1)
+INSTR(CMOD,     "cmod",     OPERAND_NONE,  0,              2,          1)
+INSTR(CPRINT,   "cprint",   OPERAND_NONE,  0,              0,          0)
+INSTR(CIPRINT,  "ciprint",  OPERAND_NONE,  0,              0,          0)
+
+INSTR(PPUSH,    "ppush",    OPERAND_LIT,   L_PTR,          0,          8)
+INSTR(PLOAD,    "pload",    OPERAND_IDX,   0,              0,          16)
+INSTR(PDEREF8,  "pderef8",  OPERAND_NONE,  0,              8,          1)
+INSTR(PDEREF32, "pderef32", OPERAND_NONE,  0,              8,          4)
+INSTR(PDEREF64, "pderef64", OPERAND_NONE,  0,              8,          8)
+INSTR(PDEREF,   "pderef",   OPERAND_IDX,   0,              EFFECT_VAR, EFFECT_VAR)
+INSTR(PSET8,    "pset8",    OPERAND_NONE,  0,              9,          0)
+INSTR(PSET32,   "pset32",   OPERAND_NONE,  0,              12,         0)
+INSTR(PSET64,   "pset64",   OPERAND_NONE,  0,              16,         0)
+INSTR(PSET,     "pset",     OPERAND_IDX,   0,              EFFECT_VAR, EFFECT_VAR)
+INSTR(SYNC,     "sync",     OPERAND_NONE,  0,              0,          0)
+INSTR(MEMCPY,   "memcpy",   OPERAND_NONE,  0,              24,         0)
+INSTR(MEMMOVE,  "memmove",  OPERAND_NONE,  0,              24,         0)
+INSTR(MEMSET,   "memset",   OPERAND_NONE,  0,              17,         0)
+INSTR(MEMCMP,   "memcmp",   OPERAND_NONE,  0,              24,         4)
+INSTR(MEMCHR,   "memchr",   OPERAND_NONE,  0,              17,         8)
+INSTR(STRLEN,   "strlen",   OPERAND_NONE,  0,              8,          8)
+INSTR(ALLOC,    "alloc",    OPERAND_NONE,  0,              8,          8)
+INSTR(FREE,     "free",     OPERAND_NONE,  0,              8,          0)
+INSTR(REALLOC,  "realloc",  OPERAND_NONE,  0,              16,         8)
+
+INSTR(ALOAD8,   "aload8",   OPERAND_ORDER, ORDER_LOAD,     8,          1)
+INSTR(ALOAD32,  "aload32",  OPERAND_ORDER, ORDER_LOAD,     8,          4)
+INSTR(ALOAD64,  "aload64",  OPERAND_ORDER, ORDER_LOAD,     8,          8)
+INSTR(ASTORE8,  "astore8",  OPERAND_ORDER, ORDER_STORE,    9,          0)
+INSTR(ASTORE32, "astore32", OPERAND_ORDER, ORDER_STORE,    12,         0)
+INSTR(ASTORE64, "astore64", OPERAND_ORDER, ORDER_STORE,    16,         0)
+INSTR(AADD8,    "aadd8",    OPERAND_ORDER, ORDER_RMW,      9,          1)
+INSTR(AADD32,   "aadd32",   OPERAND_ORDER, ORDER_RMW,      12,         4)
+INSTR(AADD64,   "aadd64",   OPERAND_ORDER, ORDER_RMW,      16,         8)
+INSTR(AXCHG8,   "axchg8",   OPERAND_ORDER, ORDER_RMW,      9,          1)
+INSTR(AXCHG32,  "axchg32",  OPERAND_ORDER, ORDER_RMW,      12,         4)
+INSTR(AXCHG64,  "axchg64",  OPERAND_ORDER, ORDER_RMW,      16,         8)
+INSTR(ACAS8,    "acas8",    OPERAND_ORDER, ORDER_RMW,      10,         2)
+INSTR(ACAS32,   "acas32",   OPERAND_ORDER, ORDER_RMW,      16,         5)
+INSTR(ACAS64,   "acas64",   OPERAND_ORDER, ORDER_RMW,      24,         9)
+INSTR(FENCE,    "fence",    OPERAND_ORDER, ORDER_FENCE,    0,          0)
+
+INSTR(HMNEW,    "hmnew",    OPERAND_NONE,  0,              0,          8)
+INSTR(HMFREE,   "hmfree",   OPERAND_NONE,  0,              8,          0)
+INSTR(HMLEN,    "hmlen",    OPERAND_NONE,  0,              8,          8)
+INSTR(HMSET,    "hmset",    OPERAND_NONE,  0,              24,         0)
+INSTR(HMGET,    "hmget",    OPERAND_NONE,  0,              16,         9)
+INSTR(HMDEL,    "hmdel",    OPERAND_NONE,  0,              16,         1)
+INSTR(HMSETS,   "hmsets",   OPERAND_NONE,  0,              32,         0)
+INSTR(HMGETS,   "hmgets",   OPERAND_NONE,  0,              24,         9)
+INSTR(HMDELS,   "hmdels",   OPERAND_NONE,  0,              24,         1)
+INSTR(HMNEXT,   "hmnext",   OPERAND_NONE,  0,              16,         25)
+
+INSTR(CHNEW,    "chnew",    OPERAND_NONE,  0,              16,         8)
+INSTR(CHFREE,   "chfree",   OPERAND_NONE,  0,              8,          0)
+INSTR(CHCLOSE,  "chclose",  OPERAND_NONE,  0,              8,          0)
+INSTR(CHSEND,   "chsend",   OPERAND_NONE,  0,              16,         0)
+INSTR(CHRECV,   "chrecv",   OPERAND_NONE,  0,              16,         1)
+INSTR(CHSENDN,  "chsendn",  OPERAND_NONE,  0,              24,         0)
+INSTR(CHRECVN,  "chrecvn",  OPERAND_NONE,  0,              24,         8)
+
+INSTR(SOPEN,    "sopen",    OPERAND_NONE,  0,              9,          8)
+INSTR(SREAD,    "sread",    OPERAND_NONE,  0,              24,         8)
+INSTR(SREADLN,  "sreadln",  OPERAND_NONE,  0,              24,         8)
+INSTR(SWRITE,   "swrite",   OPERAND_NONE,  0,              24,         0)
+INSTR(SFLUSH,   "sflush",   OPERAND_NONE,  0,              8,          0)
+INSTR(SCLOSE,   "sclose",   OPERAND_NONE,  0,              8,          0)
+
+INSTR(JUMP,     "jump",     OPERAND_LABEL, 0,              0,          0)
+INSTR(JUMPCMP,  "jumpcmp",  OPERAND_LABEL, 0,              0,          0)
+INSTR(JUMPPROC, "jumpproc", OPERAND_PROC,  0,              EFFECT_VAR, EFFECT_VAR)
+INSTR(CALLEXT,  "callext",  OPERAND_PROC,  0,              EFFECT_VAR, EFFECT_VAR)
+
+INSTR(SPAWN,    "spawn",    OPERAND_PROC,  0,              EFFECT_VAR, 8)
+INSTR(PARFOR,   "parfor",   OPERAND_PROC,  0,              16,         0)
+INSTR(YIELD,    "yield",    OPERAND_NONE,  0,              0,          0)
+INSTR(JOIN,     "join",     OPERAND_NONE,  0,              8,          0)
+
+INSTR(DUPE8,    "dupe8",    OPERAND_NONE,  0,              0,          1)
+INSTR(DUPE32,   "dupe32",   OPERAND_NONE,  0,              0,          4)
+INSTR(DUPE64,   "dupe64",   OPERAND_NONE,  0,              0,          8)
+
+INSTR(SWAP8,    "swap8",    OPERAND_NONE,  0,              2,          2)
+INSTR(SWAP32,   "swap32",   OPERAND_NONE,  0,              8,          8)
+INSTR(SWAP64,   "swap64",   OPERAND_NONE,  0,              16,         16)
+
+INSTR(COPY8,    "copy8",    OPERAND_IDX,   0,              EFFECT_VAR, EFFECT_VAR)
+INSTR(COPY32,   "copy32",   OPERAND_IDX,   0,              EFFECT_VAR, EFFECT_VAR)
+INSTR(COPY64,   "copy64",   OPERAND_IDX,   0,              EFFECT_VAR, EFFECT_VAR)
+
+INSTR(STORE8,   "store8",   OPERAND_IDX,   0,              1,          0)
+INSTR(STORE32,  "store32",  OPERAND_IDX,   0,              4,          0)
+INSTR(STORE64,  "store64",  OPERAND_IDX,   0,              8,          0)
+
+INSTR(LOAD8,    "load8",    OPERAND_IDX,   0,              0,          1)
+INSTR(LOAD32,   "load32",   OPERAND_IDX,   0,              0,          4)
+INSTR(LOAD64,   "load64",   OPERAND_IDX,   0,              0,          8)
+
+INSTR(RET8,     "ret8",     OPERAND_NONE,  0,              1,          1)
+INSTR(RET32,    "ret32",    OPERAND_NONE,  0,              4,          4)
+INSTR(RET64,    "ret64",    OPERAND_NONE,  0,              8,          8)
+
+INSTR(RET,      "ret",      OPERAND_IDX,   0,              EFFECT_VAR, EFFECT_VAR)
 
 /* Comparison instructions */
-INSTR(ICLT,     "iclt")
-INSTR(ICLE,     "icle")
-INSTR(ICEQ,     "iceq")
-INSTR(ICGT,     "icgt")
-INSTR(ICGE,     "icge")
-
-INSTR(ULCLT,    "ulclt")
-INSTR(ULCLE,    "ulcle")
-INSTR(ULCEQ,    "ulceq")
-INSTR(ULCGT,    "ulcgt")
-INSTR(ULCGE,    "ulcge")
-
-INSTR(FCLT,     "fclt")
-INSTR(FCLE,     "fcle")
-INSTR(FCEQ,     "fceq")
-INSTR(FCGT,     "fcgt")
-INSTR(FCGE,     "fcge")
-
-INSTR(CCLT,     "cclt")
-INSTR(CCLE,     "ccle")
-INSTR(CCEQ,     "cceq")
-INSTR(CCGT,     "ccgt")
-INSTR(CCGE,     "ccge")
+INSTR(ICLT,     "iclt",     OPERAND_NONE,  0,              0,          1)
+INSTR(ICLE,     "icle",     OPERAND_NONE,  0,              0,          1)
+INSTR(ICEQ,     "iceq",     OPERAND_NONE,  0,              0,          1)
+INSTR(ICGT,     "icgt",     OPERAND_NONE,  0,              0,          1)
+INSTR(ICGE,     "icge",     OPERAND_NONE,  0,              0,          1)
+
+INSTR(ULCLT,    "ulclt",    OPERAND_NONE,  0,              0,          1)
+INSTR(ULCLE,    "ulcle",    OPERAND_NONE,  0,              0,          1)
+INSTR(ULCEQ,    "ulceq",    OPERAND_NONE,  0,              0,          1)
+INSTR(ULCGT,    "ulcgt",    OPERAND_NONE,  0,              0,          1)
+INSTR(ULCGE,    "ulcge",    OPERAND_NONE,  0,              0,          1)
+
+INSTR(FCLT,     "fclt",     OPERAND_NONE,  0,              0,          1)
+INSTR(FCLE,     "fcle",     OPERAND_NONE,  0,              0,          1)
+INSTR(FCEQ,     "fceq",     OPERAND_NONE,  0,              0,          1)
+INSTR(FCGT,     "fcgt",     OPERAND_NONE,  0,              0,          1)
+INSTR(FCGE,     "fcge",     OPERAND_NONE,  0,              0,          1)
+
+INSTR(CCLT,     "cclt",     OPERAND_NONE,  0,              0,          1)
+INSTR(CCLE,     "ccle",     OPERAND_NONE,  0,              0,          1)
+INSTR(CCEQ,     "cceq",     OPERAND_NONE,  0,              0,          1)
+INSTR(CCGT,     "ccgt",     OPERAND_NONE,  0,              0,          1)
+INSTR(CCGE,     "ccge",     OPERAND_NONE,  0,              0,          1)
@@ -0,0 +1,585 @@
+#define _XOPEN_SOURCE 700
+#define _XOPEN_SOURCE_EXTENDED
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lanes.h"
+#include "stream.h"
+
+const char *lanes_check(Program *program, size_t i)
+{
+	size_t width = 0;
+	switch (program->ops[i]) {
+	case I_ULPUSH: case I_ULADD: case I_ULSUB: case I_ULMULT: case I_ULDIV: case I_ULMOD: case I_ULPRINT:
+	case I_ULCEQ: case I_ULCLT: case I_ULCLE: case I_ULCGT: case I_ULCGE:
+	case I_IPUSH: case I_IADD: case I_ISUB: case I_IMULT: case I_IDIV: case I_IMOD: case I_IPRINT:
+	case I_ICEQ: case I_ICLT: case I_ICLE: case I_ICGT: case I_ICGE:
+	case I_CPUSH: case I_CADD: case I_CSUB: case I_CMULT: case I_CDIV: case I_CMOD: case I_CPRINT: case I_CIPRINT:
+	case I_CCEQ: case I_CCLT: case I_CCLE: case I_CCGT: case I_CCGE:
+	case I_FPUSH: case I_FADD: case I_FSUB: case I_FMULT: case I_FDIV: case I_FPRINT:
+	case I_FCEQ: case I_FCLT: case I_FCLE: case I_FCGT: case I_FCGE:
+	case I_POP8: case I_POP32: case I_POP64:
+	case I_DUPE8: case I_DUPE32: case I_DUPE64:
+	case I_SWAP8: case I_SWAP32: case I_SWAP64:
+	case I_PPUSH: case I_PDEREF8: case I_PDEREF32: case I_PDEREF64: case I_PSET8: case I_PSET32: case I_PSET64:
+	case I_JUMP: case I_JUMPCMP:
+		return NULL;
+	case I_LOAD8: case I_STORE8:
+		width = 1;
+		break;
+	case I_LOAD32: case I_STORE32:
+		width = 4;
+		break;
+	case I_LOAD64: case I_STORE64:
+		width = 8;
+		break;
+	default:
+		return "Instruction is not available with --lanes";
+	}
+	return program->imms[i].n > LOCAL_SIZE - width ? "Local index out of range" : NULL;
+}
+
+static size_t jump_target(Program *program, size_t i)
+{
+	ssize_t target = (ssize_t) i + 1 + program->imms[i].offset;
+	return target < 0 || (size_t) target > program->len ? program->len : (size_t) target;
+}
+
+static size_t lanes_successors(Program *program, size_t i, size_t succ[2])
+{
+	switch (program->ops[i]) {
+	case I_JUMP:
+		succ[0] = jump_target(program, i);
+		return 1;
+	case I_JUMPCMP:
+		succ[0] = jump_target(program, i);
+		succ[1] = i + 1;
+		return 2;
+	default:
+		succ[0] = i + 1;
+		return 1;
+	}
+}
+
+size_t *post_dominators(Program *program)
+{
+	size_t n = program->len;
+	size_t *ipdom = xmalloc(sizeof(*ipdom) * (n + 1));
+	size_t *order = xmalloc(sizeof(*order) * (n + 1));
+	size_t *post = xmalloc(sizeof(*post) * (n + 1));
+	size_t *pred_start = xmalloc(sizeof(*pred_start) * (n + 2));
+	size_t *preds = xmalloc(sizeof(*preds) * (n * 2 + 1));
+	size_t *stack = xmalloc(sizeof(*stack) * (n + 1));
+	size_t *edge = xmalloc(sizeof(*edge) * (n + 1));
+	size_t succ[2];
+
+	/* Predecessors of `v` are `preds[pred_start[v]..pred_start[v + 1])` */
+	memset(pred_start, 0, sizeof(*pred_start) * (n + 2));
+	for (size_t i = 0; i < n; ++i) {
+		size_t k = lanes_successors(program, i, succ);
+		for (size_t j = 0; j < k; ++j) ++pred_start[succ[j] + 1];
+	}
+	for (size_t v = 0; v <= n; ++v) pred_start[v + 1] += pred_start[v];
+	for (size_t v = 0; v <= n; ++v) edge[v] = pred_start[v];
+	for (size_t i = 0; i < n; ++i) {
+		size_t k = lanes_successors(program, i, succ);
+		for (size_t j = 0; j < k; ++j) preds[edge[succ[j]]++] = i;
+	}
+
+	/* Number the nodes in postorder of a walk from the exit against the edges */
+	for (size_t v = 0; v <= n; ++v) {
+		post[v] = LANE_UNSET;
+		ipdom[v] = LANE_UNSET;
+		edge[v] = pred_start[v];
+	}
+	size_t order_len = 0;
+	size_t sp = 0;
+	stack[sp++] = n;
+	post[n] = 0;
+	while (sp) {
+		size_t v = stack[sp - 1];
+		if (edge[v] < pred_start[v + 1]) {
+			size_t u = preds[edge[v]++];
+			if (post[u] == LANE_UNSET) {
+				post[u] = 0;
+				stack[sp++] = u;
+			}
+			continue;
+		}
+		post[v] = order_len;
+		order[order_len++] = v;
+		--sp;
+	}
+
+	ipdom[n] = n;
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (size_t k = order_len - 1; k-- > 0;) {
+			size_t v = order[k];
+			size_t dom = LANE_UNSET;
+			size_t len = lanes_successors(program, v, succ);
+			for (size_t j = 0; j < len; ++j) {
+				size_t a = succ[j];
+				if (ipdom[a] == LANE_UNSET) continue;
+				if (dom == LANE_UNSET) {
+					dom = a;
+					continue;
+				}
+				while (a != dom) {
+					while (post[a] < post[dom]) a = ipdom[a];
+					while (post[dom] < post[a]) dom = ipdom[dom];
+				}
+			}
+			if (ipdom[v] != dom) {
+				ipdom[v] = dom;
+				changed = true;
+			}
+		}
+	}
+	for (size_t v = 0; v <= n; ++v) {
+		if (ipdom[v] == LANE_UNSET) ipdom[v] = n;
+	}
+
+	free(order);
+	free(post);
+	free(pred_start);
+	free(preds);
+	free(stack);
+	free(edge);
+	return ipdom;
+}
+
+static void lanes_fail(Lanes *lanes, const char *msg)
+{
+	Program *program = &lanes->context->program;
+	fprintf(stderr, "%s:%zu:%s\n", lanes->context->path, program->rows[lanes->pc], msg);
+	abort();
+}
+
+void lanes_init(Lanes *lanes, Batch *batch)
+{
+	Ctx *context = batch->context;
+	*lanes = (Lanes){0};
+	lanes->width = batch->lanes;
+	for (size_t l = 0; l < lanes->width; ++l) {
+		vm_init(&lanes->vms[l], context);
+		vm_private_bss(&lanes->vms[l], &context->data.bss);
+	}
+	lanes->cap = 64;
+	lanes->stack = xmalloc(sizeof(*lanes->stack) * lanes->cap * lanes->width);
+	lanes->widths = xmalloc(lanes->cap);
+	lanes->locals = xmalloc(LOCAL_SIZE * lanes->width);
+	lanes->path_cap = 8;
+	lanes->paths = xmalloc(sizeof(*lanes->paths) * lanes->path_cap);
+	lanes->context = context;
+	lanes->ipdom = batch->ipdom;
+}
+
+void lanes_destroy(Lanes *lanes)
+{
+	for (size_t l = 0; l < lanes->width; ++l) vm_destroy(&lanes->vms[l]);
+	free(lanes->stack);
+	free(lanes->widths);
+	free(lanes->locals);
+	free(lanes->paths);
+}
+
+/* Room for the two slots an instruction pushes at most, so the pushes never move the stack */
+static void lanes_reserve(Lanes *lanes)
+{
+	if (lanes->depth + 2 <= lanes->cap) return;
+	if (lanes->cap * sizeof(LaneCell) >= STACK_RESERVE) lanes_fail(lanes, "Operand stack overflow");
+	lanes->cap *= 2;
+	lanes->stack = xrealloc(lanes->stack, sizeof(*lanes->stack) * lanes->cap * lanes->width);
+	lanes->widths = xrealloc(lanes->widths, lanes->cap);
+}
+
+static inline __attribute__((always_inline)) LaneCell *lanes_push(Lanes *lanes, size_t width, const size_t lane_len)
+{
+	lanes->widths[lanes->depth] = width;
+	return &lanes->stack[lanes->depth++ * lane_len];
+}
+
+/* Slot `n` from the top, pushed `width` bytes wide */
+static inline __attribute__((always_inline)) LaneCell *lanes_peek(Lanes *lanes, size_t n, size_t width, const size_t lane_len)
+{
+	if (lanes->depth <= n) lanes_fail(lanes, "Stack is empty");
+	size_t i = lanes->depth - 1 - n;
+	if (lanes->widths[i] != width) lanes_fail(lanes, "Popped with a different width than pushed, --lanes can't split values");
+	return &lanes->stack[i * lane_len];
+}
+
+static inline __attribute__((always_inline)) LaneCell *lanes_pop(Lanes *lanes, size_t width, const size_t lane_len)
+{
+	LaneCell *cells = lanes_peek(lanes, 0, width, lane_len);
+	--lanes->depth;
+	return cells;
+}
+
+static void lanes_push_path(Lanes *lanes, LanePath path)
+{
+	if (lanes->path_len == lanes->path_cap) {
+		lanes->path_cap *= 2;
+		lanes->paths = xrealloc(lanes->paths, sizeof(*lanes->paths) * lanes->path_cap);
+	}
+	lanes->paths[lanes->path_len++] = path;
+}
+
+static uint8_t *lanes_widths(Lanes *lanes)
+{
+	uint8_t *widths = xmalloc(lanes->depth + 1);
+	memcpy(widths, lanes->widths, lanes->depth);
+	return widths;
+}
+
+/*
+ * Split the running lanes at the jumpcmp `i`, `taken` go on to `target`
+ * first. Both sides wait for each other at the branch's immediate
+ * post-dominator. When that is where the running path ends anyway the
+ * not taken lanes just take over its entry, which keeps loops that lanes
+ * leave one by one from stacking up entries.
+ */
+static void lanes_diverge(Lanes *lanes, size_t i, size_t target, uint32_t taken, uint32_t rest)
+{
+	size_t rpc = lanes->ipdom[i];
+	LanePath *top = &lanes->paths[lanes->path_len - 1];
+	LanePath path = { .pc = i + 1, .rpc = rpc, .mask = rest, .depth = lanes->depth, .widths = lanes_widths(lanes) };
+	if (top->rpc == rpc) {
+		path.merge = top->merge;
+		*top = path;
+	} else {
+		path.merge = lanes->path_len - 1;
+		top->pc = rpc;
+		top->mask = taken | rest;
+		top->depth = LANE_UNSET;
+		lanes_push_path(lanes, path);
+	}
+	path = (LanePath){ .pc = target, .rpc = rpc, .merge = path.merge, .mask = taken, .depth = lanes->depth };
+	lanes_push_path(lanes, path);
+}
+
+/* The running path reached its end, switch to the next one. False once every lane is done */
+static bool lanes_join(Lanes *lanes, size_t *pc, uint32_t *mask)
+{
+	LanePath *done = &lanes->paths[--lanes->path_len];
+	if (done->merge != SIZE_MAX) {
+		LanePath *merge = &lanes->paths[done->merge];
+		if (merge->depth == LANE_UNSET) {
+			merge->depth = lanes->depth;
+			merge->widths = lanes_widths(lanes);
+		} else if (merge->depth != lanes->depth || memcmp(merge->widths, lanes->widths, lanes->depth)) {
+			lanes_fail(lanes, "Lanes join with different stacks, --lanes needs both sides of a branch to push the same");
+		}
+	}
+	if (!lanes->path_len) return false;
+
+	LanePath *next = &lanes->paths[lanes->path_len - 1];
+	lanes->depth = next->depth;
+	memcpy(lanes->widths, next->widths, next->depth);
+	free(next->widths);
+	next->widths = NULL;
+	*pc = next->pc;
+	*mask = next->mask;
+	return true;
+}
+
+/* All ones for the running lanes */
+static inline __attribute__((always_inline)) void lanes_set_mask(LaneCell *active, uint32_t mask, const size_t lane_len)
+{
+	for (size_t l = 0; l < lane_len; ++l) active[l] = -(LaneCell) (mask >> l & 1);
+}
+
+/* `old` with the bits in `keep` taken from `value` */
+static inline LaneCell lane_blend(LaneCell old, LaneCell value, LaneCell keep)
+{
+	return old ^ ((old ^ value) & keep);
+}
+
+static inline float lane_float(LaneCell cell)
+{
+	uint32_t bits = (uint32_t) cell;
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+static inline LaneCell float_lane(float f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	return bits;
+}
+
+#define LANE_UL(x) ((unsigned long) (x))
+#define LANE_I(x) ((int) (uint32_t) (x))
+#define LANE_C(x) ((char) (uint8_t) (x))
+#define LANE_F(x) lane_float(x)
+#define UL_LANE(x) ((LaneCell) (x))
+#define I_LANE(x) ((LaneCell) (uint32_t) (x))
+#define C_LANE(x) ((LaneCell) (uint8_t) (x))
+#define F_LANE(x) float_lane(x)
+
+/* Bits of a cell a value of `width` bytes takes up */
+#define LANE_BITS(width) ((width) == 8 ? ~(LaneCell) 0 : ((LaneCell) 1 << (width) * 8) - 1)
+
+#define LANE_ARITH(ty, prefix, name, op)                                                 \
+	case I_##prefix##name: {                                                         \
+		LaneCell *b = lanes_pop(lanes, sizeof(ty), lane_len);                    \
+		LaneCell *a = lanes_pop(lanes, sizeof(ty), lane_len);                    \
+		lanes_push(lanes, sizeof(ty), lane_len);                                 \
+		for (size_t l = 0; l < lane_len; ++l) {                                  \
+			ty x = LANE_##prefix(a[l]) op LANE_##prefix(b[l]);               \
+			a[l] = lane_blend(a[l], prefix##_LANE(x), active[l] & LANE_BITS(sizeof(ty))); \
+		}                                                                        \
+		break;                                                                   \
+	}
+
+/* Not vectorized, a masked off lane may hold a zero */
+#define LANE_DIV(ty, prefix, name, op)                                                   \
+	case I_##prefix##name: {                                                         \
+		LaneCell *b = lanes_pop(lanes, sizeof(ty), lane_len);                    \
+		LaneCell *a = lanes_pop(lanes, sizeof(ty), lane_len);                    \
+		lanes_push(lanes, sizeof(ty), lane_len);                                 \
+		for (size_t l = 0; l < lane_len; ++l) {                                  \
+			if (!active[l]) continue;                                        \
+			ty x = LANE_##prefix(a[l]) op LANE_##prefix(b[l]);               \
+			a[l] = lane_blend(a[l], prefix##_LANE(x), LANE_BITS(sizeof(ty)));  \
+		}                                                                        \
+		break;                                                                   \
+	}
+
+#define LANE_CMP(ty, prefix, name, op)                                                   \
+	case I_##prefix##name: {                                                         \
+		LaneCell *b = lanes_peek(lanes, 0, sizeof(ty), lane_len);                \
+		LaneCell *a = lanes_peek(lanes, 1, sizeof(ty), lane_len);                \
+		LaneCell *item = lanes_push(lanes, 1, lane_len);                         \
+		for (size_t l = 0; l < lane_len; ++l) {                                  \
+			LaneCell x = LANE_##prefix(a[l]) op LANE_##prefix(b[l]);         \
+			item[l] = lane_blend(item[l], x, active[l] & LANE_BITS(1));      \
+		}                                                                        \
+		break;                                                                   \
+	}
+
+#define LANE_TYOP(ty, prefix, print)                                                     \
+	case I_##prefix##PUSH: {                                                         \
+		ty data;                                                                 \
+		memcpy(&data, &imm->lit.data, sizeof(data));                             \
+		LaneCell *item = lanes_push(lanes, sizeof(ty), lane_len);                \
+		for (size_t l = 0; l < lane_len; ++l) {                                  \
+			item[l] = lane_blend(item[l], prefix##_LANE(data), active[l] & LANE_BITS(sizeof(ty))); \
+		}                                                                        \
+		break;                                                                   \
+	}                                                                                \
+	case I_##prefix##PRINT: {                                                        \
+		LaneCell *a = lanes_peek(lanes, 0, sizeof(ty), lane_len);                \
+		for (size_t l = 0; l < lane_len; ++l) {                                  \
+			if (active[l]) print(&lanes->vms[l], LANE_##prefix(a[l]));              \
+		}                                                                        \
+		break;                                                                   \
+	}                                                                                \
+	LANE_ARITH(ty, prefix, ADD, +)                                                   \
+	LANE_ARITH(ty, prefix, SUB, -)                                                   \
+	LANE_ARITH(ty, prefix, MULT, *)                                                  \
+	LANE_DIV(ty, prefix, DIV, /)                                                     \
+	LANE_CMP(ty, prefix, CEQ, ==)                                                    \
+	LANE_CMP(ty, prefix, CLT, <)                                                     \
+	LANE_CMP(ty, prefix, CLE, <=)                                                    \
+	LANE_CMP(ty, prefix, CGT, >)                                                     \
+	LANE_CMP(ty, prefix, CGE, >=)
+
+#define LANE_ITYOP(ty, prefix, print)                                                    \
+	LANE_TYOP(ty, prefix, print)                                                     \
+	LANE_DIV(ty, prefix, MOD, %)
+
+#define LANE_OPN(width, suffix)                                                          \
+	case I_POP##suffix: {                                                            \
+		lanes_pop(lanes, width, lane_len);                                       \
+		break;                                                                   \
+	}                                                                                \
+	case I_DUPE##suffix: {                                                           \
+		LaneCell *a = lanes_peek(lanes, 0, width, lane_len);                     \
+		LaneCell *item = lanes_push(lanes, width, lane_len);                     \
+		for (size_t l = 0; l < lane_len; ++l) {                                  \
+			item[l] = lane_blend(item[l], a[l], active[l]);                  \
+		}                                                                        \
+		break;                                                                   \
+	}                                                                                \
+	case I_SWAP##suffix: {                                                           \
+		LaneCell *b = lanes_peek(lanes, 0, width, lane_len);                     \
+		LaneCell *a = lanes_peek(lanes, 1, width, lane_len);                     \
+		for (size_t l = 0; l < lane_len; ++l) {                                  \
+			LaneCell diff = (a[l] ^ b[l]) & active[l];                       \
+			a[l] ^= diff;                                                    \
+			b[l] ^= diff;                                                    \
+		}                                                                        \
+		break;                                                                   \
+	}                                                                                \
+	case I_STORE##suffix: {                                                          \
+		LaneCell *a = lanes_pop(lanes, width, lane_len);                         \
+		for (size_t l = 0; l < lane_len; ++l) {                                  \
+			if (active[l]) memcpy(&lanes->locals[l * LOCAL_SIZE + imm->n], &a[l], width); \
+		}                                                                        \
+		break;                                                                   \
+	}                                                                                \
+	case I_LOAD##suffix: {                                                           \
+		LaneCell *item = lanes_push(lanes, width, lane_len);                     \
+		for (size_t l = 0; l < lane_len; ++l) {                                  \
+			if (active[l]) memcpy(&item[l], &lanes->locals[l * LOCAL_SIZE + imm->n], width); \
+		}                                                                        \
+		break;                                                                   \
+	}                                                                                \
+	case I_PDEREF##suffix: {                                                         \
+		LaneCell *a = lanes_pop(lanes, sizeof(void *), lane_len);                \
+		LaneCell *item = lanes_push(lanes, width, lane_len);                     \
+		for (size_t l = 0; l < lane_len; ++l) {                                  \
+			if (active[l]) memcpy(&item[l], (byte *) (uintptr_t) a[l], width); \
+		}                                                                        \
+		break;                                                                   \
+	}                                                                                \
+	case I_PSET##suffix: {                                                           \
+		LaneCell *a = lanes_pop(lanes, sizeof(void *), lane_len);                \
+		LaneCell *b = lanes_pop(lanes, width, lane_len);                         \
+		for (size_t l = 0; l < lane_len; ++l) {                                  \
+			if (active[l]) memcpy((byte *) (uintptr_t) a[l], &b[l], width);  \
+		}                                                                        \
+		break;                                                                   \
+	}
+
+/* Run the program over the lanes in `live`, instantiated for each group width */
+static inline __attribute__((always_inline)) void lanes_exec(Lanes *lanes, Program *program, uint32_t live, const size_t lane_len)
+{
+	LaneCell active[LANES_MAX];
+	size_t pc = 0;
+	uint32_t mask = live;
+	lanes_set_mask(active, mask, lane_len);
+	lanes->path_len = 0;
+	lanes_push_path(lanes, (LanePath){ .pc = 0, .rpc = program->len, .merge = SIZE_MAX, .mask = live, .depth = lanes->depth });
+
+	for (;;) {
+		if (pc >= program->len || pc == lanes->paths[lanes->path_len - 1].rpc) {
+			if (pc < program->len) lanes->pc = pc;
+			if (!lanes_join(lanes, &pc, &mask)) break;
+			lanes_set_mask(active, mask, lane_len);
+			continue;
+		}
+		lanes_reserve(lanes);
+		lanes->pc = pc;
+		union InstructionData *imm = &program->imms[pc];
+		switch (program->ops[pc++]) {
+		LANE_ITYOP(unsigned long, UL, vm_print_u64)
+		LANE_ITYOP(int, I, vm_print_i64)
+		LANE_ITYOP(char, C, vm_print_char)
+		LANE_TYOP(float, F, vm_print_float)
+		LANE_OPN(1, 8)
+		LANE_OPN(4, 32)
+		LANE_OPN(8, 64)
+		case I_CIPRINT: {
+			LaneCell *a = lanes_peek(lanes, 0, 1, lane_len);
+			for (size_t l = 0; l < lane_len; ++l) {
+				if (active[l]) vm_print_i64(&lanes->vms[l], LANE_C(a[l]));
+			}
+			break;
+		}
+		case I_PPUSH: {
+			LaneCell *item = lanes_push(lanes, sizeof(void *), lane_len);
+			for (size_t l = 0; l < lane_len; ++l) {
+				Vm *vm = &lanes->vms[l];
+				size_t offset = (uintptr_t) imm->ptr - (uintptr_t) vm->bss_origin;
+				byte *ptr = offset < vm->bss.len ? vm->bss.base + offset : imm->ptr;
+				item[l] = lane_blend(item[l], (uintptr_t) ptr, active[l]);
+			}
+			break;
+		}
+		case I_JUMP: {
+			pc += imm->offset;
+			break;
+		}
+		case I_JUMPCMP: {
+			/* The top byte of whatever is on top, like the scalar jumpcmp */
+			if (!lanes->depth) lanes_fail(lanes, "Stack is empty");
+			size_t shift = (lanes->widths[lanes->depth - 1] - 1) * 8;
+			LaneCell *a = &lanes->stack[(lanes->depth - 1) * lane_len];
+			uint32_t taken = 0;
+			for (size_t l = 0; l < lane_len; ++l) taken |= (uint32_t) ((a[l] >> shift & 0xff) != 0) << l;
+			taken &= mask;
+			size_t target = pc + imm->offset;
+			if (taken == mask) {
+				pc = target;
+			} else if (taken) {
+				lanes_diverge(lanes, pc - 1, target, taken, mask & ~taken);
+				pc = target;
+				mask = taken;
+				lanes_set_mask(active, mask, lane_len);
+			}
+			break;
+		}
+		default:
+			lanes_fail(lanes, "Instruction is not available with --lanes");
+		}
+	}
+}
+
+#undef LANE_ARITH
+#undef LANE_DIV
+#undef LANE_CMP
+#undef LANE_TYOP
+#undef LANE_ITYOP
+#undef LANE_OPN
+#undef LANE_BITS
+#undef LANE_UL
+#undef LANE_I
+#undef LANE_C
+#undef LANE_F
+#undef UL_LANE
+#undef I_LANE
+#undef C_LANE
+#undef F_LANE
+
+static void lanes_exec8(Lanes *lanes, Program *program, uint32_t live)
+{
+	lanes_exec(lanes, program, live, 8);
+}
+
+static void lanes_exec16(Lanes *lanes, Program *program, uint32_t live)
+{
+	lanes_exec(lanes, program, live, 16);
+}
+
+void lanes_run_group(Lanes *lanes, Batch *batch, size_t group)
+{
+	size_t first = group * lanes->width;
+	size_t len = batch->job_len - first < lanes->width ? batch->job_len - first : lanes->width;
+	uint32_t live = ((uint32_t) 1 << len) - 1;
+
+	lanes->depth = 0;
+	LaneCell *inputs = lanes_push(lanes, sizeof(void *), lanes->width);
+	LaneCell *lens = lanes_push(lanes, sizeof(uint64_t), lanes->width);
+	memset(inputs, 0, sizeof(*inputs) * lanes->width * 2);
+	memset(lanes->locals, 0, LOCAL_SIZE * lanes->width);
+	for (size_t l = 0; l < len; ++l) {
+		BatchJob *job = &batch->jobs[first + l];
+		Vm *vm = &lanes->vms[l];
+		FILE *out = open_memstream(&job->output, &job->output_len);
+		if (!out) panic("Failed to buffer job output\n");
+		vm_redirect(vm, out);
+		byte *input = heap_alloc(&vm->heap, job->len + 1);
+		if (!input) panic("Heap is full\n");
+		memcpy(input, job->input, job->len);
+		input[job->len] = '\0';
+		inputs[l] = (uintptr_t) input;
+		lens[l] = job->len;
+	}
+
+	if (lanes->width == 8) lanes_exec8(lanes, &batch->context->program, live);
+	else lanes_exec16(lanes, &batch->context->program, live);
+
+	for (size_t l = 0; l < len; ++l) {
+		Vm *vm = &lanes->vms[l];
+		FILE *out = vm->streams[STREAM_OUT].file;
+		vm_redirect(vm, NULL);
+		if (fclose(out)) panic("Failed to buffer job output\n");
+		vm_reset(vm);
+	}
+}
@@ -0,0 +1,76 @@
+#ifndef LANES_H
+#define LANES_H
+
+#include "batch.h"
+
+/*
+ * With --lanes a --batch worker runs a group of jobs in lockstep. An
+ * operand stack slot holds one 8 byte cell per lane side by side, so the
+ * typed arithmetic is a fixed-width loop over the lanes that the compiler
+ * turns into vector instructions (AVX2 when built with -mavx2). Where the lanes disagree on a jumpcmp
+ * each side runs with the other side's lanes masked off, and the two join
+ * again at the branch's immediate post-dominator.
+ */
+#define LANES_MAX 16
+/* Depth of a join no path has reached yet */
+#define LANE_UNSET SIZE_MAX
+
+/*
+ * A value sits in the low bytes of its cell. Cells are plain integers so
+ * that masked writes are bit operations the vectorizer understands.
+ */
+typedef uint64_t LaneCell;
+
+/* Lanes `mask` run from `pc` until they reach `rpc`, where path `merge` waits for them */
+typedef struct LanePath {
+	size_t pc;
+	size_t rpc;
+	size_t merge;
+	uint32_t mask;
+	/* Stack depth at `pc` and the widths pushed up to it, restored when this path runs */
+	size_t depth;
+	uint8_t *widths;
+} LanePath;
+
+typedef struct Lanes {
+	/* 8 or 16 */
+	size_t width;
+	/* Each lane's heap, data and output */
+	Vm vms[LANES_MAX];
+	/* Slot `i` is the `width` cells from `stack + i * width` */
+	LaneCell *stack;
+	/* Bytes pushed into each slot, a pop has to match them */
+	uint8_t *widths;
+	size_t depth;
+	size_t cap;
+	/* LOCAL_SIZE bytes per lane */
+	byte *locals;
+	/* Innermost path last */
+	LanePath *paths;
+	size_t path_len;
+	size_t path_cap;
+	/* The instruction running, for errors */
+	size_t pc;
+	Ctx *context;
+	const size_t *ipdom;
+} Lanes;
+
+/* Why --lanes can't run instruction `i`, NULL when it can */
+const char *lanes_check(Program *program, size_t i);
+
+/*
+ * Immediate post-dominator of every instruction, with the end of the
+ * program as the exit node. This is the Cooper, Harvey and Kennedy
+ * dominator algorithm run on the reversed control flow graph.
+ * Instructions that never reach the end get the end.
+ */
+size_t *post_dominators(Program *program);
+
+void lanes_init(Lanes *lanes, Batch *batch);
+
+void lanes_destroy(Lanes *lanes);
+
+/* Like `batch_run_job` for the jobs of group `group`, the lanes past the last job stay masked off */
+void lanes_run_group(Lanes *lanes, Batch *batch, size_t group);
+
+#endif /* LANES_H */
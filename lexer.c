@@ -1,9 +1,14 @@
+#define _XOPEN_SOURCE 700
+#define _XOPEN_SOURCE_EXTENDED
+
 #include <assert.h>
 #include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "ass.h"
 #include "lexer.h"
@@ -31,28 +36,63 @@ static bool is_ident(char c)
 	return isalnum(c) || c == '_';
 }
 
-void lexer_init(Lexer *lexer, Arena *arena, FILE *file, size_t len)
+/* Refill the buffer from the file, returns the number of bytes read */
+static size_t lexer_fill(Lexer *lexer)
+{
+	size_t n = 0;
+	if (lexer->remaining == LEXER_UNBOUNDED) {
+		/* Take whatever the writer has produced so far instead of waiting for a full buffer */
+		ssize_t got;
+		while ((got = read(fileno(lexer->file), lexer->buf, sizeof(lexer->buf))) < 0 && errno == EINTR);
+		if (got > 0) n = got;
+		else lexer->remaining = 0;
+	} else {
+		size_t want = sizeof(lexer->buf);
+		if (lexer->remaining < want) want = lexer->remaining;
+		if (want && lexer->offset >= 0) {
+			ssize_t got;
+			while ((got = pread(fileno(lexer->file), lexer->buf, want, lexer->offset)) < 0 && errno == EINTR);
+			if (got > 0) n = got;
+			lexer->offset += n;
+		} else if (want) {
+			n = fread(lexer->buf, 1, want, lexer->file);
+		}
+		/* Short read means the file is done, whatever length we were told */
+		lexer->remaining = n < want ? 0 : lexer->remaining - n;
+	}
+	dprintf("filled buffer with %lu bytes\n", n);
+
+	lexer->pos = 0;
+	lexer->filled = n;
+	return n;
+}
+
+void lexer_init(Lexer *lexer, Arena *arena, FILE *file, off_t offset, size_t len)
 {
-	lexer->len = len;
+	lexer->offset = offset;
 	lexer->remaining = len;
+	lexer->pos = 0;
+	lexer->filled = 0;
 	lexer->file = file;
 	lexer->col = 0;
 	lexer->row = 0;
 	lexer->arena = arena;
+	lexer->scratch = arena_create(LEXER_SCRATCH_SIZE);
+	if (!lexer->scratch) panic("Failed to allocate lexer scratch arena\n");
 
-	size_t n = fread(lexer->buf, 1, sizeof(lexer->buf), lexer->file);
-	dprintf("filled buffer with %lu bytes\n", n);
+	lexer_fill(lexer);
+}
+
+void lexer_destroy(Lexer *lexer)
+{
+	arena_destroy(lexer->scratch);
+	lexer->scratch = NULL;
 }
 
 static int lexer_bump(Lexer *lexer)
 {
-	if (lexer->remaining <= 0) return EOF;
-	size_t idx = (lexer->len - lexer->remaining--) % sizeof(lexer->buf);
-	int c = lexer->buf[idx];
-	if (idx + 1 == sizeof(lexer->buf)) {
-		size_t n = fread(lexer->buf, 1, sizeof(lexer->buf), lexer->file);
-		dprintf("filled buffer with %lu bytes\n", n);
-	}
+	if (lexer->pos >= lexer->filled && !lexer_fill(lexer)) return EOF;
+	int c = lexer->buf[lexer->pos++];
 
 	lexer->prev_row = lexer->row;
 	lexer->prev_col = lexer->col;
@@ -69,9 +109,8 @@ static int lexer_bump(Lexer *lexer)
 
 static int lexer_peak(Lexer *lexer)
 {
-	if (lexer->remaining <= 0) return EOF;
-	size_t idx = (lexer->len - lexer->remaining) % sizeof(lexer->buf);
-	return lexer->buf[idx];
+	if (lexer->pos >= lexer->filled && !lexer_fill(lexer)) return EOF;
+	return lexer->buf[lexer->pos];
 }
 
 #define SBUF_SIZE 16 * 16
@@ -156,9 +195,9 @@ static void lexer_consume_signed_num_lit(Lexer *lexer, Token *token, char c)
 	*p = '\0';
 
 	if (is_float) {
-		double f = atof(buf);
+		/* Kept as a double, dd initializers need every digit */
 		token->kind = T_FNUMLIT;
-		token->data.f = f;
+		token->data.d = strtod(buf, NULL);
 	} else {
 		int i = atoi(buf);
 		token->kind = T_INUMLIT;
@@ -228,9 +267,9 @@ static void lexer_consume_num_lit(Lexer *lexer, Token *token, char c)
 	*p = '\0';
 
 	if (is_float) {
-		double f = atof(buf);
+		/* Kept as a double, dd initializers need every digit */
 		token->kind = T_FNUMLIT;
-		token->data.f = f;
+		token->data.d = strtod(buf, NULL);
 	} else {
 		long ui = atol(buf);
 		token->kind = T_UINUMLIT;
@@ -240,27 +279,34 @@ static void lexer_consume_num_lit(Lexer *lexer, Token *token, char c)
 
 static void lexer_consume_comment(Lexer *lexer)
 {
-	while (lexer_peak(lexer) != '\n') lexer_bump(lexer);
+	int c;
+	while ((c = lexer_peak(lexer)) != '\n' && c != EOF) lexer_bump(lexer);
 }
 
+/* Grows inside a scratch arena, outgrown buffers are dropped with it */
 typedef struct StringBuilder {
+	Arena *arena;
 	size_t len;
 	size_t cap;
 	char *items;
 } StringBuilder;
 
-void string_builder_init(StringBuilder *string_builder, size_t cap)
+void string_builder_init(StringBuilder *string_builder, Arena *arena, size_t cap)
 {
+	arena_clear(arena);
+	string_builder->arena = arena;
 	string_builder->len = 0;
 	string_builder->cap = cap;
-	string_builder->items = xmalloc(sizeof(*string_builder->items) * cap);
+	string_builder->items = arena_xalloc(arena, sizeof(*string_builder->items) * cap);
 }
 
 void string_builder_push(StringBuilder *string_builder, char c)
 {
 	if (string_builder->len >= string_builder->cap) {
+		char *items = arena_xalloc(string_builder->arena, string_builder->cap * 2);
+		memcpy(items, string_builder->items, string_builder->len);
+		string_builder->items = items;
 		string_builder->cap *= 2;
-		string_builder->items = xrealloc(string_builder->items, string_builder->cap);
 	}
 
 	string_builder->items[string_builder->len++] = c;
@@ -270,15 +316,13 @@ void string_builder_build(StringBuilder *string_builder, char *buf)
 {
 	memcpy(buf, string_builder->items, string_builder->len);
 	buf[string_builder->len] = '\0';
-	free(string_builder->items);
 }
 
 static void lexer_consume_string_lit(Lexer *lexer, Token *token)
 {
 	StringBuilder string_builder = {0};
 	int c = lexer_bump(lexer);
-	string_builder_init(&string_builder, 16);
-	string_builder_push(&string_builder, c);
+	string_builder_init(&string_builder, lexer->scratch, 16);
 	token->kind = T_SLIT;
 
 	while (c != '"') {
@@ -296,7 +340,7 @@ static void lexer_consume_string_lit(Lexer *lexer, Token *token)
 			T('0', '\0'); T('a', '\a');
 			T('b', '\b'); T('t', '\t');
 			T('n', '\n'); T('\\', '\\');
-			T('\'', '\'');
+			T('\'', '\''); T('"', '"');
 			default:
 				// ERROR Invalid escape character
 				token->kind = T_ILLEGAL;
@@ -312,6 +356,7 @@ static void lexer_consume_string_lit(Lexer *lexer, Token *token)
 	char *s = arena_xalloc(lexer->arena, string_builder.len + 1);
 	string_builder_build(&string_builder, s);
 	token->data.s = s;
+	token->len = string_builder.len;
 }
 
 static void lexer_consume_char_lit(Lexer *lexer, Token *token)
@@ -356,6 +401,7 @@ static void lexer_consume_section(Lexer *lexer, Token *token)
 #define CMP_TOK(s, tok) do { if (strncmp(s, buf, sizeof(buf)) == 0) { token->kind = tok; return; } } while(0)
 	CMP_TOK("data", T_SECTION_DATA);
 	CMP_TOK("text", T_SECTION_TEXT);
+	CMP_TOK("stack", T_DIRECTIVE_STACK);
 #undef CMP_TOK
 
 	// Invalid section name
@@ -2,6 +2,7 @@
 #define LEXER_H
 
 #include <stdint.h>
+#include <sys/types.h>
 
 #include "arena.h"
 #include "ass.h"
@@ -26,16 +27,29 @@ typedef union Data TokenData;
 typedef struct Token {
 	enum TokenKind kind;
 	TokenData data;
+	/* Bytes in a T_SLIT, which may contain '\0' */
+	size_t len;
 	Span span;
 } Token;
 
 #define LEXER_BUF_SIZE (1024 * 64)
 //#define LEXER_BUF_SIZE (1)
+
+/* Length to pass for pipes and other streams of unknown size */
+#define LEXER_UNBOUNDED SIZE_MAX
+
+/* Initial size of the per-token scratch arena */
+#define LEXER_SCRATCH_SIZE 256
+
 typedef struct Lexer {
 	char buf[LEXER_BUF_SIZE];
 	FILE *file;
-	size_t len;
+	/* Where the next pread of `file` starts, -1 reads it in order */
+	off_t offset;
+	/* Bytes left to read from `file` */
 	size_t remaining;
+	size_t pos;
+	size_t filled;
 
 	size_t prev_col;
 	size_t prev_row;
@@ -43,11 +57,15 @@ typedef struct Lexer {
 	size_t row;
 
 	Arena *arena;
+	/* Cleared for every string literal, owned by the lexer */
+	Arena *scratch;
 } Lexer;
 
 void token_name(Token *token, char *buf);
 
-void lexer_init(Lexer *lexer, Arena *arena, FILE *file, size_t len);
+void lexer_init(Lexer *lexer, Arena *arena, FILE *file, off_t offset, size_t len);
+
+void lexer_destroy(Lexer *lexer);
 
 Token lexer_next(Lexer *lexer);
 
@@ -9,16 +9,49 @@
 #define span_join(a, b) ({printf("%s:%d:span_join(a, b)\n", __FILE__, __LINE__); span_join(a, b);})
 #endif
 
-void parser_init(Parser *parser, Arena *arena, FILE *file, size_t len)
+const InstructionInfo instruction_info[] = {
+#define INSTR(x, str, shape, lits, pop, push) [I_##x] = { I_##x, str, shape, lits, pop, push },
+#include "instructions.h"
+#undef INSTR
+};
+
+/* Instruction metadata for each opcode token, NULL for every other token */
+static const InstructionInfo *const token_instructions[T_ILLEGAL + 1] = {
+#define INSTR(x, ...) [T_##x] = &instruction_info[I_##x],
+#include "instructions.h"
+#undef INSTR
+};
+
+void program_push(Program *program, enum InstructionKind kind, union InstructionData imm, size_t row)
+{
+	if (program->len >= program->cap) {
+		program->cap *= 2;
+		program->ops = xrealloc(program->ops, sizeof(*program->ops) * program->cap);
+		program->imms = xrealloc(program->imms, sizeof(*program->imms) * program->cap);
+		program->rows = xrealloc(program->rows, sizeof(*program->rows) * program->cap);
+	}
+	program->ops[program->len] = kind;
+	program->imms[program->len] = imm;
+	program->rows[program->len] = row;
+	++program->len;
+}
+
+void parser_init(Parser *parser, Arena *arena, Program *program, FILE *file, off_t offset, size_t len)
 {
 	Lexer lexer = {0};
-	lexer_init(&lexer, arena, file, len);
+	lexer_init(&lexer, arena, file, offset, len);
 	parser->span = (Span) { 0, 0, 0, 0 };
 	parser->lexer = lexer;
 	parser->arena = arena;
+	parser->program = program;
 	parser->state = PARSE_TEXT;
 }
 
+void parser_destroy(Parser *parser)
+{
+	lexer_destroy(&parser->lexer);
+}
+
 static bool is_end_of_statement(enum TokenKind kind)
 {
 	return kind == T_EOL || kind == T_EOF;
@@ -37,7 +70,7 @@ static Token parser_bump(Parser *parser)
 		parser->error = _s;                                   \
 	} while (0)
 
-#define single_stmt_expect(parser, instruction_kind)                 \
+#define single_stmt_expect(parser)                                    \
 	do {                                                         \
 		Token next = parser_bump(parser);                    \
 		if (next.kind != T_EOL && next.kind != T_EOF) {      \
@@ -46,19 +79,15 @@ static Token parser_bump(Parser *parser)
 			parser_err(parser, __s);                     \
 			return -1;                                   \
 		}                                                    \
-		node->data.instruction.kind = instruction_kind;      \
-		node->kind = N_INSTRUCTION;                          \
 		node->span = span_join(node->span, next.span);       \
 		return 0;                                            \
 	} while (0)
 
-static int parse_push(Parser *parser, Node *node, enum InstructionKind kind, int lit_kind_mask)
+static int parse_push(Parser *parser, Node *node, union InstructionData *imm, int lit_kind_mask)
 {
 	Token next = parser_bump(parser);
-	Lit *lit = &node->data.instruction.data.lit;
+	Lit *lit = &imm->lit;
 	node->span = span_join(node->span, next.span);
-	node->kind = N_INSTRUCTION;
-	node->data.instruction.kind = kind;
 
 	if (next.kind == T_INUMLIT) {
 		lit->kind = L_INT;
@@ -68,7 +97,7 @@ static int parse_push(Parser *parser, Node *node, enum InstructionKind kind, int
 		lit->data.ui = next.data.ui;
 	} else if (next.kind == T_FNUMLIT) {
 		lit->kind = L_FLOAT;
-		lit->data.f = next.data.f;
+		lit->data.f = (float) next.data.d;
 	} else if (next.kind == T_IDENT) {
 		lit->kind = L_PTR;
 		lit->data.s = next.data.s;
@@ -98,16 +127,16 @@ static int parse_push(Parser *parser, Node *node, enum InstructionKind kind, int
 		lit->data.f = casted;
 	} else if (lit_kind_mask & (L_INT | L_UINT) && lit->kind & L_FLOAT) {
 		assert(lit->kind == L_FLOAT);
-		if (next.data.f < 0.0) {
-			int64_t casted = (int64_t) next.data.f;
+		if (next.data.d < 0.0) {
+			int64_t casted = (int64_t) next.data.d;
 			lit->kind = L_INT;
 			lit->data.i = casted;
-			dprintf("Casting float into integer literal:`%f` => `%ld`\n", next.data.f, casted);
+			dprintf("Casting float into integer literal:`%f` => `%ld`\n", next.data.d, casted);
 		} else {
-			uint64_t casted = (uint64_t) next.data.f;
+			uint64_t casted = (uint64_t) next.data.d;
 			lit->kind = L_UINT;
 			lit->data.ui = casted;
-			dprintf("Casting float into integer literal:`%f` => `%lu`\n", next.data.f, casted);
+			dprintf("Casting float into integer literal:`%f` => `%lu`\n", next.data.d, casted);
 		}
 	} else if (!(lit->kind & lit_kind_mask)) {
 		/* TODO: Report what literal types are allowed */
@@ -142,16 +171,14 @@ static int parse_push(Parser *parser, Node *node, enum InstructionKind kind, int
 	return 0;
 }
 
-static int parse_idx(Parser *parser, Node *node, enum InstructionKind kind)
+static int parse_idx(Parser *parser, Node *node, union InstructionData *imm)
 {
 	Token next = parser_bump(parser);
 	node->span = span_join(node->span, next.span);
-	node->data.instruction.kind = kind;
-	node->kind = N_INSTRUCTION;
 	node->span = next.span;
 
 	if (next.kind == T_UINUMLIT) {
-		node->data.instruction.data.n = next.data.ui;
+		imm->n = next.data.ui;
 	} else {
 		parser_err(parser, "Expected index");
 		return -1;
@@ -166,12 +193,47 @@ static int parse_idx(Parser *parser, Node *node, enum InstructionKind kind)
 	return 0;
 }
 
-static int parse_single_stmt(Parser *parser, Node *node, enum InstructionKind kind)
+/* Indexed by the bit of the `MemoryOrder` */
+static const char *const order_names[] = { "relaxed", "acquire", "release", "acq_rel", "seq_cst" };
+
+static int parse_order(Parser *parser, Node *node, union InstructionData *imm, int order_mask)
+{
+	Token next = parser_bump(parser);
+	if (is_end_of_statement(next.kind)) {
+		imm->n = ORDER_SEQ_CST;
+		return 0;
+	}
+	node->span = span_join(node->span, next.span);
+
+	imm->n = 0;
+	if (next.kind == T_IDENT) {
+		for (size_t i = 0; i < sizeof(order_names) / sizeof(*order_names); ++i) {
+			if (strcmp(next.data.s, order_names[i]) == 0) imm->n = (size_t) 1 << i;
+		}
+	}
+	if (!imm->n) {
+		parser_err(parser, "Expected a memory order");
+		return -1;
+	}
+	if (!(imm->n & order_mask)) {
+		parser_err(parser, "Memory order not allowed here");
+		return -1;
+	}
+
+	next = parser_bump(parser);
+	if (!is_end_of_statement(next.kind)) {
+		parser_err(parser, "Expected newline");
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_single_stmt(Parser *parser, Node *node)
 {
-	single_stmt_expect(parser, kind);
+	single_stmt_expect(parser);
 }
 
-static int parse_jump(Parser *parser, Node *node)
+static int parse_jump(Parser *parser, Node *node, union InstructionData *imm)
 {
 	Token next = parser_bump(parser);
 	node->span = span_join(node->span, next.span);
@@ -180,11 +242,8 @@ static int parse_jump(Parser *parser, Node *node)
 		return -1;
 	}
 
-	node->data.instruction.kind = I_JUMP;
-	node->kind = N_INSTRUCTION;
-
 	if (next.kind == T_IDENT) {
-		node->data.instruction.data.s = next.data.s;
+		imm->s = next.data.s;
 	}
 
 	next = parser_bump(parser);
@@ -196,23 +255,31 @@ static int parse_jump(Parser *parser, Node *node)
 	return 0;
 }
 
-static int parse_jumpcmp(Parser *parser, Node *node, enum InstructionKind kind)
+/* .stack operand_bytes [, return_bytes] */
+static int parse_stack_directive(Parser *parser, Node *node)
 {
+	node->kind = N_STACK;
+	node->data.stack = (StackSizes){0};
+
 	Token next = parser_bump(parser);
 	node->span = span_join(node->span, next.span);
-	if (next.kind != T_IDENT) {
-		parser_err(parser, "Expected label");
+	if (next.kind != T_UINUMLIT) {
+		parser_err(parser, "Expected stack size");
 		return -1;
 	}
-
-	node->data.instruction.kind = kind;
-	node->kind = N_INSTRUCTION;
-
-	if (next.kind == T_IDENT) {
-		node->data.instruction.data.s = next.data.s;
-	}
+	node->data.stack.operand = next.data.ui;
 
 	next = parser_bump(parser);
+	if (next.kind == T_COMMA) {
+		next = parser_bump(parser);
+		node->span = span_join(node->span, next.span);
+		if (next.kind != T_UINUMLIT) {
+			parser_err(parser, "Expected return stack size");
+			return -1;
+		}
+		node->data.stack.ret = next.data.ui;
+		next = parser_bump(parser);
+	}
 	if (!is_end_of_statement(next.kind)) {
 		parser_err(parser, "Expected newline");
 		return -1;
@@ -221,15 +288,13 @@ static int parse_jumpcmp(Parser *parser, Node *node, enum InstructionKind kind)
 	return 0;
 }
 
-static int parse_jumpproc(Parser *parser, Node *node)
+static int parse_jumpproc(Parser *parser, Node *node, union InstructionData *imm)
 {
 	Token next = parser_bump(parser);
-	node->data.instruction.kind = I_JUMPPROC;
-	node->kind = N_INSTRUCTION;
 	node->span = span_join(node->span, next.span);
 
 	if (next.kind == T_IDENT) {
-		node->data.instruction.data.proc.location.s = next.data.s;
+		imm->proc.location.s = next.data.s;
 	} else {
 		parser_err(parser, "Expected label");
 		return -1;
@@ -238,7 +303,7 @@ static int parse_jumpproc(Parser *parser, Node *node)
 	next = parser_bump(parser);
 	node->span = span_join(node->span, next.span);
 	if (next.kind == T_UINUMLIT) {
-		node->data.instruction.data.proc.argc = next.data.ui;
+		imm->proc.argc = next.data.ui;
 	} else {
 		parser_err(parser, "Expected number of bytes");
 		return -1;
@@ -267,11 +332,94 @@ static int parse_label(Parser *parser, const Token *token, Node *node)
 	return 0;
 }
 
+/* Strings and numbers packed back to back: `msg db "Hi", 10, 0` */
+static int parse_data_init(Parser *parser, Node *node, size_t ty_size, Token next)
+{
+	size_t cap = 64;
+	size_t len = 0;
+	unsigned char *buf = xmalloc(cap);
+
+	for (;;) {
+		size_t n = next.kind == T_SLIT ? next.len : ty_size;
+		while (len + n > cap) buf = xrealloc(buf, cap *= 2);
+
+		if (next.kind == T_SLIT && ty_size == 1) {
+			memcpy(buf + len, next.data.s, n);
+		} else if (next.kind == T_INUMLIT || next.kind == T_UINUMLIT) {
+			/* Signed and unsigned share the low bytes */
+			uint64_t ui = next.data.ui;
+			int8_t i8 = (int8_t) ui;
+			int32_t i32 = (int32_t) ui;
+			switch (ty_size) {
+			case 1: memcpy(buf + len, &i8, n); break;
+			case 4: memcpy(buf + len, &i32, n); break;
+			case 8: memcpy(buf + len, &ui, n); break;
+			}
+		} else if (next.kind == T_FNUMLIT && ty_size == 4) {
+			float f = (float) next.data.d;
+			memcpy(buf + len, &f, n);
+		} else if (next.kind == T_FNUMLIT && ty_size == 8) {
+			memcpy(buf + len, &next.data.d, n);
+		} else {
+			parser_err(parser, next.kind == T_SLIT
+				? "string initializers need db"
+				: "expected a number or string");
+			free(buf);
+			return -1;
+		}
+		len += n;
+		node->span = span_join(node->span, next.span);
+
+		next = parser_bump(parser);
+		if (is_end_of_statement(next.kind)) break;
+		if (next.kind != T_COMMA) {
+			parser_err(parser, "expected a comma");
+			free(buf);
+			return -1;
+		}
+		next = parser_bump(parser);
+	}
+
+	void *init = arena_xalloc(parser->arena, len ? len : 1);
+	memcpy(init, buf, len);
+	free(buf);
+	node->data.declaration.init = init;
+	node->data.declaration.len = len;
+	return 0;
+}
+
+/* `table dd file "path" [shared]`, "file" and "shared" are only keywords here */
+static int parse_data_file(Parser *parser, Node *node)
+{
+	Token next = parser_bump(parser);
+	if (next.kind != T_SLIT) {
+		parser_err(parser, "expected a file path");
+		return -1;
+	}
+	node->data.declaration.path = next.data.s;
+	node->span = span_join(node->span, next.span);
+
+	next = parser_bump(parser);
+	if (next.kind == T_IDENT && strcmp(next.data.s, "shared") == 0) {
+		node->data.declaration.shared = true;
+		node->span = span_join(node->span, next.span);
+		next = parser_bump(parser);
+	}
+	if (!is_end_of_statement(next.kind)) {
+		parser_err(parser, "expected end of statement");
+		return -1;
+	}
+	return 0;
+}
+
 static int parse_data(Parser *parser, const Token *token, Node *node)
 {
 	Token next = parser_bump(parser);
 	node->span = span_join(node->span, next.span);
-	node->data.declaration.ident = token->data.s;
+	node->data.declaration = (Declaration){
+		.ident = token->data.s,
+		.align = 1,
+	};
 	node->kind = N_DECLARATION;
 
 	if (next.kind == T_DD || next.kind == T_DB || next.kind == T_DW) {
@@ -294,6 +442,7 @@ static int parse_data(Parser *parser, const Token *token, Node *node)
 		default:
 			panic("Unreachable\n");
 		}
+		node->data.declaration.align = ty_size;
 
 		next = parser_bump(parser);
 		if (next.kind == T_OPEN_BRACKET) {
@@ -303,22 +452,28 @@ static int parse_data(Parser *parser, const Token *token, Node *node)
 				return -1;
 			}
 
-			node->data.declaration.bytes = calloc(next.data.ui, ty_size);
 			node->data.declaration.len = next.data.ui * ty_size;
 			node->span = span_join(node->span, next.span);
-			node->data.declaration.span = node->span;
 
 			next = parser_bump(parser);
 			if (next.kind != T_CLOSE_BRACKET) {
 				parser_err(parser, "unclosed bracket");
 				return -1;
 			}
-		} else {
-			panic("Unimplemented\n");
+		} else if (next.kind == T_IDENT && strcmp(next.data.s, "file") == 0) {
+			if (parse_data_file(parser, node) < 0) return -1;
+		} else if (parse_data_init(parser, node, ty_size, next) < 0) {
+			return -1;
 		}
 	} else if (next.kind == T_EXTERN) {
 		next = parser_bump(parser);
 		node->data.declaration.kind = D_EXTERN;
+		/* `name extern variadic`, only a keyword here */
+		if (next.kind == T_IDENT && strcmp(next.data.s, "variadic") == 0) {
+			node->data.declaration.variadic = true;
+			node->span = span_join(node->span, next.span);
+			next = parser_bump(parser);
+		}
 
 		if (!is_end_of_statement(next.kind)) {
 			char __s[256];
@@ -333,13 +488,32 @@ static int parse_data(Parser *parser, const Token *token, Node *node)
 		return -1;
 	}
 
+	node->data.declaration.span = node->span;
 	return 0;
 }
 
-Node *parser_next(Parser *parser)
+static int parse_instruction(Parser *parser, Node *node, union InstructionData *imm, const InstructionInfo *info)
+{
+	switch (info->shape) {
+	case OPERAND_NONE:
+		return parse_single_stmt(parser, node);
+	case OPERAND_LIT:
+		return parse_push(parser, node, imm, info->lit_kind_mask);
+	case OPERAND_IDX:
+		return parse_idx(parser, node, imm);
+	case OPERAND_LABEL:
+		return parse_jump(parser, node, imm);
+	case OPERAND_PROC:
+		return parse_jumpproc(parser, node, imm);
+	case OPERAND_ORDER:
+		return parse_order(parser, node, imm, info->lit_kind_mask);
+	}
+	panic("Unreachable\n");
+}
+
+bool parser_next(Parser *parser, Node *node)
 {
 	Token token;
-	Node *node = arena_xalloc(parser->arena, sizeof(*node));
 	int errcode = 0;
 
 tailcall:
@@ -349,10 +523,20 @@ tailcall:
 	switch (token.kind) {
 	case T_SECTION_TEXT:
 		parser->state = PARSE_TEXT;
-		goto tailcall;
+		node->kind = N_SECTION;
+		node->data.section = PARSE_TEXT;
+		return true;
 	case T_SECTION_DATA:
 		parser->state = PARSE_DATA;
-		goto tailcall;
+		node->kind = N_SECTION;
+		node->data.section = PARSE_DATA;
+		return true;
+	case T_DIRECTIVE_STACK:
+		if (parse_stack_directive(parser, node) < 0) {
+			parser->span = node->span;
+			return false;
+		}
+		return true;
 	case T_EOL:
 		goto tailcall;
 	default: ;
@@ -364,6 +548,9 @@ tailcall:
 		case T_IDENT:
 			errcode = parse_data(parser, &token, node);
 			break;
+		case T_EOF:
+			node->kind = N_EOF;
+			break;
 		default: {
 			char msg[256] = {0};
 			char name[256] = {0};
@@ -374,279 +561,23 @@ tailcall:
 		}
 		}
 		break;
-	case PARSE_TEXT:
-		switch (token.kind) {
-		case T_ULPUSH:
-			errcode = parse_push(parser, node, I_ULPUSH, L_INT | L_UINT);
-			break;
-		case T_ULADD:
-			errcode = parse_single_stmt(parser, node, I_ULADD);
-			break;
-		case T_ULSUB:
-			errcode = parse_single_stmt(parser, node, I_ULSUB);
-			break;
-		case T_ULMULT:
-			errcode = parse_single_stmt(parser, node, I_ULMULT);
-			break;
-		case T_ULDIV:
-			errcode = parse_single_stmt(parser, node, I_ULDIV);
-			break;
-		case T_ULMOD:
-			errcode = parse_single_stmt(parser, node, I_ULMOD);
-			break;
-		case T_ULPRINT:
-			errcode = parse_single_stmt(parser, node, I_ULPRINT);
-			break;
-
-		case T_IPUSH:
-			errcode = parse_push(parser, node, I_IPUSH, L_UINT | L_INT);
-			break;
-		case T_IADD:
-			errcode = parse_single_stmt(parser, node, I_IADD);
-			break;
-		case T_ISUB:
-			errcode = parse_single_stmt(parser, node, I_ISUB);
-			break;
-		case T_IMULT:
-			errcode = parse_single_stmt(parser, node, I_IMULT);
-			break;
-		case T_IDIV:
-			errcode = parse_single_stmt(parser, node, I_IDIV);
-			break;
-		case T_IMOD:
-			errcode = parse_single_stmt(parser, node, I_IMOD);
-			break;
-		case T_IPRINT:
-			errcode = parse_single_stmt(parser, node, I_IPRINT);
-			break;
-
-		case T_FPUSH:
-			errcode = parse_push(parser, node, I_FPUSH, L_FLOAT);
-			break;
-		case T_FADD:
-			errcode = parse_single_stmt(parser, node, I_FADD);
-			break;
-		case T_FSUB:
-			errcode = parse_single_stmt(parser, node, I_FSUB);
-			break;
-		case T_FMULT:
-			errcode = parse_single_stmt(parser, node, I_FMULT);
-			break;
-		case T_FDIV:
-			errcode = parse_single_stmt(parser, node, I_FDIV);
-			break;
-		case T_FPRINT:
-			errcode = parse_single_stmt(parser, node, I_FPRINT);
-			break;
-
-		case T_CPUSH:
-			errcode = parse_push(parser, node, I_CPUSH, L_UINT | L_INT);
-			break;
-		case T_CADD:
-			errcode = parse_single_stmt(parser, node, I_CADD);
-			break;
-		case T_CSUB:
-			errcode = parse_single_stmt(parser, node, I_CSUB);
-			break;
-		case T_CMULT:
-			errcode = parse_single_stmt(parser, node, I_CMULT);
-			break;
-		case T_CDIV:
-			errcode = parse_single_stmt(parser, node, I_CDIV);
-			break;
-		case T_CMOD:
-			errcode = parse_single_stmt(parser, node, I_CMOD);
-			break;
-		case T_CPRINT:
-			errcode = parse_single_stmt(parser, node, I_CPRINT);
-			break;
-		case T_CIPRINT:
-			errcode = parse_single_stmt(parser, node, I_CIPRINT);
-			break;
-
-		case T_PPUSH:
-			errcode = parse_push(parser, node, I_PPUSH, L_PTR);
-			break;
-		case T_PLOAD:
-			errcode = parse_idx(parser, node, I_PLOAD);
-			break;
-		case T_PDEREF8:
-			errcode = parse_single_stmt(parser, node, I_PDEREF8);
-			break;
-		case T_PDEREF32:
-			errcode = parse_single_stmt(parser, node, I_PDEREF32);
-			break;
-		case T_PDEREF64:
-			errcode = parse_single_stmt(parser, node, I_PDEREF64);
-			break;
-		case T_PDEREF:
-			errcode = parse_idx(parser, node, I_PDEREF);
-			break;
-		case T_PSET8:
-			errcode = parse_single_stmt(parser, node, I_PSET8);
-			break;
-		case T_PSET32:
-			errcode = parse_single_stmt(parser, node, I_PSET32);
-			break;
-		case T_PSET64:
-			errcode = parse_single_stmt(parser, node, I_PSET64);
-			break;
-		case T_PSET:
-			errcode = parse_idx(parser, node, I_PSET);
-			break;
-
-		case T_POP8:
-			errcode = parse_single_stmt(parser, node, I_POP8);
-			break;
-		case T_POP32:
-			errcode = parse_single_stmt(parser, node, I_POP32);
-			break;
-		case T_POP64:
-			errcode = parse_single_stmt(parser, node, I_POP64);
-			break;
-
-		case T_JUMP:
-			errcode = parse_jump(parser, node);
-			break;
-		case T_JUMPCMP:
-			errcode = parse_jumpcmp(parser, node, I_JUMPCMP);
-			break;
-		case T_JUMPPROC:
-			errcode = parse_jumpproc(parser, node);
-			break;
-
-		case T_ICLT:
-			errcode = parse_single_stmt(parser, node, I_ICLT);
-			break;
-		case T_ICLE:
-			errcode = parse_single_stmt(parser, node, I_ICLE);
-			break;
-		case T_ICEQ:
-			errcode = parse_single_stmt(parser, node, I_ICEQ);
-			break;
-		case T_ICGT:
-			errcode = parse_single_stmt(parser, node, I_ICGT);
-			break;
-		case T_ICGE:
-			errcode = parse_single_stmt(parser, node, I_ICGE);
-			break;
-
-		case T_ULCLT:
-			errcode = parse_single_stmt(parser, node, I_ULCLT);
-			break;
-		case T_ULCLE:
-			errcode = parse_single_stmt(parser, node, I_ULCLE);
-			break;
-		case T_ULCEQ:
-			errcode = parse_single_stmt(parser, node, I_ULCEQ);
-			break;
-		case T_ULCGT:
-			errcode = parse_single_stmt(parser, node, I_ULCGT);
-			break;
-		case T_ULCGE:
-			errcode = parse_single_stmt(parser, node, I_ULCGE);
-			break;
-
-		case T_FCLT:
-			errcode = parse_single_stmt(parser, node, I_FCLT);
-			break;
-		case T_FCLE:
-			errcode = parse_single_stmt(parser, node, I_FCLE);
-			break;
-		case T_FCEQ:
-			errcode = parse_single_stmt(parser, node, I_FCEQ);
-			break;
-		case T_FCGT:
-			errcode = parse_single_stmt(parser, node, I_FCGT);
-			break;
-		case T_FCGE:
-			errcode = parse_single_stmt(parser, node, I_FCGE);
-			break;
-
-		case T_CCLT:
-			errcode = parse_single_stmt(parser, node, I_CCLT);
-			break;
-		case T_CCLE:
-			errcode = parse_single_stmt(parser, node, I_CCLE);
-			break;
-		case T_CCEQ:
-			errcode = parse_single_stmt(parser, node, I_CCEQ);
-			break;
-		case T_CCGT:
-			errcode = parse_single_stmt(parser, node, I_CCGT);
-			break;
-		case T_CCGE:
-			errcode = parse_single_stmt(parser, node, I_CCGE);
+	case PARSE_TEXT: {
+		const InstructionInfo *info = token_instructions[token.kind];
+		if (info) {
+			union InstructionData imm = {0};
+			errcode = parse_instruction(parser, node, &imm, info);
+			if (errcode == 0) {
+				node->kind = N_INSTRUCTION;
+				program_push(parser->program, info->kind, imm, node->span.start_row);
+			}
 			break;
+		}
 
+		switch (token.kind) {
 		case T_LABEL:
 			errcode = parse_label(parser, &token, node);
 			break;
 
-		case T_DUPE8:
-			errcode = parse_single_stmt(parser, node, I_DUPE8);
-			break;
-		case T_DUPE32:
-			errcode = parse_single_stmt(parser, node, I_DUPE32);
-			break;
-		case T_DUPE64:
-			errcode = parse_single_stmt(parser, node, I_DUPE64);
-			break;
-
-		case T_SWAP8:
-			errcode = parse_single_stmt(parser, node, I_SWAP8);
-			break;
-		case T_SWAP32:
-			errcode = parse_single_stmt(parser, node, I_SWAP32);
-			break;
-		case T_SWAP64:
-			errcode = parse_single_stmt(parser, node, I_SWAP64);
-			break;
-
-		case T_COPY8:
-			errcode = parse_idx(parser, node, I_COPY8);
-			break;
-		case T_COPY32:
-			errcode = parse_idx(parser, node, I_COPY32);
-			break;
-		case T_COPY64:
-			errcode = parse_idx(parser, node, I_COPY64);
-			break;
-
-		case T_STORE8:
-			errcode = parse_idx(parser, node, I_STORE8);
-			break;
-		case T_STORE32:
-			errcode = parse_idx(parser, node, I_STORE32);
-			break;
-		case T_STORE64:
-			errcode = parse_idx(parser, node, I_STORE64);
-			break;
-
-		case T_LOAD8:
-			errcode = parse_idx(parser, node, I_LOAD8);
-			break;
-		case T_LOAD32:
-			errcode = parse_idx(parser, node, I_LOAD32);
-			break;
-		case T_LOAD64:
-			errcode = parse_idx(parser, node, I_LOAD64);
-			break;
-
-		case T_RET8:
-			errcode = parse_single_stmt(parser, node, I_RET8);
-			break;
-		case T_RET32:
-			errcode = parse_single_stmt(parser, node, I_RET32);
-			break;
-		case T_RET64:
-			errcode = parse_single_stmt(parser, node, I_RET64);
-			break;
-
-		case T_RET:
-			errcode = parse_idx(parser, node, I_RET);
-			break;
-
 		case T_EOF:
 			node->kind = N_EOF;
 			break;
@@ -661,10 +592,11 @@ tailcall:
 		}
 		break;
 	}
+	}
 
 	if (errcode < 0) {
 		parser->span = node->span;
-		return NULL;
+		return false;
 	}
 
 #ifdef DEBUG
@@ -677,5 +609,5 @@ tailcall:
 	}
 #endif
 
-	return node;
+	return true;
 }
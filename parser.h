@@ -10,12 +10,14 @@ enum NodeKind {
 	N_INSTRUCTION,
 	N_LABEL,
 	N_DECLARATION,
+	N_SECTION,
+	N_STACK,
 
 	N_EOF,
 };
 
 enum InstructionKind {
-#define INSTR(x, _) I_##x,
+#define INSTR(x, ...) I_##x,
 #include "instructions.h"
 #undef INSTR
 };
@@ -34,6 +36,32 @@ enum LitKind {
 	L_PTR = 8,
 };
 
+enum OperandShape {
+	OPERAND_NONE,
+	OPERAND_LIT,   /* ipush 1 */
+	OPERAND_IDX,   /* load32 0 */
+	OPERAND_LABEL, /* jump label */
+	OPERAND_PROC,  /* jumpproc label argc */
+	OPERAND_ORDER, /* aload64 acquire, seq_cst when left out */
+};
+
+/* Memory orders of the atomic ops, the instruction table lists the ones each allows */
+enum MemoryOrder {
+	ORDER_RELAXED = 1,
+	ORDER_ACQUIRE = 2,
+	ORDER_RELEASE = 4,
+	ORDER_ACQ_REL = 8,
+	ORDER_SEQ_CST = 16,
+};
+
+#define ORDER_LOAD (ORDER_RELAXED | ORDER_ACQUIRE | ORDER_SEQ_CST)
+#define ORDER_STORE (ORDER_RELAXED | ORDER_RELEASE | ORDER_SEQ_CST)
+#define ORDER_FENCE (ORDER_ACQUIRE | ORDER_RELEASE | ORDER_ACQ_REL | ORDER_SEQ_CST)
+#define ORDER_RMW (ORDER_RELAXED | ORDER_FENCE)
+
+/* Stack effect that depends on the instruction's operand */
+#define EFFECT_VAR -1
+
 enum ParserState {
 	PARSE_DATA,
 	PARSE_TEXT,
@@ -44,7 +72,6 @@ typedef union Data LitData;
 typedef struct Lit {
 	enum LitKind kind;
 	LitData data;
-	Span span;
 } Lit;
 
 union ProcLocation {
@@ -55,14 +82,22 @@ union ProcLocation {
 typedef struct Proc {
 	union ProcLocation location;
 	size_t argc;
-	Span span;
 } Proc;
 
 typedef struct Declaration {
 	enum DeclarationKind kind;
 	const char *ident;
-	void *bytes;
+	/* Initial contents in the parse arena, NULL when zero-filled */
+	const void *init;
+	/* Mapped from this file instead, `shared` writes go back to it */
+	const char *path;
+	bool shared;
+	/* An extern taking a variable argument list, like printf */
+	bool variadic;
 	size_t len;
+	size_t align;
+	/* Where it ended up in the data segment, NULL until placed */
+	void *bytes;
 	Span span;
 } Declaration;
 
@@ -81,15 +116,50 @@ union InstructionData {
 	Proc proc;
 };
 
-typedef struct Instruction {
+typedef struct InstructionInfo {
 	enum InstructionKind kind;
-	union InstructionData data;
-} Instruction;
+	const char *name;
+	enum OperandShape shape;
+	/* Literal kinds for OPERAND_LIT, memory orders for OPERAND_ORDER */
+	int lit_kind_mask;
+	int pop;
+	int push;
+} InstructionInfo;
+
+/* Initial stack sizes in bytes, 0 keeps the default */
+typedef struct StackSizes {
+	size_t operand;
+	size_t ret;
+} StackSizes;
+
+/* Per-opcode metadata generated from instructions.h, indexed by `InstructionKind` */
+extern const InstructionInfo instruction_info[];
+
+/*
+ * Instructions as parallel arrays, `ops[i]` runs with operand `imms[i]`.
+ * The parser appends straight into it, labels and declarations go in the
+ * tables next to them.
+ */
+typedef struct Program {
+	uint8_t *ops;
+	union InstructionData *imms;
+	/* Source row of each instruction, only read for diagnostics */
+	size_t *rows;
+	size_t len;
+	size_t cap;
 
+	LabelMap label_map;
+	DeclarationMap declaration_map;
+	/* Largest `.stack` directive */
+	StackSizes stack;
+} Program;
+
+/* Statements are returned by value, instructions end up in `Program` */
 union NodeData {
 	const char *s;
-	Instruction instruction;
+	enum ParserState section;
 	Declaration declaration;
+	StackSizes stack;
 };
 
 typedef struct Node {
@@ -101,13 +171,20 @@ typedef struct Node {
 typedef struct Parser {
 	Lexer lexer;
 	Arena *arena;
+	Program *program;
 	char *error;
 	Span span;
 	enum ParserState state;
 } Parser;
 
-void parser_init(Parser *parser, Arena *arena, FILE *file, size_t len);
+void program_push(Program *program, enum InstructionKind kind, union InstructionData imm, size_t row);
+
+/* Reads `len` bytes of `file` from `offset` with pread, or in order when `offset` is -1 */
+void parser_init(Parser *parser, Arena *arena, Program *program, FILE *file, off_t offset, size_t len);
+
+void parser_destroy(Parser *parser);
 
-Node *parser_next(Parser *parser);
+/* Fills `node`, appending to the parser's program for N_INSTRUCTION. False on a parse error */
+bool parser_next(Parser *parser, Node *node);
 
 #endif /* PARSER_H */
@@ -0,0 +1,129 @@
+#define _XOPEN_SOURCE 700
+#define _XOPEN_SOURCE_EXTENDED
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "lexer.h"
+#include "ffi.h"
+
+/* The context comes first, natives get it back as the Piss */
+struct Piss {
+	Ctx context;
+	Arena *arena;
+	char *path;
+};
+
+static Piss *piss_parse(const char *path, FILE *f, size_t len)
+{
+	Piss *piss = xmalloc(sizeof(*piss));
+	piss->path = xmalloc(strlen(path) + 1);
+	strcpy(piss->path, path);
+	piss->arena = arena_create(1024 * 32);
+	context_init(&piss->context, piss->path);
+	if (vm_commit_stacks(&piss->context.vm, (StackSizes){0}) || parse_src(&piss->context, piss->arena, piss->path, f, len)) {
+		piss_free(piss);
+		return NULL;
+	}
+	return piss;
+}
+
+Piss *piss_load(const char *path)
+{
+	struct stat sb;
+	FILE *f = fopen(path, "rb");
+	if (!f || fstat(fileno(f), &sb) < 0) {
+		fprintf(stderr, "%s: cannot open\n", path);
+		if (f) fclose(f);
+		return NULL;
+	}
+	Piss *piss = piss_parse(path, f, S_ISREG(sb.st_mode) ? (size_t) sb.st_size : LEXER_UNBOUNDED);
+	fclose(f);
+	return piss;
+}
+
+Piss *piss_load_buffer(const char *name, const char *src, size_t len)
+{
+	FILE *f = len ? fmemopen((void *) src, len, "rb") : NULL;
+	if (!f) {
+		fprintf(stderr, "%s: cannot open\n", name);
+		return NULL;
+	}
+	Piss *piss = piss_parse(name, f, len);
+	fclose(f);
+	return piss;
+}
+
+void piss_free(Piss *piss)
+{
+	if (!piss) return;
+	context_destroy(&piss->context);
+	arena_destroy(piss->arena);
+	free(piss->path);
+	free(piss);
+}
+
+PissProc piss_lookup(Piss *piss, const char *label)
+{
+	Label *found = label_map_find(&piss->context.program.label_map, label);
+	return found && found->location != LABEL_UNDEFINED ? (PissProc) found->location : PISS_NO_PROC;
+}
+
+int piss_register(Piss *piss, const char *name, PissNative fn, void *user)
+{
+	Ctx *context = &piss->context;
+	for (size_t i = 0; i < context->extern_len; ++i) {
+		Extern *ext = &context->externs[i];
+		if (strcmp(ext->name, name) != 0) continue;
+		ext->fn = fn;
+		ext->user = user;
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Enter `proc` like jumpproc would with the return address past the end
+ * of the program, so the run stops when it returns. A native may call in
+ * again, the outer call's pc is put back afterwards.
+ */
+int piss_call(Piss *piss, PissProc proc, const void *args, size_t argc, void *ret, size_t ret_len)
+{
+	Ctx *context = &piss->context;
+	Vm *vm = &context->vm;
+	Program *program = &context->program;
+	if (proc < 0 || (size_t) proc >= program->len || argc > LOCAL_SIZE) {
+		fprintf(stderr, "%s: Bad call of procedure %ld with %zu argument bytes\n", context->path, proc, argc);
+		return -1;
+	}
+	if (vm->scheduler) {
+		fprintf(stderr, "%s: Can't call in while green threads run\n", context->path);
+		return -1;
+	}
+
+	FramePointer *caller = vm->frame_ptr;
+	byte *base = caller->ptr;
+	size_t pc = vm->pc;
+	vm_call_proc(vm, program, proc, args, argc);
+
+	int errcode = 0;
+	if (vm->frame_ptr != caller) {
+		fprintf(stderr, "%s: Procedure %ld ended without ret\n", context->path, proc);
+		while (vm->frame_ptr != caller) {
+			FramePointer *p = vm->frame_ptr;
+			vm->frame_ptr = p->prev;
+			free(p);
+		}
+		errcode = -1;
+	} else if (caller->ptr < base || (size_t) (caller->ptr - base) < ret_len) {
+		fprintf(stderr, "%s: Procedure %ld returned fewer than %zu bytes\n", context->path, proc, ret_len);
+		errcode = -1;
+	} else {
+		memcpy(ret, caller->ptr - ret_len, ret_len);
+	}
+	caller->ptr = base;
+	vm->pc = pc;
+	return errcode;
+}
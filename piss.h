@@ -0,0 +1,71 @@
+#ifndef PISS_H
+#define PISS_H
+
+/*
+ * Embedding API, built into libpiss by ./x. A host loads a program once
+ * and then calls its procedures like functions:
+ *
+ *	Piss *piss = piss_load("lib.pissm");
+ *	PissProc add = piss_lookup(piss, "add");
+ *	int args[2] = {1, 2}, sum;
+ *	piss_call(piss, add, args, sizeof(args), &sum, sizeof(sum));
+ *
+ * Arguments become the procedure's first locals, like with jumpproc, and
+ * the bytes its ret pushes come back in the return buffer. Diagnostics go
+ * to stderr. Runtime errors still abort the process like they do in ass.
+ * A Piss is not thread safe, use one per thread.
+ */
+
+#include <stddef.h>
+
+#if defined(__GNUC__)
+#define PISS_API __attribute__((visibility("default")))
+#else
+#define PISS_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Piss Piss;
+
+/* Instruction a procedure starts at, PISS_NO_PROC when there is no such label */
+typedef long PissProc;
+#define PISS_NO_PROC (-1L)
+
+/* Most bytes a native procedure can return */
+#define PISS_RET_MAX 256
+
+/*
+ * A host procedure the program calls with jumpproc on an extern of the
+ * same name. It gets the `argc` argument bytes the program passed and
+ * writes its result to `ret`, returning how many bytes of it to push.
+ * It may call back into `piss`.
+ */
+typedef size_t (*PissNative)(Piss *piss, void *user, const void *args, size_t argc, void *ret);
+
+/* Parse and load a program, NULL on errors */
+PISS_API Piss *piss_load(const char *path);
+
+/* Same from memory, `name` shows up in diagnostics */
+PISS_API Piss *piss_load_buffer(const char *name, const char *src, size_t len);
+
+PISS_API void piss_free(Piss *piss);
+
+PISS_API PissProc piss_lookup(Piss *piss, const char *label);
+
+/* Have jumpproc on the program's `name extern` call `fn`. -1 when the program never calls it */
+PISS_API int piss_register(Piss *piss, const char *name, PissNative fn, void *user);
+
+/*
+ * Call `proc` with `argc` bytes of `args` and copy the last `ret_len`
+ * bytes it returned to `ret`. -1 when the call doesn't return that many.
+ */
+PISS_API int piss_call(Piss *piss, PissProc proc, const void *args, size_t argc, void *ret, size_t ret_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PISS_H */
@@ -0,0 +1,461 @@
+#define _XOPEN_SOURCE 700
+#define _XOPEN_SOURCE_EXTENDED
+
+#include <string.h>
+
+#include "scheduler.h"
+
+void fiber_save(Vm *vm)
+{
+	Fiber *fiber = vm->fiber;
+	fiber->stack = vm->stack;
+	fiber->return_stack = vm->return_stack;
+	fiber->frame_ptr = vm->frame_ptr;
+	fiber->pc = vm->pc;
+}
+
+static void fiber_load(Vm *vm, Fiber *fiber)
+{
+	vm->fiber = fiber;
+	vm->stack = fiber->stack;
+	vm->return_stack = fiber->return_stack;
+	vm->frame_ptr = fiber->frame_ptr;
+	vm->pc = fiber->pc;
+}
+
+/* Only called by the owner, false when the queue is full */
+static bool run_queue_push(RunQueue *queue, Fiber *fiber)
+{
+	uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	uint32_t tail = queue->tail;
+	if (tail - head >= RUN_QUEUE_SIZE) return false;
+	__atomic_store_n(&queue->slots[tail % RUN_QUEUE_SIZE], fiber, __ATOMIC_RELAXED);
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static Fiber *run_queue_pop(RunQueue *queue)
+{
+	uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	for (;;) {
+		uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+		if (head == tail) return NULL;
+		Fiber *fiber = __atomic_load_n(&queue->slots[head % RUN_QUEUE_SIZE], __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&queue->head, &head, head + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			return fiber;
+		}
+	}
+}
+
+/*
+ * Move the older half of `victim` into `queue`, which belongs to the
+ * caller and is empty, and return the newest of them to run right away.
+ */
+static Fiber *run_queue_steal(RunQueue *queue, RunQueue *victim)
+{
+	uint32_t tail = queue->tail;
+	for (;;) {
+		uint32_t head = __atomic_load_n(&victim->head, __ATOMIC_ACQUIRE);
+		uint32_t victim_tail = __atomic_load_n(&victim->tail, __ATOMIC_ACQUIRE);
+		uint32_t n = victim_tail - head;
+		n -= n / 2;
+		if (n == 0) return NULL;
+		/* Read `head` and `tail` far apart, they don't describe one queue */
+		if (n > RUN_QUEUE_SIZE / 2) continue;
+		for (uint32_t i = 0; i < n; ++i) {
+			Fiber *fiber = __atomic_load_n(&victim->slots[(head + i) % RUN_QUEUE_SIZE], __ATOMIC_RELAXED);
+			__atomic_store_n(&queue->slots[(tail + i) % RUN_QUEUE_SIZE], fiber, __ATOMIC_RELAXED);
+		}
+		if (__atomic_compare_exchange_n(&victim->head, &head, head + n, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			Fiber *fiber = queue->slots[(tail + n - 1) % RUN_QUEUE_SIZE];
+			if (n > 1) __atomic_store_n(&queue->tail, tail + n - 1, __ATOMIC_RELEASE);
+			return fiber;
+		}
+	}
+}
+
+/* Called with `lock` held */
+static Fiber *scheduler_pop_global(Scheduler *scheduler)
+{
+	Fiber *fiber = scheduler->global_head;
+	if (!fiber) return NULL;
+	scheduler->global_head = fiber->next;
+	if (!scheduler->global_head) scheduler->global_tail = NULL;
+	__atomic_store_n(&scheduler->global_len, scheduler->global_len - 1, __ATOMIC_RELAXED);
+	return fiber;
+}
+
+void scheduler_ready(Vm *vm, Fiber *fiber)
+{
+	Scheduler *scheduler = vm->scheduler;
+	if (!run_queue_push(&scheduler->queues[vm->worker], fiber)) {
+		pthread_mutex_lock(&scheduler->lock);
+		fiber->next = NULL;
+		if (scheduler->global_tail) scheduler->global_tail->next = fiber;
+		else scheduler->global_head = fiber;
+		scheduler->global_tail = fiber;
+		__atomic_store_n(&scheduler->global_len, scheduler->global_len + 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&scheduler->lock);
+	}
+	/* Pairs with the fence in `scheduler_next`, either it sees the fiber or we see it parking */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&scheduler->idle, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&scheduler->lock);
+		pthread_cond_signal(&scheduler->cond);
+		pthread_mutex_unlock(&scheduler->lock);
+	}
+}
+
+/* The worker's own queue, then everyone else's */
+static Fiber *scheduler_steal(Vm *vm)
+{
+	Scheduler *scheduler = vm->scheduler;
+	RunQueue *queue = &scheduler->queues[vm->worker];
+	Fiber *fiber = run_queue_pop(queue);
+	for (size_t i = 1; !fiber && i < scheduler->worker_len; ++i) {
+		fiber = run_queue_steal(queue, &scheduler->queues[(vm->worker + i) % scheduler->worker_len]);
+	}
+	return fiber;
+}
+
+/* A runnable thread for this worker without waiting, NULL when there is none */
+static Fiber *scheduler_find(Vm *vm)
+{
+	Scheduler *scheduler = vm->scheduler;
+	Fiber *fiber = NULL;
+	/* Now and then the global queue goes first so nothing starves in it */
+	bool global = ++vm->tick % RUN_QUEUE_GLOBAL_TICK == 0;
+	if (!global) fiber = scheduler_steal(vm);
+	if (!fiber && __atomic_load_n(&scheduler->global_len, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&scheduler->lock);
+		fiber = scheduler_pop_global(scheduler);
+		pthread_mutex_unlock(&scheduler->lock);
+	}
+	if (!fiber && global) fiber = scheduler_steal(vm);
+	return fiber;
+}
+
+/* Wait for a runnable thread, NULL once every thread has finished */
+static Fiber *scheduler_next(Vm *vm)
+{
+	Scheduler *scheduler = vm->scheduler;
+	Fiber *fiber = scheduler_find(vm);
+	if (fiber) return fiber;
+
+	pthread_mutex_lock(&scheduler->lock);
+	__atomic_add_fetch(&scheduler->idle, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (;;) {
+		fiber = scheduler_pop_global(scheduler);
+		if (!fiber) fiber = scheduler_steal(vm);
+		if (fiber || __atomic_load_n(&scheduler->live, __ATOMIC_SEQ_CST) == 0) break;
+		if (scheduler->idle == scheduler->worker_len) {
+			fprintf(stderr, "%s:Every green thread is waiting on another\n", vm->context->path);
+			abort();
+		}
+		pthread_cond_wait(&scheduler->cond, &scheduler->lock);
+	}
+	__atomic_sub_fetch(&scheduler->idle, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&scheduler->lock);
+	return fiber;
+}
+
+void scheduler_switch(Vm *vm)
+{
+	Fiber *next = scheduler_next(vm);
+	if (next) {
+		fiber_load(vm, next);
+	} else {
+		vm->fiber = NULL;
+		vm->pc = FIBER_EXIT;
+	}
+}
+
+static void *scheduler_worker(void *arg)
+{
+	Vm *vm = arg;
+	Fiber *fiber = scheduler_next(vm);
+	if (fiber) {
+		fiber_load(vm, fiber);
+		vm_run(vm, &vm->context->program);
+	}
+	return NULL;
+}
+
+void scheduler_start(Vm *vm)
+{
+	Scheduler *scheduler = xmalloc(sizeof(*scheduler));
+	*scheduler = (Scheduler){0};
+	size_t worker_len = vm->context->workers ? vm->context->workers : 1;
+	scheduler->worker_len = worker_len;
+	scheduler->queues = xmalloc(sizeof(*scheduler->queues) * worker_len);
+	memset(scheduler->queues, 0, sizeof(*scheduler->queues) * worker_len);
+	scheduler->workers = xmalloc(sizeof(*scheduler->workers) * worker_len);
+	scheduler->threads = xmalloc(sizeof(*scheduler->threads) * worker_len);
+	scheduler->caches = xmalloc(sizeof(*scheduler->caches) * worker_len);
+	memset(scheduler->caches, 0, sizeof(*scheduler->caches) * worker_len);
+	pthread_mutex_init(&scheduler->lock, NULL);
+	pthread_cond_init(&scheduler->cond, NULL);
+	pthread_mutex_init(&scheduler->heap_lock, NULL);
+
+	Fiber *fiber = xmalloc(sizeof(*fiber));
+	*fiber = (Fiber){0};
+	scheduler->fibers = xmalloc(sizeof(*scheduler->fibers) * 16);
+	scheduler->fiber_cap = 16;
+	scheduler->fibers[scheduler->fiber_len++] = fiber;
+	scheduler->first = fiber;
+	scheduler->live = 1;
+	vm->scheduler = scheduler;
+	vm->fiber = fiber;
+	vm->worker = 0;
+	vm->tick = 0;
+	scheduler->workers[0] = vm;
+
+	for (size_t i = 1; i < worker_len; ++i) {
+		Vm *worker = xmalloc(sizeof(*worker));
+		*worker = (Vm){0};
+		worker->bss = vm->bss;
+		worker->bss_origin = vm->bss_origin;
+		worker->guarded = vm->guarded;
+		worker->home = vm;
+		worker->scheduler = scheduler;
+		worker->worker = i;
+		worker->context = vm->context;
+		scheduler->workers[i] = worker;
+		if (pthread_create(&scheduler->threads[i], NULL, scheduler_worker, worker)) {
+			panic("Failed to spawn scheduler worker\n");
+		}
+	}
+}
+
+/* A thread that hasn't started yet, with stacks from a finished one when there is one */
+static Fiber *scheduler_new_fiber(Scheduler *scheduler, uint64_t *handle)
+{
+	Fiber *fiber = xmalloc(sizeof(*fiber));
+	*fiber = (Fiber){0};
+	pthread_mutex_lock(&scheduler->lock);
+	if (scheduler->pool_len) {
+		Fiber *done = scheduler->pool[--scheduler->pool_len];
+		fiber->stack = done->stack;
+		fiber->return_stack = done->return_stack;
+		done->stack = (Stack){0};
+		done->return_stack = (Stack){0};
+	}
+	if (scheduler->fiber_len >= scheduler->fiber_cap) {
+		scheduler->fiber_cap *= 2;
+		scheduler->fibers = xrealloc(scheduler->fibers, sizeof(*scheduler->fibers) * scheduler->fiber_cap);
+	}
+	scheduler->fibers[scheduler->fiber_len++] = fiber;
+	*handle = scheduler->fiber_len;
+	pthread_mutex_unlock(&scheduler->lock);
+
+	if (!fiber->stack.base) {
+		stack_init(&fiber->stack, STACK_SIZE, FIBER_STACK_RESERVE);
+		stack_init(&fiber->return_stack, STACK_SIZE, FIBER_RETURN_STACK_RESERVE);
+	}
+	__atomic_add_fetch(&scheduler->live, 1, __ATOMIC_SEQ_CST);
+	return fiber;
+}
+
+/* Point the thread at the procedure at `pc`, its `ret` ends the thread */
+static void fiber_call(Fiber *fiber, size_t pc, const void *args, size_t argc)
+{
+	FramePointer *base = xmalloc(sizeof(*base));
+	base->ptr = fiber->stack.base;
+	base->start = fiber->stack.base;
+	base->return_stack_ptr = fiber->return_stack.base;
+	base->locals = base->local_storage;
+	base->prev = NULL;
+
+	/* As if `base` had called it */
+	FramePointer *frame = xmalloc(sizeof(*frame));
+	*(size_t *)fiber->return_stack.base = FIBER_EXIT;
+	frame->ptr = fiber->stack.base;
+	frame->start = fiber->stack.base;
+	frame->return_stack_ptr = fiber->return_stack.base + sizeof(size_t);
+	frame->locals = frame->local_storage;
+	memcpy(frame->locals, args, argc);
+	frame->prev = base;
+	fiber->frame_ptr = frame;
+	fiber->pc = pc;
+}
+
+static void fiber_free_frames(Fiber *fiber)
+{
+	while (fiber->frame_ptr) {
+		FramePointer *p = fiber->frame_ptr;
+		fiber->frame_ptr = p->prev;
+		free(p);
+	}
+}
+
+uint64_t scheduler_spawn(Vm *vm, size_t pc, byte *args, size_t argc)
+{
+	uint64_t handle;
+	Fiber *fiber = scheduler_new_fiber(vm->scheduler, &handle);
+	fiber_call(fiber, pc, args, argc);
+	scheduler_ready(vm, fiber);
+	return handle;
+}
+
+/* Point a parfor runner at the chunk starting at `lo` */
+static void parfor_call(Fiber *fiber, uint64_t lo)
+{
+	ParFor *group = fiber->parfor;
+	uint64_t range[2] = { lo, group->end - lo > group->grain ? lo + group->grain : group->end };
+	fiber_call(fiber, group->pc, range, sizeof(range));
+}
+
+/* Move a parfor runner on to the next chunk, false once they are all taken */
+static bool parfor_next(Fiber *fiber)
+{
+	ParFor *group = fiber->parfor;
+	uint64_t lo = __atomic_fetch_add(&group->next, group->grain, __ATOMIC_RELAXED);
+	if (lo >= group->end) return false;
+	fiber_free_frames(fiber);
+	parfor_call(fiber, lo);
+	return true;
+}
+
+void scheduler_parfor(Vm *vm, size_t pc, uint64_t start, uint64_t end, uint64_t grain)
+{
+	Scheduler *scheduler = vm->scheduler;
+	if (start >= end) return;
+	if (!grain) grain = (end - start) / (scheduler->worker_len * PARFOR_CHUNKS_PER_WORKER);
+	if (!grain) grain = 1;
+	uint64_t chunks = (end - start - 1) / grain + 1;
+	size_t runners = chunks < scheduler->worker_len ? chunks : scheduler->worker_len;
+
+	Fiber *fiber = vm->fiber;
+	ParFor *group = &fiber->group;
+	/* Each runner starts on its own chunk, the rest go to whoever asks first */
+	*group = (ParFor){ .pc = pc, .next = start + runners * grain, .end = end, .grain = grain, .parent = fiber };
+	/* The parent holds one until it has started every runner */
+	group->pending = runners + 1;
+	fiber_save(vm);
+	for (size_t i = 0; i < runners; ++i) {
+		uint64_t handle;
+		Fiber *runner = scheduler_new_fiber(scheduler, &handle);
+		runner->parfor = group;
+		parfor_call(runner, start + i * grain);
+		scheduler_ready(vm, runner);
+	}
+	/* Every chunk already ran, the registers are still this thread's */
+	if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL) == 0) return;
+	scheduler_switch(vm);
+}
+
+void scheduler_yield(Vm *vm)
+{
+	Fiber *next = scheduler_find(vm);
+	if (!next) return;
+	Fiber *fiber = vm->fiber;
+	fiber_save(vm);
+	scheduler_ready(vm, fiber);
+	fiber_load(vm, next);
+}
+
+void scheduler_join(Vm *vm, uint64_t handle)
+{
+	Scheduler *scheduler = vm->scheduler;
+	if (!scheduler) {
+		fprintf(stderr, "Invalid green thread handle %" PRIu64 "\n", handle);
+		print_frames(vm);
+		abort();
+	}
+	pthread_mutex_lock(&scheduler->lock);
+	if (handle == 0 || handle > scheduler->fiber_len || scheduler->fibers[handle - 1] == vm->fiber) {
+		fprintf(stderr, "Invalid green thread handle %" PRIu64 "\n", handle);
+		print_frames(vm);
+		abort();
+	}
+	Fiber *target = scheduler->fibers[handle - 1];
+	if (target->done) {
+		pthread_mutex_unlock(&scheduler->lock);
+		return;
+	}
+	/* Saved before anyone can see it, the thread that wakes it may run it at once */
+	Fiber *fiber = vm->fiber;
+	fiber_save(vm);
+	fiber->next = target->joiners;
+	target->joiners = fiber;
+	pthread_mutex_unlock(&scheduler->lock);
+	scheduler_switch(vm);
+}
+
+bool scheduler_exit(Vm *vm)
+{
+	Scheduler *scheduler = vm->scheduler;
+	Fiber *fiber = vm->fiber;
+	/* Left by `scheduler_switch` with nothing to run */
+	if (!fiber) return false;
+	fiber_save(vm);
+	if (fiber->parfor && parfor_next(fiber)) {
+		fiber_load(vm, fiber);
+		return true;
+	}
+	/* The first thread's stacks and frames are the vm's own */
+	if (fiber != scheduler->first) fiber_free_frames(fiber);
+
+	pthread_mutex_lock(&scheduler->lock);
+	fiber->done = true;
+	Fiber *joiners = fiber->joiners;
+	fiber->joiners = NULL;
+	if (fiber != scheduler->first) {
+		if (scheduler->pool_len >= scheduler->pool_cap) {
+			scheduler->pool_cap = scheduler->pool_cap ? scheduler->pool_cap * 2 : 16;
+			scheduler->pool = xrealloc(scheduler->pool, sizeof(*scheduler->pool) * scheduler->pool_cap);
+		}
+		scheduler->pool[scheduler->pool_len++] = fiber;
+	}
+	pthread_mutex_unlock(&scheduler->lock);
+
+	for (Fiber *next; joiners; joiners = next) {
+		next = joiners->next;
+		scheduler_ready(vm, joiners);
+	}
+	if (fiber->parfor && __atomic_sub_fetch(&fiber->parfor->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		scheduler_ready(vm, fiber->parfor->parent);
+	}
+	if (__atomic_sub_fetch(&scheduler->live, 1, __ATOMIC_SEQ_CST) == 0) {
+		pthread_mutex_lock(&scheduler->lock);
+		pthread_cond_broadcast(&scheduler->cond);
+		pthread_mutex_unlock(&scheduler->lock);
+	}
+
+	Fiber *next = scheduler_next(vm);
+	if (!next) return false;
+	fiber_load(vm, next);
+	return true;
+}
+
+void scheduler_destroy(Vm *vm)
+{
+	Scheduler *scheduler = vm->scheduler;
+	for (size_t i = 1; i < scheduler->worker_len; ++i) {
+		pthread_join(scheduler->threads[i], NULL);
+		free(scheduler->workers[i]);
+	}
+	for (size_t i = 0; i < scheduler->worker_len; ++i) heap_cache_drain(&vm->heap, &scheduler->caches[i]);
+	fiber_load(vm, scheduler->fibers[0]);
+	for (size_t i = 0; i < scheduler->fiber_len; ++i) {
+		Fiber *fiber = scheduler->fibers[i];
+		if (i > 0 && fiber->stack.base) {
+			stack_destroy(&fiber->stack);
+			stack_destroy(&fiber->return_stack);
+		}
+		free(fiber);
+	}
+	free(scheduler->fibers);
+	free(scheduler->pool);
+	free(scheduler->workers);
+	free(scheduler->queues);
+	free(scheduler->threads);
+	free(scheduler->caches);
+	pthread_mutex_destroy(&scheduler->lock);
+	pthread_cond_destroy(&scheduler->cond);
+	pthread_mutex_destroy(&scheduler->heap_lock);
+	free(scheduler);
+	vm->scheduler = NULL;
+	vm->fiber = NULL;
+}
@@ -0,0 +1,151 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "vm.h"
+
+/* A parfor in flight, owned by the thread waiting for it */
+typedef struct ParFor {
+	/* The procedure, called with the bounds of a chunk as two 8 byte locals */
+	size_t pc;
+	/* Start of the next chunk nobody took yet */
+	uint64_t next;
+	uint64_t end;
+	uint64_t grain;
+	struct Fiber *parent;
+	/* Runners still going */
+	size_t pending;
+} ParFor;
+
+/* Chunks per worker when parfor is given no grain, so uneven chunks even out */
+#define PARFOR_CHUNKS_PER_WORKER 8
+
+/*
+ * A green thread. While it runs its stacks, frames and pc are loaded into
+ * the vm, switching threads only swaps these.
+ */
+typedef struct Fiber {
+	Stack stack;
+	Stack return_stack;
+	FramePointer *frame_ptr;
+	size_t pc;
+
+	bool done;
+	/* The parfor this thread runs chunks of */
+	struct ParFor *parfor;
+	/* The parfor this thread waits for */
+	ParFor group;
+	/* Threads waiting in `join` for this one, chained through `next` */
+	struct Fiber *joiners;
+	/* In a join list or the global run queue */
+	struct Fiber *next;
+} Fiber;
+
+/* Green threads get smaller stacks, so a program can keep many of them */
+#define FIBER_STACK_RESERVE ((size_t) 1 << 26)
+#define FIBER_RETURN_STACK_RESERVE ((size_t) 1 << 16)
+/* Return address of a green thread's procedure */
+#define FIBER_EXIT SIZE_MAX
+#define RUN_QUEUE_SIZE 256
+/* A worker looks at the global run queue first every this many switches */
+#define RUN_QUEUE_GLOBAL_TICK 61
+
+/*
+ * Runnable threads of one worker, oldest first. Only the owner appends,
+ * anyone takes from the front by advancing `head` with a compare and
+ * swap, so neither side ever locks.
+ */
+typedef struct RunQueue {
+	uint32_t head;
+	uint32_t tail;
+	Fiber *slots[RUN_QUEUE_SIZE];
+} RunQueue;
+
+/*
+ * Multiplexes the green threads of one run over `worker_len` threads. The
+ * vm that ran the first `spawn` is worker 0 and the others get vms of
+ * their own that share its heap and maps. A worker runs its own queue,
+ * then the global one, then steals half of another worker's and only
+ * parks when all of them are empty.
+ */
+typedef struct Scheduler {
+	/* Handle `i + 1` names `fibers[i]`, thread 0 is the one that spawned first */
+	Fiber **fibers;
+	size_t fiber_len;
+	size_t fiber_cap;
+	/* `fibers[0]`, which can be read without `lock` */
+	Fiber *first;
+	/* Stacks of finished threads, for the next spawn */
+	Fiber **pool;
+	size_t pool_len;
+	size_t pool_cap;
+
+	struct Vm **workers;
+	RunQueue *queues;
+	pthread_t *threads;
+	size_t worker_len;
+
+	/* Overflow of the run queues */
+	Fiber *global_head;
+	Fiber *global_tail;
+	size_t global_len;
+
+	/* Threads not finished yet */
+	size_t live;
+	/* Parked workers */
+	size_t idle;
+	/* Guards the fields above that have no atomic access, parking and joins */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* One per worker, so alloc and free mostly leave `heap_lock` alone */
+	HeapCache *caches;
+	/* Taken around the shared heap, maps and streams with more than one worker */
+	pthread_mutex_t heap_lock;
+} Scheduler;
+
+/* The heap, maps and streams are shared by the workers of a scheduler */
+static inline void vm_lock_heap(Vm *vm)
+{
+	if (vm->scheduler && vm->scheduler->worker_len > 1) pthread_mutex_lock(&vm->scheduler->heap_lock);
+}
+
+static inline void vm_unlock_heap(Vm *vm)
+{
+	if (vm->scheduler && vm->scheduler->worker_len > 1) pthread_mutex_unlock(&vm->scheduler->heap_lock);
+}
+
+void fiber_save(Vm *vm);
+
+/* Make `fiber` runnable on this worker and wake a parked one to take it */
+void scheduler_ready(Vm *vm, Fiber *fiber);
+
+/*
+ * Switch to the next runnable thread. When there is none left, the one
+ * that was waiting here finished on another worker and this one stops.
+ */
+void scheduler_switch(Vm *vm);
+
+/* The running code becomes green thread 1 and the other workers start parked */
+void scheduler_start(Vm *vm);
+
+/* Start the procedure at `pc` with `argc` bytes of arguments, returning its handle */
+uint64_t scheduler_spawn(Vm *vm, size_t pc, byte *args, size_t argc);
+
+/*
+ * Run the procedure at `pc` over `[start, end)` in chunks of `grain` and
+ * wait for all of them. Only one runner per worker is started, each takes
+ * chunks until there are none left.
+ */
+void scheduler_parfor(Vm *vm, size_t pc, uint64_t start, uint64_t end, uint64_t grain);
+
+/* Let the oldest runnable thread go first, the running one continues if there is none */
+void scheduler_yield(Vm *vm);
+
+void scheduler_join(Vm *vm, uint64_t handle);
+
+/* The running thread is done, load the next one. False once every thread has finished */
+bool scheduler_exit(Vm *vm);
+
+/* Once every thread has finished, give the vm its own stacks back */
+void scheduler_destroy(Vm *vm);
+
+#endif /* SCHEDULER_H */
@@ -0,0 +1,287 @@
+#define _XOPEN_SOURCE 700
+#define _XOPEN_SOURCE_EXTENDED
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "serve.h"
+#include "stream.h"
+
+static void serve_evict(ServeEntry *entry)
+{
+	context_destroy(&entry->context);
+	arena_destroy(entry->arena);
+	free(entry->src);
+	free(entry->path);
+	entry->used = 0;
+}
+
+/* Parse `path` into the least recently used slot */
+static ServeEntry *serve_parse(Serve *serve, const char *path, char *src, size_t len, uint64_t hash)
+{
+	ServeEntry *entry = &serve->entries[0];
+	for (size_t i = 1; i < SERVE_CACHE_LEN; ++i) {
+		if (serve->entries[i].used < entry->used) entry = &serve->entries[i];
+	}
+	if (entry->used) serve_evict(entry);
+
+	entry->path = xmalloc(strlen(path) + 1);
+	strcpy(entry->path, path);
+	Ctx *context = &entry->context;
+	context_init(context, entry->path);
+	context->data.huge_pages = serve->huge_pages;
+	context->workers = serve->workers;
+	if (serve->guard_pages) vm_guard_stacks(&context->vm);
+	entry->arena = arena_create(1024 * 32);
+
+	FILE *f = len ? fmemopen(src, len, "rb") : NULL;
+	int errcode = -1;
+	if (!f) {
+		fprintf(stderr, "%s: cannot open\n", path);
+	} else {
+		errcode = vm_commit_stacks(&context->vm, serve->stack);
+		if (!errcode) errcode = parse_src(context, entry->arena, entry->path, f, len);
+		if (fclose(f)) panic("Failed to close file\n");
+	}
+	if (errcode) {
+		entry->src = src;
+		serve_evict(entry);
+		return NULL;
+	}
+	entry->hash = hash;
+	entry->src = src;
+	entry->len = len;
+	entry->used = serve->requests;
+	return entry;
+}
+
+/* The cached program for `request`, parsing it on a miss. `parsed` tells which one happened */
+static ServeEntry *serve_load(Serve *serve, const char *request, bool *parsed)
+{
+	*parsed = false;
+	if (request[0] == '#') {
+		char *end = NULL;
+		uint64_t hash = strtoull(request + 1, &end, 16);
+		for (size_t i = 0; end != request + 1 && *end == '\0' && i < SERVE_CACHE_LEN; ++i) {
+			ServeEntry *entry = &serve->entries[i];
+			if (entry->used && entry->hash == hash) {
+				entry->used = serve->requests;
+				return entry;
+			}
+		}
+		fprintf(stderr, "%s: no program with this hash is cached\n", request);
+		return NULL;
+	}
+
+	size_t len;
+	char *src = read_file(request, &len);
+	if (!src) {
+		fprintf(stderr, "%s: cannot open\n", request);
+		return NULL;
+	}
+	uint64_t hash = map_hash_bytes((byte *) src, len);
+	for (size_t i = 0; i < SERVE_CACHE_LEN; ++i) {
+		ServeEntry *entry = &serve->entries[i];
+		if (entry->used && entry->hash == hash && entry->len == len && memcmp(entry->src, src, len) == 0) {
+			free(src);
+			entry->used = serve->requests;
+			return entry;
+		}
+	}
+	*parsed = true;
+	return serve_parse(serve, request, src, len, hash);
+}
+
+/*
+ * Run the program in a grandchild with the client's stdin, stdout and
+ * stderr. The child in between waits for it and sends the client its exit
+ * status, or 128 and the signal that killed it.
+ */
+static void serve_run(ServeEntry *entry, int conn, int fds[3], bool line)
+{
+	fflush(NULL);
+	pid_t pid = fork();
+	if (pid < 0) panic("Failed to fork\n");
+	if (pid > 0) return;
+
+	signal(SIGCHLD, SIG_DFL);
+	pid_t run = fork();
+	if (run == 0) {
+		close(conn);
+		for (int i = 0; i < 3; ++i) {
+			if (dup2(fds[i], i) < 0) _exit(1);
+			close(fds[i]);
+		}
+		vm_std_streams(&entry->context.vm);
+		if (line) {
+			size_t len;
+			char *input = read_stream(stdin, &len);
+			vm_push_input(&entry->context.vm, input, len);
+			free(input);
+		}
+		begin_execution(&entry->context);
+		exit(0);
+	}
+	int status = 1;
+	int wstatus;
+	if (run > 0 && waitpid(run, &wstatus, 0) == run) {
+		status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+	}
+	send(conn, &status, sizeof(status), MSG_NOSIGNAL);
+	_exit(0);
+}
+
+/* Read a request and the client's stdin, stdout and stderr passed along with it */
+static bool serve_receive(int conn, char request[SERVE_REQUEST_MAX], int fds[3])
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * 3)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { .iov_base = request, .iov_len = SERVE_REQUEST_MAX };
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	ssize_t got = recvmsg(conn, &msg, 0);
+
+	struct cmsghdr *cmsg = got > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return false;
+	size_t fd_len = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (fd_len < 3 ? fd_len : 3));
+	bool mode = request[0] == SERVE_STDIN || request[0] == SERVE_LINE;
+	if (fd_len != 3 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || got < 2 || !mode || request[got - 1] != '\0') {
+		for (size_t i = 0; i < fd_len && i < 3; ++i) close(fds[i]);
+		return false;
+	}
+	return true;
+}
+
+static void serve_request(Serve *serve, int conn)
+{
+	char request[SERVE_REQUEST_MAX];
+	int fds[3];
+	if (!serve_receive(conn, request, fds)) return;
+	++serve->requests;
+
+	/* Parse errors are the client's */
+	fflush(stderr);
+	int saved = dup(STDERR_FILENO);
+	dup2(fds[2], STDERR_FILENO);
+	bool parsed;
+	ServeEntry *entry = serve_load(serve, request + 1, &parsed);
+	fflush(stderr);
+	dup2(saved, STDERR_FILENO);
+	close(saved);
+
+	if (entry) {
+		if (parsed) fprintf(stderr, "cached %016" PRIx64 " %s\n", entry->hash, entry->path);
+		serve_run(entry, conn, fds, request[0] == SERVE_LINE);
+	} else {
+		int status = 1;
+		send(conn, &status, sizeof(status), MSG_NOSIGNAL);
+	}
+	for (int i = 0; i < 3; ++i) close(fds[i]);
+}
+
+static int unix_socket_addr(const char *path, struct sockaddr_un *addr)
+{
+	*addr = (struct sockaddr_un){0};
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int run_serve(Serve *serve, const char *path)
+{
+	struct sockaddr_un addr;
+	if (unix_socket_addr(path, &addr)) return -1;
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) panic("Failed to create socket\n");
+	/* A socket left behind by an earlier daemon */
+	unlink(path);
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) || listen(sock, SOMAXCONN)) {
+		fprintf(stderr, "%s: cannot listen: %s\n", path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+	/* The children that report a run's status are reaped by the kernel */
+	signal(SIGCHLD, SIG_IGN);
+
+	for (;;) {
+		int conn = accept(sock, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			panic("Failed to accept\n");
+		}
+		serve_request(serve, conn);
+		close(conn);
+	}
+	return 0;
+}
+
+int serve_connect(const char *path, const char *program, bool line)
+{
+	char request[SERVE_REQUEST_MAX];
+	request[0] = line ? SERVE_LINE : SERVE_STDIN;
+	if (program[0] == '#') {
+		if (strlen(program) >= sizeof(request) - 1) {
+			fprintf(stderr, "%s: not a program hash\n", program);
+			return 1;
+		}
+		strcpy(request + 1, program);
+	} else if (!realpath(program, request + 1)) {
+		fprintf(stderr, "%s: cannot find %s\n", path, program);
+		return 1;
+	}
+
+	struct sockaddr_un addr;
+	if (unix_socket_addr(path, &addr)) return 1;
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) panic("Failed to create socket\n");
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr))) {
+		fprintf(stderr, "%s: cannot connect: %s\n", path, strerror(errno));
+		close(sock);
+		return 1;
+	}
+
+	int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	union {
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct iovec iov = { .iov_base = request, .iov_len = strlen(request) + 1 };
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	int status = 1;
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 || recv(sock, &status, sizeof(status), MSG_WAITALL) != sizeof(status)) {
+		fprintf(stderr, "%s: the daemon hung up\n", path);
+		status = 1;
+	}
+	close(sock);
+	return status;
+}
@@ -0,0 +1,57 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <limits.h>
+
+#include "vm.h"
+
+/* Programs --serve keeps parsed */
+#define SERVE_CACHE_LEN 32
+/*
+ * A request is one of the input modes below, then a program path or `#`
+ * and its content hash
+ */
+#define SERVE_REQUEST_MAX (PATH_MAX + 2)
+/* The run reads the client's stdin itself, like a plain run */
+#define SERVE_STDIN 's'
+/* The run starts like a --batch job with all of the client's stdin as its line */
+#define SERVE_LINE 'l'
+
+typedef struct ServeEntry {
+	uint64_t hash;
+	/* What was parsed, a matching hash alone isn't enough to reuse it */
+	char *src;
+	size_t len;
+	char *path;
+	Ctx context;
+	Arena *arena;
+	/* Request it was last used for, 0 for a free slot */
+	uint64_t used;
+} ServeEntry;
+
+/*
+ * A --serve daemon. It parses a program once, then forks a child off the
+ * cached context for every run, so the child starts with the vm already
+ * set up and a crash only takes that run down.
+ */
+typedef struct Serve {
+	ServeEntry entries[SERVE_CACHE_LEN];
+	uint64_t requests;
+	/* Applied to every program like for a plain run */
+	bool huge_pages;
+	bool guard_pages;
+	size_t workers;
+	StackSizes stack;
+} Serve;
+
+/* Listen on the unix socket at `path` and answer requests until killed */
+int run_serve(Serve *serve, const char *path);
+
+/*
+ * Have the daemon at `path` run `program` on our stdin, stdout and stderr,
+ * returns its exit status. With `line` stdin is read up front and handed to
+ * the run as its input line.
+ */
+int serve_connect(const char *path, const char *program, bool line);
+
+#endif /* SERVE_H */
@@ -0,0 +1,237 @@
+#define _XOPEN_SOURCE 700
+#define _XOPEN_SOURCE_EXTENDED
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "stream.h"
+
+static void stream_init(Stream *stream, int fd, bool input)
+{
+	*stream = (Stream){
+		.fd = fd,
+		.input = input,
+		.line = !input && (fd == STDERR_FILENO || isatty(fd)),
+		.live = true,
+	};
+}
+
+/* Write all of `iov`, false with errno set when that fails */
+static bool stream_writev(Stream *stream, struct iovec *iov, int iovcnt)
+{
+	if (stream->file) {
+		for (int i = 0; i < iovcnt; ++i) {
+			if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, stream->file) != iov[i].iov_len) return false;
+		}
+		return true;
+	}
+	while (iovcnt) {
+		ssize_t n = writev(stream->fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		while (iovcnt && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt) {
+			iov->iov_base = (byte *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
+bool stream_flush(Stream *stream)
+{
+	if (stream->input || !stream->len || stream->hold) return true;
+	struct iovec iov = { stream->buf, stream->len };
+	stream->len = 0;
+	return stream_writev(stream, &iov, 1);
+}
+
+bool stream_write(Stream *stream, const void *src, size_t len)
+{
+	if (!stream->buf) stream->buf = xmalloc(STREAM_BUF);
+	if (stream->len + len <= STREAM_BUF) {
+		memcpy(stream->buf + stream->len, src, len);
+		stream->len += len;
+		return stream->line && memchr(src, '\n', len) ? stream_flush(stream) : true;
+	}
+	if (stream->hold) {
+		size_t cap = stream->cap > STREAM_BUF ? stream->cap : STREAM_BUF;
+		while (cap - stream->len < len) cap *= 2;
+		if (cap != stream->cap) stream->buf = xrealloc(stream->buf, cap);
+		stream->cap = cap;
+		memcpy(stream->buf + stream->len, src, len);
+		stream->len += len;
+		return true;
+	}
+	struct iovec iov[2] = { { stream->buf, stream->len }, { (void *) src, len } };
+	stream->len = 0;
+	return stream_writev(stream, iov, 2);
+}
+
+ssize_t stream_read(Stream *stream, byte *dst, size_t len)
+{
+	if (stream->pos < stream->len) {
+		size_t n = stream->len - stream->pos < len ? stream->len - stream->pos : len;
+		memcpy(dst, stream->buf + stream->pos, n);
+		stream->pos += n;
+		return n;
+	}
+	if (!stream->buf) stream->buf = xmalloc(STREAM_BUF);
+	struct iovec iov[2] = { { dst, len }, { stream->buf, STREAM_BUF } };
+	ssize_t n;
+	do n = readv(stream->fd, iov, 2);
+	while (n < 0 && errno == EINTR);
+	if (n < 0) return -1;
+	stream->pos = 0;
+	stream->len = (size_t) n > len ? n - len : 0;
+	return (size_t) n > len ? (ssize_t) len : n;
+}
+
+ssize_t stream_read_line(Stream *stream, byte *dst, size_t len)
+{
+	if (!stream->buf) stream->buf = xmalloc(STREAM_BUF);
+	size_t n = 0;
+	while (n < len) {
+		if (stream->pos == stream->len) {
+			ssize_t got;
+			do got = read(stream->fd, stream->buf, STREAM_BUF);
+			while (got < 0 && errno == EINTR);
+			if (got < 0) return -1;
+			if (got == 0) break;
+			stream->pos = 0;
+			stream->len = got;
+		}
+		byte *start = stream->buf + stream->pos;
+		size_t avail = stream->len - stream->pos < len - n ? stream->len - stream->pos : len - n;
+		byte *newline = memchr(start, '\n', avail);
+		size_t take = newline ? (size_t) (newline - start) + 1 : avail;
+		memcpy(dst + n, start, take);
+		stream->pos += take;
+		n += take;
+		if (newline) break;
+	}
+	return n;
+}
+
+bool stream_close(Stream *stream)
+{
+	bool ok = stream_flush(stream);
+	if (close(stream->fd) < 0 && ok) ok = false;
+	free(stream->buf);
+	*stream = (Stream){0};
+	return ok;
+}
+
+Stream *vm_stream(Vm *vm, uint64_t handle)
+{
+	Vm *home = vm->home;
+	if (handle == 0 || handle > home->stream_len || !home->streams[handle - 1].live) {
+		fprintf(stderr, "Invalid stream handle %" PRIu64 "\n", handle);
+		print_frames(vm);
+		abort();
+	}
+	return &home->streams[handle - 1];
+}
+
+Stream *vm_stream_dir(Vm *vm, uint64_t handle, bool input)
+{
+	Stream *stream = vm_stream(vm, handle);
+	if (stream->input != input) {
+		fprintf(stderr, "Stream %" PRIu64 " is not open for %s\n", handle, input ? "reading" : "writing");
+		print_frames(vm);
+		abort();
+	}
+	return stream;
+}
+
+void stream_failed(Vm *vm, uint64_t handle, const char *op)
+{
+	fprintf(stderr, "Failed to %s stream %" PRIu64 ": %s\n", op, handle, strerror(errno));
+	print_frames(vm);
+	abort();
+}
+
+uint64_t vm_open_stream(Vm *vm, const char *path, char mode)
+{
+	int flags;
+	switch (mode) {
+	case 'r': flags = O_RDONLY; break;
+	case 'w': flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+	case 'a': flags = O_WRONLY | O_CREAT | O_APPEND; break;
+	default:
+		fprintf(stderr, "Invalid stream mode '%c'\n", mode);
+		print_frames(vm);
+		abort();
+	}
+	int fd = open(path, flags | O_CLOEXEC, 0666);
+	if (fd < 0) return 0;
+	Vm *home = vm->home;
+	size_t i = STREAM_STD;
+	while (i < home->stream_len && home->streams[i].live) ++i;
+	if (i == home->stream_len) {
+		home->streams = xrealloc(home->streams, sizeof(*home->streams) * ++home->stream_len);
+	}
+	stream_init(&home->streams[i], fd, mode == 'r');
+	return i + 1;
+}
+
+void vm_flush_streams(Vm *vm)
+{
+	Vm *home = vm->home;
+	for (size_t i = 0; i < home->stream_len; ++i) {
+		if (home->streams[i].live) stream_flush(&home->streams[i]);
+	}
+}
+
+void vm_hold_streams(Vm *vm)
+{
+	Vm *home = vm->home;
+	for (size_t i = 0; i < home->stream_len; ++i) {
+		if (home->streams[i].live && !home->streams[i].input) home->streams[i].hold = true;
+	}
+}
+
+void vm_release_streams(Vm *vm, bool drop)
+{
+	Vm *home = vm->home;
+	for (size_t i = 0; i < home->stream_len; ++i) {
+		Stream *stream = &home->streams[i];
+		if (!stream->live) continue;
+		if (stream->hold && drop) stream->len = 0;
+		stream->hold = false;
+		stream_flush(stream);
+	}
+}
+
+void vm_clear_streams(Vm *vm)
+{
+	for (size_t i = 0; i < vm->stream_len; ++i) {
+		if (i < STREAM_STD) stream_flush(&vm->streams[i]);
+		else if (vm->streams[i].live) stream_close(&vm->streams[i]);
+	}
+	if (vm->stream_len > STREAM_STD) vm->stream_len = STREAM_STD;
+}
+
+void vm_std_streams(Vm *vm)
+{
+	for (int i = 0; i < STREAM_STD; ++i) {
+		free(vm->streams[i].buf);
+		stream_init(&vm->streams[i], i, i == STREAM_IN);
+	}
+}
+
+void vm_redirect(Vm *vm, FILE *out)
+{
+	stream_flush(&vm->streams[STREAM_OUT]);
+	vm->streams[STREAM_OUT].file = out;
+}
@@ -0,0 +1,78 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "vm.h"
+
+/* Bytes a stream buffers, a write that doesn't fit goes out with them in one writev */
+#define STREAM_BUF (64 * 1024)
+/* stdin, stdout and stderr come first in every vm's streams */
+#define STREAM_IN 0
+#define STREAM_OUT 1
+#define STREAM_ERR 2
+#define STREAM_STD 3
+
+/* A file descriptor and a buffer of the vm's own */
+typedef struct Stream {
+	int fd;
+	/* Output goes here instead of `fd` when set, --batch collects a job's this way */
+	FILE *file;
+	/* Allocated on first use */
+	byte *buf;
+	/* Pending output is `[0, len)`, unread input `[pos, len)` */
+	size_t pos;
+	size_t len;
+	bool input;
+	/* Flushed at every newline, for terminals and stderr */
+	bool line;
+	bool live;
+	/* Nothing goes out and `buf` grows to `cap` instead, see `vm_hold_streams` */
+	bool hold;
+	size_t cap;
+} Stream;
+
+bool stream_flush(Stream *stream);
+
+/* Buffer `len` bytes, or send them together with the buffer when they don't fit */
+bool stream_write(Stream *stream, const void *src, size_t len);
+
+/*
+ * Up to `len` bytes, from the buffer when it holds any. Otherwise one
+ * readv fills `dst` and reads ahead into the buffer. 0 at the end, -1
+ * with errno set on errors.
+ */
+ssize_t stream_read(Stream *stream, byte *dst, size_t len);
+
+/* Bytes up to and including the next newline, at most `len` of them. 0 at the end, -1 on errors */
+ssize_t stream_read_line(Stream *stream, byte *dst, size_t len);
+
+bool stream_close(Stream *stream);
+
+Stream *vm_stream(Vm *vm, uint64_t handle);
+
+/* The stream behind `handle` if it reads (or writes) in that direction */
+Stream *vm_stream_dir(Vm *vm, uint64_t handle, bool input);
+
+void stream_failed(Vm *vm, uint64_t handle, const char *op);
+
+/* Handle of `path` opened to read ('r'), write ('w') or append ('a') to, 0 when it can't be opened */
+uint64_t vm_open_stream(Vm *vm, const char *path, char mode);
+
+/* Errors are left for the next write to the stream to report */
+void vm_flush_streams(Vm *vm);
+
+/* Keep all output in the buffers until `vm_release_streams` */
+void vm_hold_streams(Vm *vm);
+
+/* Send what was held, or with `drop` throw it away */
+void vm_release_streams(Vm *vm, bool drop);
+
+/* Flush everything and close what the program opened, the standard streams stay */
+void vm_clear_streams(Vm *vm);
+
+/* Whatever fds 0, 1 and 2 are now, --serve points them at the client's */
+void vm_std_streams(Vm *vm);
+
+/* Send the program's output to `out` instead of stdout, NULL switches back */
+void vm_redirect(Vm *vm, FILE *out);
+
+#endif /* STREAM_H */
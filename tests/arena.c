@@ -0,0 +1,33 @@
+/* Allocations that fill a region up to its end, and ones that would pass it */
+#include <stdbool.h>
+#include <stdio.h>
+
+#define ARENA_IMPLEMENTATION
+#include "arena.h"
+
+static void check(Arena *arena, const char *what, size_t size, unsigned int alignment)
+{
+	size_t index = arena->index;
+	char *p = arena_alloc_aligned(arena, size, alignment);
+	if (!p) {
+		printf("%s: full, index %s\n", what, arena->index == index ? "kept" : "moved");
+		return;
+	}
+	bool inside = p >= arena->region && p + size <= arena->region + arena->size;
+	printf("%s: %s\n", what, inside ? "inside" : "PAST THE END");
+}
+
+int main(void)
+{
+	/* malloc'd, so the region starts aligned to 8 */
+	Arena *arena = arena_create(62);
+	check(arena, "60 bytes", 60, 1);
+	check(arena, "8 aligned past the end", 1, 8);
+	check(arena, "last 2 bytes", 2, 1);
+	check(arena, "one more", 1, 1);
+	arena_clear(arena);
+	check(arena, "all of it", 62, 8);
+	check(arena, "after all of it", 1, 8);
+	arena_destroy(arena);
+	return 0;
+}
@@ -0,0 +1,12 @@
+# Enough initialized declarations to grow the parse arenas many times over
+awk 'BEGIN {
+	print ".data"
+	for (i = 0; i < 150000; ++i) printf "    d%d dd %d, %d, %d, %d, %d, %d, %d, %d\n", i, i, i, i, i, i, i, i, i
+	print ".text"
+	print "    ppush d149999"
+	print "    pderef64"
+	print "    ulprint"
+	print "    cpush 10"
+	print "    cprint"
+}' > "$TMP/data.pissm"
+"$ASS" "$TMP/data.pissm"
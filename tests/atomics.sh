@@ -0,0 +1,242 @@
+# Each atomic op with and without its memory order, orders an op doesn't
+# take, counters raced on by four workers and a misaligned access
+cd "$TMP" || exit 1
+cat > ops.pissm <<'END'
+.data
+    w dd [1]
+    b dd [1]
+.text
+    ulpush 5
+    ppush w
+    astore64 release
+    ppush w
+    aload64 acquire
+    ulprint
+    pop64
+    cpush 32
+    cprint
+    pop8
+    ulpush 3
+    ppush w
+    aadd64
+    ulprint
+    pop64
+    cpush 32
+    cprint
+    pop8
+    ulpush 42
+    ppush w
+    axchg64 acq_rel
+    ulprint
+    pop64
+    cpush 32
+    cprint
+    pop8
+    ulpush 7
+    ulpush 9
+    ppush w
+    acas64 relaxed
+    ciprint
+    pop8
+    cpush 32
+    cprint
+    pop8
+    ulprint
+    pop64
+    cpush 32
+    cprint
+    pop8
+    ulpush 42
+    ulpush 9
+    ppush w
+    acas64 seq_cst
+    ciprint
+    pop8
+    cpush 32
+    cprint
+    pop8
+    ulprint
+    pop64
+    cpush 32
+    cprint
+    pop8
+    fence acquire
+    fence release
+    fence acq_rel
+    fence
+    ppush w
+    aload64 relaxed
+    ulprint
+    pop64
+    cpush 10
+    cprint
+    pop8
+    ; 8 bit ops wrap
+    cpush 250
+    ppush b
+    astore8 relaxed
+    cpush 10
+    ppush b
+    aadd8
+    ciprint
+    pop8
+    cpush 32
+    cprint
+    pop8
+    cpush 1
+    ppush b
+    axchg8
+    ciprint
+    pop8
+    cpush 32
+    cprint
+    pop8
+    cpush 1
+    cpush 2
+    ppush b
+    acas8
+    ciprint
+    pop8
+    cpush 32
+    cprint
+    pop8
+    ciprint
+    pop8
+    cpush 32
+    cprint
+    pop8
+    ; 32 bit ops, in the upper half of b
+    ipush -4
+    ppush b
+    ulpush 4
+    uladd
+    astore32
+    ipush 10
+    ppush b
+    ulpush 4
+    uladd
+    aadd32 acquire
+    iprint
+    pop32
+    cpush 32
+    cprint
+    pop8
+    ppush b
+    ulpush 4
+    uladd
+    aload32
+    iprint
+    pop32
+    cpush 10
+    cprint
+END
+"$ASS" ops.pissm
+
+cat > orders.pissm <<'END'
+.text
+    aload64 release
+    astore32 acquire
+    fence relaxed
+    aadd8 sometimes
+    acas64 acq_rel extra
+    aload8 acq_rel
+    astore64 acq_rel
+END
+"$ASS" orders.pissm
+echo "exit $?"
+
+# Four threads add 1 10000 times each, with aadd32 and with an acas64 retry loop
+cat > race.pissm <<'END'
+.data
+    added dd [1]
+    swapped dd [1]
+.text
+    spawn count 0
+    store64 0
+    spawn count 0
+    store64 8
+    spawn count 0
+    store64 16
+    spawn count 0
+    store64 24
+    load64 0
+    join
+    load64 8
+    join
+    load64 16
+    join
+    load64 24
+    join
+    ppush added
+    aload32 acquire
+    iprint
+    pop32
+    cpush 32
+    cprint
+    pop8
+    ppush swapped
+    aload64 acquire
+    ulprint
+    pop64
+    cpush 10
+    cprint
+    jump end
+count:
+    ulpush 0
+    store64 0
+loop:
+    load64 0
+    ulpush 10000
+    ulclt
+    jumpcmp add
+    pop8
+    pop64
+    pop64
+    ret 0
+add:
+    pop8
+    pop64
+    pop64
+    ipush 1
+    ppush added
+    aadd32 relaxed
+    pop32
+retry:
+    ppush swapped
+    aload64 relaxed
+    store64 8
+    load64 8
+    load64 8
+    ulpush 1
+    uladd
+    ppush swapped
+    acas64 acq_rel
+    jumpcmp next
+    pop8
+    pop64
+    yield
+    jump retry
+next:
+    pop8
+    pop64
+    load64 0
+    ulpush 1
+    uladd
+    store64 0
+    yield
+    jump loop
+end:
+END
+"$ASS" --workers 1 race.pissm
+"$ASS" --workers 4 race.pissm
+
+cat > misaligned.pissm <<'END'
+.data
+    w dd [2]
+.text
+    ppush w
+    ulpush 4
+    uladd
+    aload64
+END
+sh -c '"$ASS" misaligned.pissm 2>&1 | sed "s/at 0x[0-9a-f]*/at .../"' 2>/dev/null
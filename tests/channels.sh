@@ -0,0 +1,263 @@
+# Messages one at a time and in runs on one worker and on four, receives
+# after a close, and the errors of sending on a closed channel and of
+# freeing one that threads wait on
+cd "$TMP" || exit 1
+cat > single.pissm <<'END'
+.text
+	ulpush 2
+	ulpush 8
+	chnew
+	store64 0
+	load64 0
+	spawn produce 8
+	store64 8
+	ulpush 8
+	alloc
+	store64 16
+recv:
+	load64 0
+	load64 16
+	chrecv
+	jumpcmp got
+	pop8
+	load64 0
+	load64 16
+	chrecv
+	ciprint
+	cpush 10
+	cprint
+	load64 8
+	join
+	load64 0
+	chfree
+	jump end
+got:
+	pop8
+	load64 16
+	pderef64
+	ulprint
+	pop64
+	cpush 32
+	cprint
+	pop8
+	jump recv
+; Sends 1 to 5, then closes
+produce:
+	ulpush 8
+	alloc
+	store64 8
+	ulpush 1
+	store64 16
+send:
+	load64 16
+	ulpush 5
+	ulcle
+	jumpcmp next
+	pop8
+	pop64
+	pop64
+	load64 0
+	chclose
+	ret 0
+next:
+	pop8
+	pop64
+	pop64
+	load64 16
+	load64 8
+	pset64
+	load64 0
+	load64 8
+	chsend
+	load64 16
+	ulpush 1
+	uladd
+	store64 16
+	jump send
+end:
+END
+"$ASS" --workers 1 single.pissm
+"$ASS" --workers 4 single.pissm
+
+# 100 messages of 4 bytes go in runs of 10 through room for 8, and come out up to 16 at a time
+cat > runs.pissm <<'END'
+.text
+	ulpush 8
+	ulpush 4
+	chnew
+	store64 0
+	load64 0
+	spawn produce 8
+	store64 8
+	ulpush 64
+	alloc
+	store64 16
+	ulpush 0
+	store64 24
+	ulpush 0
+	store64 32
+recv:
+	load64 0
+	load64 16
+	ulpush 16
+	chrecvn
+	ulpush 0
+	ulceq
+	jumpcmp closed
+	pop8
+	pop64
+	store64 40
+	load64 24
+	load64 40
+	uladd
+	store64 24
+	ulpush 0
+	store64 48
+add:
+	load64 48
+	load64 40
+	ulclt
+	jumpcmp one
+	pop8
+	pop64
+	pop64
+	jump recv
+one:
+	pop8
+	pop64
+	pop64
+	ulpush 0
+	store64 56
+	load64 16
+	load64 48
+	ulpush 4
+	ulmult
+	uladd
+	pderef32
+	store32 56
+	load64 32
+	load64 56
+	uladd
+	store64 32
+	load64 48
+	ulpush 1
+	uladd
+	store64 48
+	jump add
+closed:
+	pop8
+	pop64
+	pop64
+	load64 24
+	ulprint
+	cpush 32
+	cprint
+	pop8
+	load64 32
+	ulprint
+	cpush 10
+	cprint
+	load64 8
+	join
+	jump end
+; Sends 0 to 99, ten at a time
+produce:
+	ulpush 40
+	alloc
+	store64 8
+	ulpush 0
+	store64 16
+fill:
+	load64 16
+	ulpush 100
+	ulclt
+	jumpcmp more
+	pop8
+	pop64
+	pop64
+	load64 0
+	chclose
+	ret 0
+more:
+	pop8
+	pop64
+	pop64
+	ulpush 0
+	store64 24
+run:
+	load64 24
+	ulpush 10
+	ulclt
+	jumpcmp put
+	pop8
+	pop64
+	pop64
+	load64 0
+	load64 8
+	ulpush 10
+	chsendn
+	jump fill
+put:
+	pop8
+	pop64
+	pop64
+	load64 16
+	store64 32
+	load32 32
+	load64 8
+	load64 24
+	ulpush 4
+	ulmult
+	uladd
+	pset32
+	load64 16
+	ulpush 1
+	uladd
+	store64 16
+	load64 24
+	ulpush 1
+	uladd
+	store64 24
+	jump run
+end:
+END
+"$ASS" --workers 1 runs.pissm
+"$ASS" --workers 4 runs.pissm
+
+cat > closed.pissm <<'END'
+.text
+	ulpush 1
+	ulpush 8
+	chnew
+	store64 0
+	load64 0
+	chclose
+	load64 0
+	ulpush 8
+	alloc
+	chsend
+END
+sh -c '"$ASS" closed.pissm 2>&1 | cat' 2>/dev/null
+
+# The receiver parks before the main thread frees its channel
+cat > parked.pissm <<'END'
+.text
+	ulpush 1
+	ulpush 8
+	chnew
+	store64 0
+	load64 0
+	spawn wait 8
+	yield
+	load64 0
+	chfree
+	jump end
+wait:
+	load64 0
+	ulpush 8
+	alloc
+	chrecv
+	ret 0
+end:
+END
+sh -c '"$ASS" --workers 1 parked.pissm 2>&1 | cat' 2>/dev/null
@@ -0,0 +1,31 @@
+# Externs call C functions of the process, printf through its variadic prototype
+cd "$TMP" || exit 1
+cat > ffi.pissm <<'END'
+.data
+    puts extern
+    printf extern variadic
+    msg db "from puts", 0
+    fmt db "%s %ld %lx", 10, 0
+    word db "printf", 0
+.text
+    ppush msg
+    jumpproc puts 8
+    pop64
+    ppush fmt
+    ppush word
+    ulpush -42
+    ulpush 255
+    jumpproc printf 32
+    ulprint
+    cpush 10
+    cprint
+END
+"$ASS" ffi.pissm
+
+cat > empty.pissm <<'END'
+.data
+    printf extern variadic
+.text
+    jumpproc printf 0
+END
+sh -c '"$ASS" empty.pissm 2>&1 | cat' 2>/dev/null
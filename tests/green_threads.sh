@@ -0,0 +1,135 @@
+# spawn, yield and join on one worker and on four, joining a thread that has
+# already finished, and threads that only wait on each other
+cd "$TMP" || exit 1
+cat > sums.pissm <<'END'
+.data
+out dd [3]
+.text
+	ulpush 0
+	spawn sum 8
+	store64 0
+	ulpush 1
+	spawn sum 8
+	store64 8
+	ulpush 2
+	spawn sum 8
+	store64 16
+	load64 0
+	join
+	load64 8
+	join
+	load64 16
+	join
+	load64 8
+	join
+	ppush out
+	pderef64
+	ulprint
+	pop64
+	cpush 32
+	cprint
+	ppush out
+	ulpush 8
+	uladd
+	pderef64
+	ulprint
+	pop64
+	cpush 32
+	cprint
+	ppush out
+	ulpush 16
+	uladd
+	pderef64
+	ulprint
+	pop64
+	cpush 10
+	cprint
+	jump end
+; Adds up i + n for i below 1000, yielding on every step
+sum:
+	ulpush 0
+	store64 8
+	ulpush 0
+	store64 16
+loop:
+	load64 8
+	ulpush 1000
+	ulclt
+	jumpcmp body
+	pop8
+	pop64
+	pop64
+	load64 16
+	ppush out
+	load64 0
+	ulpush 8
+	ulmult
+	uladd
+	pset64
+	ret 0
+body:
+	pop8
+	pop64
+	pop64
+	load64 16
+	load64 8
+	uladd
+	load64 0
+	uladd
+	store64 16
+	load64 8
+	ulpush 1
+	uladd
+	store64 8
+	yield
+	jump loop
+end:
+END
+"$ASS" --workers 1 sums.pissm
+"$ASS" --workers 4 sums.pissm
+
+# yield is fair, one worker takes turns in spawn order
+cat > turns.pissm <<'END'
+.text
+	cpush 65
+	spawn say 1
+	store64 0
+	cpush 66
+	spawn say 1
+	store64 8
+	load64 0
+	join
+	load64 8
+	join
+	cpush 10
+	cprint
+	jump end
+say:
+	load8 0
+	cprint
+	yield
+	load8 0
+	cprint
+	yield
+	load8 0
+	cprint
+	ret 0
+end:
+END
+"$ASS" --workers 1 turns.pissm
+
+# The main thread is handle 1
+cat > deadlock.pissm <<'END'
+.text
+	ulpush 0
+	spawn wait 8
+	join
+	jump end
+wait:
+	ulpush 1
+	join
+	ret 0
+end:
+END
+sh -c '"$ASS" --workers 1 deadlock.pissm 2>&1 | cat' 2>/dev/null
+sh -c '"$ASS" --workers 4 deadlock.pissm 2>&1 | cat' 2>/dev/null
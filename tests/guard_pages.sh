@@ -0,0 +1,44 @@
+# Guard page faults are reported like the checked stacks report them
+cd "$TMP" || exit 1
+cat > underflow.pissm <<'END'
+    ipush 7
+    iprint
+    pop64
+    ipush 5
+    iadd
+    iprint
+    cpush 10
+    cprint
+END
+"$ASS" --guard-pages underflow.pissm
+
+# Pops are still checked, this one reaches further down than the guard
+cat > wide.pissm <<'END'
+.data
+    buf db [131072]
+.text
+    ppush buf
+    pset 131072
+    cpush 10
+    cprint
+END
+"$ASS" --guard-pages wide.pissm
+
+# Buffered output goes out before the report. The shells report the abort to /dev/null
+cat > recurse.pissm <<'END'
+    jump _start
+down:
+    jumpproc down 0
+_start:
+    cpush 65
+    cprint
+    jumpproc down 0
+END
+sh -c '"$ASS" --guard-pages recurse.pissm 2>&1 | cat' 2>/dev/null
+
+cat > push.pissm <<'END'
+loop:
+    ulpush 1
+    jump loop
+END
+sh -c '"$ASS" --guard-pages push.pissm 2>&1 | cat' 2>/dev/null
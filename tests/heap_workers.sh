@@ -0,0 +1,122 @@
+# Green threads on 4 workers allocate and free through their caches, blocks move between workers as they yield
+cd "$TMP" || exit 1
+cat > heap.pissm <<'END'
+.data
+out dd [8]
+.text
+	ulpush 0
+	spawn worker 8
+	store64 0
+	ulpush 1
+	spawn worker 8
+	store64 8
+	ulpush 2
+	spawn worker 8
+	store64 16
+	ulpush 3
+	spawn worker 8
+	store64 24
+	load64 0
+	join
+	load64 8
+	join
+	load64 16
+	join
+	load64 24
+	join
+	ppush out
+	pderef64
+	ulprint
+	pop64
+	ppush out
+	ulpush 8
+	uladd
+	pderef64
+	ulprint
+	pop64
+	ppush out
+	ulpush 16
+	uladd
+	pderef64
+	ulprint
+	pop64
+	ppush out
+	ulpush 24
+	uladd
+	pderef64
+	ulprint
+	pop64
+	cpush 10
+	cprint
+	jump end
+worker:
+	ulpush 24
+	alloc
+	store64 8
+	load64 0
+	load64 8
+	pset64
+	ulpush 0
+	store64 16
+	ulpush 0
+	store64 24
+loop:
+	load64 16
+	ulpush 20000
+	ulclt
+	jumpcmp body
+	pop8
+	pop64
+	pop64
+	jump done
+body:
+	pop8
+	pop64
+	pop64
+	load64 16
+	ulpush 50
+	ulmod
+	ulpush 8
+	ulmult
+	ulpush 24
+	uladd
+	alloc
+	store64 32
+	load64 0
+	load64 32
+	pset64
+	ulpush 300
+	alloc
+	store64 40
+	load64 8
+	pderef64
+	load64 24
+	uladd
+	store64 24
+	load64 8
+	free
+	load64 40
+	free
+	load64 32
+	store64 8
+	load64 16
+	ulpush 1
+	uladd
+	store64 16
+	yield
+	jump loop
+done:
+	load64 8
+	free
+	load64 24
+	ppush out
+	load64 0
+	ulpush 8
+	ulmult
+	uladd
+	pset64
+	ret 0
+end:
+END
+"$ASS" --workers 4 heap.pissm
+"$ASS" --workers 4 --arena-stats heap.pissm 2>&1 | grep allocs
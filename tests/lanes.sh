@@ -0,0 +1,124 @@
+# --lanes prints what one job at a time prints, with the lanes taking
+# different sides of a jumpcmp on every byte and at the end, and a last
+# group that doesn't fill all the lanes
+cd "$TMP" || exit 1
+cat > lines.txt <<'END'
+87e1958c9a5i7hg5
+752ehe62acf8bjai5923284e1dbe5gi3j36
+817838h0ai9f0788dg8ijdc55
+1c3eaj
+3db99b2807i6hbjacd97bg3j9ieb
+01e2246297d96i3hj3i6j7
+a380a298eb04119i5a8ba1
+4j890f1f019ij2da8
+j6hih0f3d
+900h4fc
+g84ihdb6g08fi0c918e3j6
+413j383b3ega59637h
+46j
+0hc8jdhbb6g38ba5df6jha673b9d0ei75b1
+gd7dfhiea582bih
+9663b50abebdbc5bc6
+50f0c1228j1ig03de7a2c8fb14972b93b
+50334ahg7i8c3h3ea017id4d
+2d087d8a5eh2b6c8d2fa0dad5j8jcb866h
+chfh492i1921
+END
+# The sum of the digits and the number of letters, then whether the sum is even
+cat > split.pissm <<'END'
+.text
+    store64 8
+    store64 0
+    ulpush 0
+    store64 16
+    ulpush 0
+    store64 24
+loop:
+    load64 8
+    ulpush 0
+    ulcgt
+    jumpcmp byte
+    pop8
+    pop64
+    pop64
+    jump done
+byte:
+    pop8
+    pop64
+    pop64
+    load64 0
+    pderef8
+    cpush 57
+    ccle
+    jumpcmp digit
+    pop8
+    pop8
+    pop8
+    load64 24
+    ulpush 1
+    uladd
+    store64 24
+    jump next
+digit:
+    pop8
+    pop8
+    cpush 48
+    csub
+    ulpush 0
+    store64 32
+    store8 32
+    load64 16
+    load64 32
+    uladd
+    store64 16
+next:
+    load64 0
+    ulpush 1
+    uladd
+    store64 0
+    load64 8
+    ulpush 1
+    ulsub
+    store64 8
+    jump loop
+done:
+    load64 16
+    ulprint
+    pop64
+    cpush 32
+    cprint
+    pop8
+    load64 24
+    ulprint
+    pop64
+    cpush 32
+    cprint
+    pop8
+    load64 16
+    ulpush 2
+    ulmod
+    ulpush 0
+    ulceq
+    jumpcmp even
+    pop8
+    pop64
+    pop64
+    fpush 0.5
+    fprint
+    pop32
+    jump end
+even:
+    pop8
+    pop64
+    pop64
+    cpush 101
+    cprint
+    pop8
+end:
+    cpush 10
+    cprint
+END
+"$ASS" --batch lines.txt -j 1 split.pissm > one.txt
+cat one.txt
+"$ASS" --batch lines.txt --lanes 8 split.pissm | cmp one.txt - && echo "--lanes 8 the same"
+"$ASS" --batch lines.txt -j 1 --lanes 16 split.pissm | cmp one.txt - && echo "--lanes 16 the same"
@@ -0,0 +1,2 @@
+# parfor.pissm again, on four workers
+"$ASS" --workers 4 tests/parfor.pissm
@@ -0,0 +1,57 @@
+# --pipeline lets output out while the rest is still being parsed and calls
+# externs, --pipeline-hold prints nothing but the errors of a broken program
+cd "$TMP" || exit 1
+cat > head.pissm <<'END'
+.text
+    cpush 65
+    cprint
+    cpush 10
+    cprint
+    ulpush 2
+    sflush
+END
+mkfifo prog
+"$ASS" --pipeline - < prog > streamed 2>&1 &
+exec 3> prog
+cat head.pissm >&3
+for i in $(seq 100); do
+	[ -s streamed ] && break
+	sleep 0.1
+done
+echo "before the parse ended: $(cat streamed)"
+printf '    bogus\n' >&3
+exec 3>&-
+wait $!
+echo "exit $?"
+cat streamed
+
+cat > broken.pissm <<'END'
+.text
+    cpush 65
+    cprint
+    cpush 10
+    cprint
+    bogus
+END
+"$ASS" --pipeline-hold broken.pissm
+echo "exit $?"
+
+cat > extern.pissm <<'END'
+.data
+    puts extern
+    msg db "from puts", 0
+.text
+    cpush 65
+    cprint
+    cpush 10
+    cprint
+    ppush msg
+    jumpproc puts 8
+    pop64
+    cpush 66
+    cprint
+    cpush 10
+    cprint
+END
+"$ASS" --pipeline extern.pissm
+echo "exit $?"
@@ -0,0 +1,74 @@
+/* A host of libpiss: calls in, failed calls and a native that calls back in */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "piss.h"
+
+static const char *src =
+	".data\n"
+	"    twice extern\n"
+	".text\n"
+	"    jump main\n"
+	"add:\n"
+	"    load32 0\n"
+	"    load32 4\n"
+	"    iadd\n"
+	"    ret32\n"
+	"quad:\n"
+	"    load64 0\n"
+	"    jumpproc twice 8\n"
+	"    jumpproc twice 8\n"
+	"    ret64\n"
+	"noret:\n"
+	"    ipush 1\n"
+	"main:\n";
+
+/* Doubles its argument with the program's own add */
+static size_t twice(Piss *piss, void *user, const void *args, size_t argc, void *ret)
+{
+	int *calls = user;
+	++*calls;
+	uint64_t x;
+	memcpy(&x, args, sizeof(x));
+	int32_t pair[2] = { (int32_t) x, (int32_t) x };
+	int32_t sum = 0;
+	if (argc != sizeof(x) || piss_call(piss, piss_lookup(piss, "add"), pair, sizeof(pair), &sum, sizeof(sum))) {
+		return 0;
+	}
+	x = (uint64_t) sum;
+	memcpy(ret, &x, sizeof(x));
+	return sizeof(x);
+}
+
+int main(void)
+{
+	Piss *piss = piss_load_buffer("<host>", src, strlen(src));
+	if (!piss) return 1;
+	int calls = 0;
+	printf("register twice: %d\n", piss_register(piss, "twice", twice, &calls));
+	printf("register nope: %d\n", piss_register(piss, "nope", twice, NULL));
+	printf("lookup missing: %s\n", piss_lookup(piss, "missing") == PISS_NO_PROC ? "none" : "found");
+
+	int32_t args[2] = { 2, 40 }, sum = 0;
+	int status = piss_call(piss, piss_lookup(piss, "add"), args, sizeof(args), &sum, sizeof(sum));
+	printf("add: %d, %d\n", status, sum);
+
+	uint64_t x = 5, quad = 0;
+	status = piss_call(piss, piss_lookup(piss, "quad"), &x, sizeof(x), &quad, sizeof(quad));
+	printf("quad: %d, %llu, %d natives\n", status, (unsigned long long) quad, calls);
+
+	fflush(stdout);
+	status = piss_call(piss, piss_lookup(piss, "noret"), NULL, 0, NULL, 0);
+	printf("noret: %d\n", status);
+	fflush(stdout);
+	uint64_t wide = 0;
+	status = piss_call(piss, piss_lookup(piss, "add"), args, sizeof(args), &wide, sizeof(wide));
+	printf("add for 8 bytes: %d\n", status);
+
+	/* Still usable after the failed calls */
+	status = piss_call(piss, piss_lookup(piss, "add"), args, sizeof(args), &sum, sizeof(sum));
+	printf("add again: %d, %d\n", status, sum);
+	piss_free(piss);
+	return 0;
+}
@@ -0,0 +1,13 @@
+# A write to initialized data is reported after the output so far
+cd "$TMP" || exit 1
+cat > rodata.pissm <<'END'
+.data
+    answer dd 42
+.text
+    cpush 65
+    cprint
+    ulpush 7
+    ppush answer
+    pset64
+END
+sh -c '"$ASS" rodata.pissm 2>&1 | cat' 2>/dev/null
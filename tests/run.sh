@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Regression tests, run from the repository root after ./x
+#
+#   tests/run.sh [path/to/ass]
+#
+# name.pissm is assembled and run, name.sh runs with $ASS set and name.c
+# is built against the sources, and linked with the libpiss.so next to
+# ass when it includes piss.h. What each prints to stdout and stderr, then
+# its exit status when that isn't 0, must match name.out.
+
+ASS=${1:-./ass}
+# Absolute, the scripts may cd into $TMP
+ASS=$(cd "$(dirname "$ASS")" && pwd)/$(basename "$ASS")
+LIB=$(dirname "$ASS")
+CC=${CC:-cc}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+export ASS TMP
+
+failed=0
+for test in tests/*.pissm tests/*.sh tests/*.c; do
+	[ -e "$test" ] || continue
+	name=${test%.*}
+	[ "$test" = tests/run.sh ] && continue
+	case $test in
+	*.pissm) "$ASS" "$test" > "$TMP/out" 2>&1 < /dev/null ;;
+	*.sh) sh "$test" > "$TMP/out" 2>&1 < /dev/null ;;
+	*.c)
+		libs=
+		grep -q '#include "piss.h"' "$test" && libs="-L$LIB -Wl,-rpath,$LIB -lpiss"
+		if ! $CC -std=c99 -I. -o "$TMP/test" "$test" $libs > "$TMP/out" 2>&1; then
+			echo "FAIL $test (build)"
+			cat "$TMP/out"
+			failed=$((failed + 1))
+			continue
+		fi
+		"$TMP/test" > "$TMP/out" 2>&1 < /dev/null ;;
+	esac
+	status=$?
+	[ $status -ne 0 ] && echo "exit $status" >> "$TMP/out"
+	if cmp -s "$TMP/out" "$name.out"; then
+		echo "ok   $test"
+	else
+		echo "FAIL $test"
+		diff "$name.out" "$TMP/out" | head -20
+		failed=$((failed + 1))
+	fi
+done
+
+[ $failed -eq 0 ] || { echo "$failed failed"; exit 1; }
@@ -0,0 +1,53 @@
+# --connect runs on the daemon with our stdin as it is, the second run of a
+# program is a cache hit and --stdin-line hands stdin over as a batch line.
+# A run that aborts reports 128 and the signal
+cd "$TMP" || exit 1
+cat > cat.pissm <<'END'
+.data
+    buf db [64]
+.text
+loop:
+    ulpush 1
+    ppush buf
+    ulpush 64
+    sread
+    store64 0
+    load64 0
+    ulpush 0
+    ulceq
+    jumpcmp done
+    pop8
+    pop64
+    pop64
+    ulpush 2
+    ppush buf
+    load64 0
+    swrite
+    jump loop
+done:
+END
+cat > len.pissm <<'END'
+    ulprint
+    cpush 10
+    cprint
+END
+"$ASS" --serve s.sock 2> serve.log &
+pid=$!
+for i in $(seq 100); do
+	[ -S s.sock ] && break
+	sleep 0.1
+done
+printf 'hello\nworld\n' | "$ASS" --connect s.sock cat.pissm
+echo "exit $?"
+printf 'again\n' | "$ASS" --connect s.sock cat.pissm
+echo "exit $?"
+printf 'four' | "$ASS" --connect s.sock --stdin-line len.pissm
+echo "exit $?"
+printf '    ulpush 9\n    chfree\n' > crash.pissm
+"$ASS" --connect s.sock crash.pissm < /dev/null > crash.log 2>&1
+status=$?
+sed "s|$PWD/||" crash.log
+echo "exit $status"
+kill $pid
+wait $pid 2>/dev/null
+sed 's/cached [0-9a-f]* .*\//cached /' serve.log
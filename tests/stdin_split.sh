@@ -0,0 +1,10 @@
+# A regular file on stdin big enough to be parsed in chunks, with no path to reopen
+awk 'BEGIN {
+	print ".text"
+	print "    ulpush 0"
+	for (i = 0; i < 200000; ++i) printf "    ulpush 1\n    uladd\n"
+	print "    ulprint"
+	print "    cpush 10"
+	print "    cprint"
+}' > "$TMP/big.pissm"
+"$ASS" - < "$TMP/big.pissm"
@@ -0,0 +1,11 @@
+# An edit that jumps to a missing label is reported once, with its row
+cd "$TMP" || exit 1
+printf '.text\n    cpush 65\n    cprint\n    cpush 10\n    cprint\n' > watch.pissm
+"$ASS" --watch watch.pissm > watch.log 2>&1 &
+pid=$!
+sleep 1
+printf '.text\n    cpush 65\n    cprint\n    jump nowhere\n    cpush 10\n    cprint\n' > watch.pissm
+sleep 1
+kill $pid
+wait $pid 2>/dev/null
+cat watch.log
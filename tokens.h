@@ -11,7 +11,7 @@ TOK(T_CLOSE_BRACKET X_ENUM(= ']'))
 TOK(T_EOL           X_ENUM(= '\n'))
 #undef X_ENUM
 
-#define INSTR(x, _) TOK(T_##x)
+#define INSTR(x, ...) TOK(T_##x)
 #include "instructions.h"
 #undef INSTR
 
@@ -20,6 +20,7 @@ TOK(T_LABEL)
 
 TOK(T_SECTION_DATA)
 TOK(T_SECTION_TEXT)
+TOK(T_DIRECTIVE_STACK)
 
 TOK(T_IDENT)
 TOK(T_UINUMLIT) // Unsigned int literal (8-bytes)
@@ -38,12 +39,13 @@ TOK(T_ILLEGAL)
 #endif
 
 #ifdef TOK_KW
-#define INSTR(x, str) TOK_KW(T_##x, str)
+#define INSTR(x, str, ...) TOK_KW(T_##x, str)
 #include "instructions.h"
 #undef INSTR
 
 TOK_KW(T_SECTION_DATA, ".data")
 TOK_KW(T_SECTION_TEXT, ".text")
+TOK_KW(T_DIRECTIVE_STACK, ".stack")
 
 TOK_KW(T_EXTERN, "extern")
 
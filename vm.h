@@ -0,0 +1,302 @@
+#ifndef VM_H
+#define VM_H
+
+/*
+ * What the interpreter and the subsystems around it share: the stacks,
+ * data segment and heap, the vm a program runs in and the context that
+ * holds the assembled program. Each subsystem has its own header that
+ * includes this one.
+ */
+
+#include <pthread.h>
+#include <setjmp.h>
+
+#include "ass.h"
+#include "parser.h"
+#include "piss.h"
+
+typedef struct FramePointer {
+	byte *ptr;
+	byte *return_stack_ptr;
+	byte *start;
+	/* `local_storage`, or this frame's slot in the sandbox */
+	byte *locals;
+	byte local_storage[LOCAL_SIZE];
+	struct FramePointer *prev;
+} FramePointer;
+
+/*
+ * An operand or return stack. The whole range up to `end` is reserved so
+ * the stack never moves and popped operands stay valid; pages are only
+ * committed up to `limit`, which doubles whenever a push crosses it.
+ */
+typedef struct Stack {
+	byte *base;
+	byte *limit;
+	byte *end;
+} Stack;
+
+/* Frames shown when a stack overflows */
+#define STACK_REPORT_FRAMES 8
+/* PROT_NONE pages on both ends of every stack, for --guard-pages */
+#define STACK_GUARD (1024 * 64)
+
+typedef struct DataRegion {
+	byte *base;
+	size_t len;
+	/* Reserved address space, only touched pages are committed */
+	size_t cap;
+} DataRegion;
+
+/*
+ * Every .data declaration, laid out in declaration order.
+ *
+ * Initialized declarations go in `rodata`, which holds no pointers and is
+ * sealed read-only once the program is assembled, so an image of it could
+ * be mapped straight from a file. Zero-filled ones go in `bss`, whose pages
+ * are only committed when first touched. Both regions are reserved up
+ * front and never move, so code can run while declarations are placed.
+ */
+typedef struct DataSegment {
+	DataRegion rodata;
+	DataRegion bss;
+	/* Declarations mapped from files, left alone when the program re-runs */
+	DataRegion files;
+	bool huge_pages;
+} DataSegment;
+
+#define DATA_RESERVE_MAX ((size_t) 1 << 36)
+#define DATA_RESERVE_MIN ((size_t) 1 << 24)
+/* Zero-filled declarations this large start on a huge page boundary with --huge-pages */
+#define DATA_HUGE_PAGE (1024 * 1024 * 2)
+
+enum HeapChunkKind {
+	HEAP_UNUSED,
+	HEAP_SLAB,
+	HEAP_LARGE,
+};
+
+typedef struct HeapChunk {
+	enum HeapChunkKind kind;
+	uint8_t class;
+	/* Chunks in a large block, set on its first chunk */
+	size_t run;
+	/* One bit per block of a slab that is handed out */
+	uint64_t *used;
+} HeapChunk;
+
+typedef struct HeapClass {
+	/* Freed blocks, as offsets from the heap base */
+	size_t *free;
+	size_t free_len;
+	size_t free_cap;
+	/* Blocks of the newest slab never handed out */
+	size_t next;
+	size_t end;
+
+	size_t allocs;
+	size_t live;
+} HeapClass;
+
+typedef struct HeapRun {
+	size_t chunk;
+	size_t run;
+} HeapRun;
+
+/* Block sizes of the slabs double from HEAP_MIN_CLASS, anything larger gets whole chunks */
+#define HEAP_CLASSES 10
+#define HEAP_MIN_CLASS 16
+#define HEAP_CHUNK (1024 * 64)
+
+/*
+ * Memory for alloc, free and realloc. Small blocks come from slabs of a
+ * single size class, large ones get their own chunks, which go back to
+ * the kernel when freed. All bookkeeping lives outside the heap, so a
+ * program scribbling over its blocks can't steer the allocator, even
+ * under --sandbox. Every context owns its heap. With more than one worker
+ * the free lists and large blocks are only touched under the scheduler's
+ * heap lock, the `used` bitmaps are updated atomically so the workers'
+ * HeapCaches can hand out and take back blocks without it.
+ */
+typedef struct Heap {
+	DataRegion region;
+	/* Indexed by offset / HEAP_CHUNK, reserved for the whole region so it never moves */
+	HeapChunk *chunks;
+	size_t chunk_cap;
+	HeapClass classes[HEAP_CLASSES];
+	/* Freed large blocks, reused first fit */
+	HeapRun *runs;
+	size_t run_len;
+	size_t run_cap;
+
+	size_t live;
+	size_t peak;
+	size_t large_allocs;
+	size_t large_live;
+} Heap;
+
+/* Free blocks a worker keeps per size class, it trades half of them with the heap at a time */
+#define HEAP_CACHE_BLOCKS 64
+
+/*
+ * Free blocks of the shared heap that one worker hands out and takes back
+ * without the heap lock. They stay unused in the slab bitmaps. What the
+ * worker allocated and freed is added to the heap's counts whenever it
+ * takes the lock anyway, so the peak is only sampled then.
+ */
+typedef struct HeapCache {
+	size_t blocks[HEAP_CLASSES][HEAP_CACHE_BLOCKS];
+	size_t len[HEAP_CLASSES];
+	size_t allocs[HEAP_CLASSES];
+	/* Wraps below zero while blocks other workers allocated are freed here */
+	size_t live[HEAP_CLASSES];
+} HeapCache;
+
+/* Chunk `k` of the channel table holds CHANNEL_CHUNK << k channels and never moves */
+#define CHANNEL_CHUNK 16
+#define CHANNEL_CHUNKS 32
+
+/*
+ * One run of a program, everything its instructions write. The program
+ * and its declarations stay untouched, so any number of these can run
+ * the same `Ctx` at once.
+ */
+typedef struct Vm {
+	Stack stack;
+	Stack return_stack;
+	FramePointer *frame_ptr;
+	size_t pc;
+
+	Heap heap;
+	/* Handle `i + 1` names `maps[i]`, 0 is never a map */
+	struct Map *maps;
+	size_t map_len;
+	/* Handle `i + 1` names channel `i`, looked up without a lock, see `channel_slot` */
+	struct Channel **channels[CHANNEL_CHUNKS];
+	size_t channel_len;
+	/* Freed while other workers ran, see `vm_free_channel` */
+	struct Channel *retired;
+	/*
+	 * Zero-filled data of its own, pointers into the program's `bss` at
+	 * `bss_origin` are moved here by ppush. Empty for the vm that writes
+	 * the program's own.
+	 */
+	DataRegion bss;
+	byte *bss_origin;
+	/* Stack bounds are caught by `stack_fault` rather than checked */
+	bool guarded;
+	/* Where the running instruction started, an underflow goes back there through `fault_jump` */
+	FramePointer *fault_frame;
+	byte *fault_ptr;
+	sigjmp_buf *fault_jump;
+	/* Pointers are offsets from here with --sandbox, NULL when they are host addresses */
+	byte *sandbox;
+	/* Handle `i + 1` names `streams[i]`, the print instructions write to STREAM_OUT */
+	struct Stream *streams;
+	size_t stream_len;
+
+	/* Whose heap, maps, channels and streams the instructions use, itself unless this is a worker of a scheduler */
+	struct Vm *home;
+	/* Set by the first `spawn` */
+	struct Scheduler *scheduler;
+	/* The green thread loaded into the registers above */
+	struct Fiber *fiber;
+	size_t worker;
+	uint32_t tick;
+
+	/* What it runs, for diagnostics and `sync` */
+	struct Ctx *context;
+} Vm;
+
+/* An assembled program and its data, with the vm a single run uses */
+typedef struct Ctx {
+	Vm vm;
+
+	const char *path;
+	Program program;
+	/* The parser thread may still reallocate `program` under --pipeline */
+	bool parsing;
+	/* Declarations were placed in the sandbox of `vm` */
+	byte *sandbox;
+	/* Threads green threads run on */
+	size_t workers;
+	DataSegment data;
+
+	/* Arenas owned by parse workers other than the first */
+	Arena **arenas;
+	size_t arena_len;
+
+	/* Only kept by --watch */
+	struct SourceMap *source_map;
+
+	/* Indexed by the callext instructions */
+	struct Extern *externs;
+	size_t extern_len;
+	size_t extern_cap;
+
+	/* Largest lexer scratch arena of any parse, for --arena-stats */
+	size_t scratch_peak;
+} Ctx;
+
+/*
+ * Report the innermost frames instead of the stack contents. Also flushes
+ * the program's output, held or not, the callers abort right after.
+ */
+void print_frames(Vm *vm);
+
+void stack_init(Stack *stack, size_t size, size_t reserve);
+
+void stack_destroy(Stack *stack);
+
+/* Give every block of `cache` back, once its worker has stopped */
+void heap_cache_drain(Heap *heap, HeapCache *cache);
+
+void vm_run(Vm *vm, Program *program);
+
+/* NULL when the heap is out of address space */
+byte *heap_alloc(Heap *heap, size_t len);
+
+void vm_print_u64(Vm *vm, uint64_t n);
+
+void vm_print_i64(Vm *vm, int64_t n);
+
+void vm_print_char(Vm *vm, char c);
+
+void vm_print_float(Vm *vm, double f);
+
+void vm_init(Vm *vm, Ctx *context);
+
+/* Give the vm zero-filled data of its own, laid out like the program's */
+void vm_private_bss(Vm *vm, DataRegion *bss);
+
+/* Back to a fresh run, the stacks and the heap's address space are kept */
+void vm_reset(Vm *vm);
+
+void vm_destroy(Vm *vm);
+
+void stack_sizes_max(StackSizes *a, StackSizes b);
+
+/* Commit what the command line or the program's `.stack` directives asked for */
+int vm_commit_stacks(Vm *vm, StackSizes sizes);
+
+void vm_guard_stacks(Vm *vm);
+
+/* Copy `input` to the vm's heap and start with a pointer to it and its 8 byte length on the stack */
+void vm_push_input(Vm *vm, const char *input, size_t len);
+
+/* Also keys the --serve cache by program content */
+uint64_t map_hash_bytes(const byte *bytes, size_t len);
+
+void context_init(Ctx *context, const char *path);
+
+void context_destroy(Ctx *context);
+
+/* Assemble `len` bytes of `file`, LEXER_UNBOUNDED when it is a pipe, into the context */
+int parse_src(Ctx *context, Arena *arena, const char *filename, FILE *file, const size_t len);
+
+void begin_execution(Ctx *context);
+
+/* Push `argc` bytes of arguments and run the procedure at `pc` until it returns past the end of the program */
+void vm_call_proc(Vm *vm, Program *program, size_t pc, const void *args, size_t argc);
+
+#endif /* VM_H */